@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Microbenchmarks for mysh: lexer, builtin dispatch, process launch,
+# conditionals and builtin output.
+#
+#   ./bench/run.sh ./mysh              time one binary
+#   ./bench/run.sh ./mysh-release ./mysh
+#                                      time both and print the speedup of
+#                                      the second over the first
+#
+# Each bench/*.msh file is a handful of representative lines; it is
+# repeated REPEAT times into a temporary script so that the shell's own
+# per-line cost dominates start-up.  The best of RUNS runs is reported,
+# and for a single binary also the number of processes the script forked.
+
+REPEAT=${REPEAT:-2000}
+RUNS=${RUNS:-5}
+BENCHES=${BENCHES:-"lexer dispatch launch cond echo"}
+DIR=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 BINARY [BINARY]" >&2
+    exit 1
+fi
+
+# Scale the slow launch benchmark down so a full run stays short.
+repeat_for() {
+    case $1 in
+        launch) echo $((REPEAT / 20)) ;;
+        *) echo "$REPEAT" ;;
+    esac
+}
+
+for b in $BENCHES; do
+    n=$(repeat_for "$b")
+    for ((i = 0; i < n; i++)); do
+        cat "$DIR/$b.msh"
+    done > "$TMP/$b.msh"
+done
+
+# best_ns BINARY SCRIPT -> fastest wall time in nanoseconds
+best_ns() {
+    local best=0 start end t
+    for ((r = 0; r < RUNS; r++)); do
+        start=$(date +%s%N)
+        (cd "$DIR/.." && "$1" "$2" > /dev/null 2>&1 < /dev/null)
+        end=$(date +%s%N)
+        t=$((end - start))
+        if [ $best -eq 0 ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+    done
+    echo $best
+}
+
+# forks BINARY SCRIPT -> processes (and threads) the script's shell and
+# its descendants started, less those of running an empty script.  Counted
+# with strace where it is installed, else as the last pid handed out in a
+# PID namespace of the script's own; "-" when neither can be had.
+forks_of() {
+    if command -v strace > /dev/null; then
+        (cd "$DIR/.." && strace -f -c -o "$TMP/strace.out" -e trace=clone,clone3,fork,vfork \
+            "$1" "$2" > /dev/null 2>&1 < /dev/null)
+        awk '$NF == "total" {n = $4} END {print n + 0}' "$TMP/strace.out"
+    else
+        # Pids in the new namespace count up from 1; the constant few
+        # around the shell cancel out against the empty script's
+        local userns=
+        [ "$(id -u)" -ne 0 ] && userns=-r
+        (cd "$DIR/.." && unshare $userns -p -f --mount-proc sh -c \
+            '"$1" "$2" > /dev/null 2>&1 < /dev/null; cat /proc/sys/kernel/ns_last_pid' \
+            sh "$1" "$2") 2> /dev/null
+    fi
+}
+: > "$TMP/empty.msh"
+forks() {
+    local n empty
+    n=$(forks_of "$1" "$2")
+    empty=$(forks_of "$1" "$TMP/empty.msh")
+    if [ -n "$n" ] && [ -n "$empty" ]; then
+        echo $((n - empty))
+    else
+        echo -
+    fi
+}
+
+bin1=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+if [ $# -ge 2 ]; then
+    bin2=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+    printf "%-10s %8s %12s %12s %8s\n" bench lines "$(basename "$1")" "$(basename "$2")" speedup
+else
+    printf "%-10s %8s %12s %8s\n" bench lines "$(basename "$1")" forks
+fi
+
+for b in $BENCHES; do
+    lines=$(wc -l < "$TMP/$b.msh")
+    t1=$(best_ns "$bin1" "$TMP/$b.msh")
+    if [ -n "$bin2" ]; then
+        t2=$(best_ns "$bin2" "$TMP/$b.msh")
+        awk -v b="$b" -v n="$lines" -v t1="$t1" -v t2="$t2" 'BEGIN {
+            printf "%-10s %8d %10.2fms %10.2fms %7.3fx\n", b, n, t1 / 1e6, t2 / 1e6, t1 / t2
+        }'
+    else
+        awk -v b="$b" -v n="$lines" -v t1="$t1" -v f="$(forks "$bin1" "$TMP/$b.msh")" 'BEGIN {
+            printf "%-10s %8d %10.2fms %8s\n", b, n, t1 / 1e6, f
+        }'
+    fi
+done
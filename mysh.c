@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,325 +7,9301 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/kcmp.h>
+#include <linux/futex.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <stddef.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/mount.h>
+#include <linux/seccomp.h>
+#include <linux/filter.h>
+#include <linux/audit.h>
 
 #define MAX_LEN 1024
 #define DELIM " \t\r\n\a"
+#define IFS " \t\n"
+
+extern char **environ;
 
 // Function prototypes
 int handle_cd(char **args);
 int handle_pwd(char **args);
 int handle_exit(char **args);
 int handle_which(char **args);
-char **split_line_and_expand_wildcards(char *line);
+int handle_true(char **args);
+int handle_false(char **args);
+int handle_test(char **args);
+int handle_echo(char **args);
+int handle_printf(char **args);
+int handle_cat(char **args);
+int handle_memo(char **args);
+int handle_export(char **args);
+int handle_unset(char **args);
+int handle_history(char **args);
+int handle_jobs(char **args);
+int handle_wait(char **args);
+int handle_ulimit(char **args);
+int handle_stats(char **args);
+int handle_coproc(char **args);
+int handle_read(char **args);
+int handle_break(char **args);
+int handle_return(char **args);
+int handle_shift(char **args);
+char **expand_tokens(char **raw);
 int execute_command(char **args);
-int launch_process(char **args);
+struct rec_iter;
+int stream_glob(char **args, struct rec_iter *it);
+int stream_filter(char **args, struct rec_iter *it);
+int stream_parallel(char **args, struct rec_iter *it);
+int stream_walk(char **args, struct rec_iter *it);
+int call_builtin(int builtin, char **args);
+void err_printf(const char *fmt, ...);
+void err_perror(const char *what);
+struct launch_opts;
+int launch_process(char **args, char **envp, const struct launch_opts *opts);
+int dispatch_command(char **args, int nassign, char **command, struct launch_opts *opts);
+extern bool exec_in_place;
+struct stage;
+void close_redirections(struct stage *st);
+int run_line(char *line);
+struct function;
+struct function *function_find(const char *name);
+int run_function(struct function *f, char **args);
 int last_exit_status = 0;
 
-// List of built-in command names and corresponding functions
-char *builtin_str[] = {"cd", "pwd", "exit", "which"};
-int (*builtin_func[]) (char **) = {&handle_cd, &handle_pwd, &handle_exit, &handle_which};
+// Builtin may run in-process where a subshell is expected (e.g. $(pwd)):
+// it has no effect on shell state besides its output and status.
+#define BUILTIN_PURE 0x1
+// Builtin's output comes from its own children, so it ends a run of
+// in-process pipeline stages.
+#define BUILTIN_SINK 0x2
+// Builtin's output is bytes rather than lines (cat of a binary file, echo
+// -n), so it is not made a record stage; in a pipeline it runs in a forked
+// shell of its own.
+#define BUILTIN_RAW 0x4
+
+// List of built-in commands and corresponding functions.  Record builtins
+// have a stream function instead, which makes them an iterator over
+// records in a pipeline.
+struct builtin {
+    const char *name;
+    int (*func)(char **);
+    int flags;
+    int (*stream)(char **args, struct rec_iter *it);
+};
+
+struct builtin builtins[] = {
+    {"cd", &handle_cd, 0},
+    {"pwd", &handle_pwd, BUILTIN_PURE},
+    {"exit", &handle_exit, 0},
+    {"which", &handle_which, BUILTIN_PURE},
+    {"true", &handle_true, BUILTIN_PURE},
+    {"false", &handle_false, BUILTIN_PURE},
+    {"test", &handle_test, BUILTIN_PURE},
+    {"[", &handle_test, BUILTIN_PURE},
+    {"echo", &handle_echo, BUILTIN_PURE | BUILTIN_RAW},
+    {"printf", &handle_printf, BUILTIN_PURE | BUILTIN_RAW},
+    {"cat", &handle_cat, BUILTIN_PURE | BUILTIN_RAW},
+    {"export", &handle_export, 0},
+    {"unset", &handle_unset, 0},
+    {"history", &handle_history, BUILTIN_PURE},
+    {"jobs", &handle_jobs, 0},
+    {"wait", &handle_wait, 0},
+    {"ulimit", &handle_ulimit, 0},
+    {"stats", &handle_stats, BUILTIN_PURE},
+    {"coproc", &handle_coproc, 0},
+    {"read", &handle_read, 0},
+    {"break", &handle_break, 0},
+    {"continue", &handle_break, 0},
+    {"return", &handle_return, 0},
+    {"shift", &handle_shift, 0},
+    {"memo", &handle_memo, BUILTIN_PURE | BUILTIN_RAW},
+    {"glob", NULL, BUILTIN_PURE, &stream_glob},
+    {"filter", NULL, BUILTIN_PURE, &stream_filter},
+    {"parallel", NULL, BUILTIN_SINK, &stream_parallel},
+    {"walk", NULL, BUILTIN_PURE, &stream_walk},
+};
+
+int num_builtins() {
+    return sizeof(builtins) / sizeof(builtins[0]);
+}
+
+void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (!p) {
+        fprintf(stderr, "allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (!p) {
+        fprintf(stderr, "allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// ---------------------------------------------------------------------------
+// Arena: a bump allocator for everything that only lives as long as one
+// command line (tokens, expanded words).  arena_reset() drops it all at once.
+// ---------------------------------------------------------------------------
+
+#define ARENA_BLOCK 8192
+
+struct arena_block {
+    struct arena_block *next;
+    size_t used, size;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct arena {
+    struct arena_block *head;
+};
+
+struct arena line_arena;
+
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    struct arena_block *b = a->head;
+    if (b == NULL || b->size - b->used < n) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = xmalloc(sizeof(*b) + size);
+        b->size = size;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+// A point in an arena to go back to, freeing everything allocated since.
+struct arena_mark {
+    struct arena_block *head;
+    size_t used;
+};
+
+struct arena_mark arena_mark(struct arena *a) {
+    return (struct arena_mark){a->head, a->head ? a->head->used : 0};
+}
+
+void arena_release(struct arena *a, struct arena_mark m) {
+    while (a->head != m.head) {
+        struct arena_block *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+    if (a->head != NULL) {
+        a->head->used = m.used;
+    }
+}
+
+// Frees every block except one default-sized block, which is kept for reuse.
+void arena_reset(struct arena *a) {
+    struct arena_block *keep = NULL;
+    struct arena_block *b = a->head;
+    while (b != NULL) {
+        struct arena_block *next = b->next;
+        if (keep == NULL && b->size == ARENA_BLOCK) {
+            keep = b;
+        } else {
+            free(b);
+        }
+        b = next;
+    }
+    if (keep != NULL) {
+        keep->used = 0;
+        keep->next = NULL;
+    }
+    a->head = keep;
+}
+
+// Growable string used while building words.
+struct strbuf {
+    char *data;
+    size_t len, cap;
+};
+
+void sb_append(struct strbuf *sb, const char *s, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        sb->cap = sb->cap ? sb->cap * 2 : 64;
+        while (sb->len + n + 1 > sb->cap) {
+            sb->cap *= 2;
+        }
+        sb->data = xrealloc(sb->data, sb->cap);
+    }
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_putc(struct strbuf *sb, char c) {
+    sb_append(sb, &c, 1);
+}
+
+// Growable NULL-terminated argument vector.
+struct argv_buf {
+    char **v;
+    int n, cap;
+};
+
+// Output buffer that grows inside an arena, used to capture the output of
+// command substitutions.
+struct capture {
+    char *data;
+    size_t len, cap;
+};
+
+void capture_reserve(struct arena *a, struct capture *c, size_t n) {
+    if (c->len + n + 1 > c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 65536;
+        while (c->len + n + 1 > cap) {
+            cap *= 2;
+        }
+        char *data = arena_alloc(a, cap);
+        if (c->len) {
+            memcpy(data, c->data, c->len);
+        }
+        c->data = data;
+        c->cap = cap;
+    }
+}
+
+// The shell's own output.  Everything it writes to stdout and stderr
+// itself (builtin output, messages, job notices, the prompt) is queued
+// here in order, so the two streams interleave as written even when they
+// share a file.  The queue goes out in writev() calls at fixed points:
+// before a child is started, before input is read, at the end of a line,
+// and when it is full.  On a terminal a stream is also flushed at each
+// newline, as stdio does.  When stderr is the very same open file as
+// stdout (2>&1, or one terminal), messages are queued as stdout, so a
+// line's output and errors go out in a single write.
+#define OUT_QUEUE_SIZE 65536
+#define OUT_SEGMENTS 64
+#define OUT_DIRECT 8192     // writes this large are not copied
+
+struct out_queue {
+    char buf[OUT_QUEUE_SIZE];
+    size_t len;
+    struct iovec iov[OUT_SEGMENTS];     // into buf, or a direct write
+    int fd[OUT_SEGMENTS];
+    int n;
+    bool line_flush[3];                 // by fd: it is a terminal
+    bool shared;                        // stderr is stdout's open file
+} outq;
+
+// Writes out all of iov[0..n).
+void writev_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done < 0) {
+            return;     // nothing sensible to do if the reader is gone
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+// Writes the queue out: one writev() per run of segments for the same fd.
+void out_flush(void) {
+    for (int i = 0; i < outq.n;) {
+        int j = i + 1;
+        while (j < outq.n && outq.fd[j] == outq.fd[i]) {
+            j++;
+        }
+        writev_all(outq.fd[i], outq.iov + i, j - i);
+        i = j;
+    }
+    outq.n = 0;
+    outq.len = 0;
+}
+
+// Queues n bytes for fd: stdout, stderr, or a file a builtin writes to
+// until it is done with it.  A large write goes straight from s,
+// in the same writev() as what was queued before it.
+void out_queue(int fd, const char *s, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (fd == STDERR_FILENO && outq.shared) {
+        fd = STDOUT_FILENO;
+    }
+    if (outq.n == OUT_SEGMENTS || (n < OUT_DIRECT && outq.len + n > OUT_QUEUE_SIZE)) {
+        out_flush();
+    }
+    if (n >= OUT_DIRECT) {
+        outq.iov[outq.n] = (struct iovec){(void *)s, n};
+        outq.fd[outq.n++] = fd;
+        out_flush();
+        return;
+    }
+    char *at = outq.buf + outq.len;
+    struct iovec *last = outq.n > 0 ? &outq.iov[outq.n - 1] : NULL;
+    if (last != NULL && outq.fd[outq.n - 1] == fd && (char *)last->iov_base + last->iov_len == at) {
+        last->iov_len += n;
+    } else {
+        outq.iov[outq.n] = (struct iovec){at, n};
+        outq.fd[outq.n++] = fd;
+    }
+    memcpy(at, s, n);
+    outq.len += n;
+    if (fd <= STDERR_FILENO && outq.line_flush[fd] && memchr(s, '\n', n) != NULL) {
+        out_flush();
+    }
+}
+
+// Where builtins write their output: stdout, or a capture buffer while a
+// builtin runs in-process for a command substitution.
+struct capture *builtin_capture = NULL;
+
+void out_write(const char *s, size_t n) {
+    if (builtin_capture != NULL) {
+        capture_reserve(&line_arena, builtin_capture, n);
+        memcpy(builtin_capture->data + builtin_capture->len, s, n);
+        builtin_capture->len += n;
+    } else {
+        out_queue(STDOUT_FILENO, s, n);
+    }
+}
+
+void out_vprintf(int fd, const char *fmt, va_list ap) {
+    char buf[1024];
+    va_list again;
+    va_copy(again, ap);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    char *text = buf;
+    if (n >= 0 && (size_t)n >= sizeof(buf)) {
+        text = xmalloc(n + 1);
+        vsnprintf(text, n + 1, fmt, again);
+    }
+    va_end(again);
+    if (n > 0 && fd == STDOUT_FILENO) {
+        out_write(text, n);
+    } else if (n > 0) {
+        out_queue(fd, text, n);
+    }
+    if (text != buf) {
+        free(text);
+    }
+}
+
+void out_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    out_vprintf(STDOUT_FILENO, fmt, ap);
+    va_end(ap);
+}
+
+// A message from the shell, on stderr in order with its stdout.
+void err_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    out_vprintf(STDERR_FILENO, fmt, ap);
+    va_end(ap);
+}
+
+// perror() through the queue.
+void err_perror(const char *what) {
+    err_printf("%s: %s\n", what, strerror(errno));
+}
+
+void argv_push(struct argv_buf *av, char *s) {
+    if (av->n + 2 > av->cap) {
+        av->cap = av->cap ? av->cap * 2 : 64;
+        av->v = xrealloc(av->v, av->cap * sizeof(char *));
+    }
+    av->v[av->n++] = s;
+    av->v[av->n] = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Shell variables.
+//
+// Variables live in an open-addressed table with linear probing.  Each slot
+// keeps the hash next to the entry so a probe rarely has to touch the string,
+// and the entry itself is stored as "NAME=value" so that exported variables
+// can be handed to execve() as-is.  The envp array is rebuilt lazily: it is
+// reused for every launch until an exported variable changes.
+// ---------------------------------------------------------------------------
+
+enum { VAR_EMPTY, VAR_USED, VAR_DELETED };
+
+struct var {
+    uint32_t hash;
+    uint16_t name_len;
+    uint8_t state;
+    bool exported;
+    bool readonly;        // assignments and unset are refused
+    char *entry;          // "NAME=value", or just "NAME" when declared but unset
+    size_t size;          // allocated for entry
+};
+
+struct var_table {
+    struct var *slots;
+    size_t cap;           // always a power of two
+    size_t used;          // live entries
+    size_t deleted;       // tombstones
+};
+
+struct var_table vars;
+char **env_cache = NULL;
+bool env_dirty = true;
+
+uint32_t hash_bytes(const char *s, size_t n) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool is_name_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool is_name_char(char c) {
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+// Returns the slot holding name, or the slot where it would be inserted.
+struct var *var_slot(const char *name, size_t len, uint32_t hash) {
+    size_t mask = vars.cap - 1;
+    struct var *tomb = NULL;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct var *v = &vars.slots[i];
+        if (v->state == VAR_EMPTY) {
+            return tomb ? tomb : v;
+        }
+        if (v->state == VAR_DELETED) {
+            if (!tomb) {
+                tomb = v;
+            }
+        } else if (v->hash == hash && v->name_len == len && memcmp(v->entry, name, len) == 0) {
+            return v;
+        }
+    }
+}
+
+void var_grow(void) {
+    struct var *old = vars.slots;
+    size_t old_cap = vars.cap;
+    vars.cap = old_cap ? old_cap * 2 : 64;
+    vars.slots = calloc(vars.cap, sizeof(struct var));
+    if (!vars.slots) {
+        fprintf(stderr, "allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    vars.deleted = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].state == VAR_USED) {
+            *var_slot(old[i].entry, old[i].name_len, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+struct var *var_lookup(const char *name, size_t len) {
+    if (vars.cap == 0) {
+        return NULL;
+    }
+    struct var *v = var_slot(name, len, hash_bytes(name, len));
+    return v->state == VAR_USED ? v : NULL;
+}
+
+// Value of a variable, or NULL when it is not set.
+const char *var_get_n(const char *name, size_t len) {
+    struct var *v = var_lookup(name, len);
+    if (v == NULL || v->entry[len] != '=') {
+        return NULL;
+    }
+    return v->entry + len + 1;
+}
+
+const char *var_get(const char *name) {
+    return var_get_n(name, strlen(name));
+}
+
+// Sets name to value (value may be NULL to declare without a value).  export
+// is 1 to export, 0 to leave the flag alone.  Returns false, with a message,
+// if the variable is read-only.
+bool var_set_n(const char *name, size_t len, const char *value, int export) {
+    if ((vars.used + vars.deleted + 1) * 4 > vars.cap * 3) {
+        var_grow();
+    }
+    uint32_t hash = hash_bytes(name, len);
+    struct var *v = var_slot(name, len, hash);
+    size_t vlen = value ? strlen(value) : 0;
+    size_t need = len + vlen + 2;
+
+    if (v->state == VAR_USED && v->readonly && (value || !export)) {
+        err_printf("mysh: %.*s: readonly variable\n", (int)len, name);
+        return false;
+    }
+    if (v->state == VAR_USED && !value && v->entry[len] == '=') {
+        // "export NAME" on a set variable keeps the value
+    } else if (v->state == VAR_USED && v->size >= need) {
+        // Rebound in place, as a loop variable is on every iteration
+        if (value) {
+            v->entry[len] = '=';
+            memmove(v->entry + len + 1, value, vlen + 1);
+        } else {
+            v->entry[len] = '\0';
+        }
+    } else {
+        char *entry = xmalloc(need);
+        memcpy(entry, name, len);
+        if (value) {
+            entry[len] = '=';
+            memcpy(entry + len + 1, value, vlen + 1);
+        } else {
+            entry[len] = '\0';
+        }
+        if (v->state == VAR_USED) {
+            free(v->entry);
+        } else {
+            if (v->state == VAR_DELETED) {
+                vars.deleted--;
+            }
+            v->state = VAR_USED;
+            v->hash = hash;
+            v->name_len = len;
+            v->exported = false;
+            v->readonly = false;
+            vars.used++;
+        }
+        v->entry = entry;
+        v->size = need;
+    }
+    if (export) {
+        v->exported = true;
+    }
+    if (v->exported) {
+        env_dirty = true;
+    }
+    return true;
+}
+
+bool var_set(const char *name, const char *value, int export) {
+    return var_set_n(name, strlen(name), value, export);
+}
+
+bool var_unset(const char *name) {
+    struct var *v = var_lookup(name, strlen(name));
+    if (v == NULL) {
+        return true;
+    }
+    if (v->readonly) {
+        err_printf("mysh: %s: readonly variable\n", name);
+        return false;
+    }
+    if (v->exported) {
+        env_dirty = true;
+    }
+    free(v->entry);
+    v->entry = NULL;
+    v->state = VAR_DELETED;
+    vars.used--;
+    vars.deleted++;
+    return true;
+}
+
+// Makes name read-only for the rest of the shell's life, declaring it if
+// it is not set.
+void var_make_readonly(const char *name) {
+    struct var *v = var_lookup(name, strlen(name));
+    if (v == NULL) {
+        var_set(name, NULL, 0);
+        v = var_lookup(name, strlen(name));
+    }
+    v->readonly = true;
+}
+
+// Positional parameters: $0, and $1... which a function call replaces for
+// its duration.  A call's arguments are copied into arg_arena and released
+// again when it returns.
+struct params {
+    const char *zero;
+    char **argv;
+    int argc;
+} params = {"mysh"};
+
+struct arena arg_arena;
+
+const char *param_get(int i) {
+    return i == 0 ? params.zero : i <= params.argc ? params.argv[i - 1] : NULL;
+}
+
+// envp for child processes; shared between launches until a change.
+char **env_get(void) {
+    if (!env_dirty) {
+        return env_cache;
+    }
+    size_t n = 0;
+    env_cache = xrealloc(env_cache, (vars.used + 1) * sizeof(char *));
+    for (size_t i = 0; i < vars.cap; i++) {
+        struct var *v = &vars.slots[i];
+        if (v->state == VAR_USED && v->exported && v->entry[v->name_len] == '=') {
+            env_cache[n++] = v->entry;
+        }
+    }
+    env_cache[n] = NULL;
+    env_dirty = false;
+    return env_cache;
+}
+
+void import_environment(void) {
+    for (char **e = environ; *e != NULL; e++) {
+        char *eq = strchr(*e, '=');
+        if (eq != NULL && eq != *e) {
+            var_set_n(*e, eq - *e, eq + 1, 1);
+        }
+    }
+}
+
+// "NAME=..." with a valid name
+bool is_assignment(const char *word) {
+    if (!is_name_start(word[0])) {
+        return false;
+    }
+    const char *p = word + 1;
+    while (is_name_char(*p)) {
+        p++;
+    }
+    return *p == '=';
+}
+
+
+// ---------------------------------------------------------------------------
+// Command history.
+//
+// History is an append-only file ($HISTFILE, default ~/.mysh_history) of
+// framed records:
+//
+//     magic (4) | len (4) | text (len) | len (4)
+//
+// Each record is appended with a single write() on an O_APPEND descriptor,
+// so concurrent shells interleave whole records.  The trailing length lets
+// recall walk backwards from the end of the file.  The file is mmap'd rather
+// than read, so opening it costs the same for ten entries or ten million;
+// the mapping is refreshed when the file has grown.  When the file cannot be
+// opened the same records are kept in memory instead.
+//
+// Searching uses a trigram index over the distinct entries, built on the
+// first search and extended incrementally afterwards.  Posting lists are
+// delta-encoded varints of entry ids, so a query only verifies entries that
+// contain every trigram of the query.
+// ---------------------------------------------------------------------------
+
+#define HIST_MAGIC 0x5453484du      // "MHST"
+#define HIST_OVERHEAD 12
+
+struct hist_entry {
+    uint32_t off;                   // latest record with this text
+    uint32_t hash;
+};
+
+struct hist_trigram {
+    uint32_t key;                   // three bytes + 1, 0 marks an empty slot
+    uint32_t count;
+    uint32_t last_id;
+    struct strbuf postings;
+};
+
+struct history {
+    bool opened;
+    int fd;                         // -1 when kept in memory
+    char *base;                     // mapping of the file (or mem.data)
+    size_t len;
+    struct strbuf mem;
+    char *last;                     // previous entry, to skip repeats
+
+    // search index
+    size_t indexed;                 // bytes of history covered by the index
+    struct hist_entry *entries;
+    size_t nentries, entries_cap;
+    uint32_t (*entry_slots)[2];     // open-addressed {hash, entry id + 1}
+    size_t entry_cap;
+    struct hist_trigram *trigrams;
+    size_t trigram_cap, ntrigrams;
+
+    // result of the last search, most recent first
+    char *query;
+    uint32_t *results;
+    size_t nresults;
+};
+
+struct history hist = {.fd = -1};
+
+uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Maps whatever has been appended to the file since the last call.
+void history_refresh(void) {
+    if (hist.fd < 0) {
+        hist.base = hist.mem.data;
+        hist.len = hist.mem.len;
+        return;
+    }
+    off_t size = lseek(hist.fd, 0, SEEK_END);
+    if (size < 0 || (size_t)size == hist.len) {
+        return;
+    }
+    if (hist.base != NULL) {
+        munmap(hist.base, hist.len);
+    }
+    hist.base = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, hist.fd, 0) : NULL;
+    hist.len = hist.base == MAP_FAILED ? 0 : size;
+    if (hist.base == MAP_FAILED) {
+        hist.base = NULL;
+    }
+}
+
+void history_open(void) {
+    if (hist.opened) {
+        return;
+    }
+    hist.opened = true;
+    const char *path = var_get("HISTFILE");
+    char buf[1024];
+    if (path == NULL && var_get("HOME") != NULL) {
+        snprintf(buf, sizeof(buf), "%s/.mysh_history", var_get("HOME"));
+        path = buf;
+    }
+    if (path != NULL && *path != '\0') {
+        hist.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+    history_refresh();
+}
+
+// Offset of the record that ends at off, or -1 at the start of history.
+long history_prev(size_t off) {
+    if (off < HIST_OVERHEAD) {
+        return -1;
+    }
+    uint32_t len = get_u32(hist.base + off - 4);
+    if (len > off - HIST_OVERHEAD) {
+        return -1;
+    }
+    size_t start = off - HIST_OVERHEAD - len;
+    if (get_u32(hist.base + start) != HIST_MAGIC || get_u32(hist.base + start + 4) != len) {
+        return -1;  // torn or foreign data; stop rather than guess
+    }
+    return start;
+}
+
+// Offset of the first valid record at or after off, or -1 at the end.  Skips
+// forward over anything that does not look like a record.
+long history_next(size_t off) {
+    for (; off + HIST_OVERHEAD <= hist.len; off++) {
+        if (get_u32(hist.base + off) == HIST_MAGIC) {
+            uint32_t len = get_u32(hist.base + off + 4);
+            if (len <= hist.len - off - HIST_OVERHEAD &&
+                get_u32(hist.base + off + 8 + len) == len) {
+                return off;
+            }
+        }
+    }
+    return -1;
+}
+
+const char *history_text(size_t off, uint32_t *len) {
+    *len = get_u32(hist.base + off + 4);
+    return hist.base + off + 8;
+}
+
+void history_add(const char *line) {
+    size_t len = strcspn(line, "\n");
+    bool blank = true;
+    for (size_t i = 0; i < len && blank; i++) {
+        blank = strchr(DELIM, line[i]) != NULL;
+    }
+    if (blank || (hist.last && strlen(hist.last) == len && strncmp(hist.last, line, len) == 0)) {
+        return;
+    }
+    history_open();
+    free(hist.last);
+    hist.last = strndup(line, len);
+
+    char *rec = xmalloc(len + HIST_OVERHEAD);
+    uint32_t magic = HIST_MAGIC, len32 = len;
+    memcpy(rec, &magic, 4);
+    memcpy(rec + 4, &len32, 4);
+    memcpy(rec + 8, line, len);
+    memcpy(rec + 8 + len, &len32, 4);
+    if (hist.fd < 0 || write(hist.fd, rec, len + HIST_OVERHEAD) != (ssize_t)(len + HIST_OVERHEAD)) {
+        if (hist.fd >= 0) {
+            // Fall back to memory for the rest of the session
+            struct strbuf copy = {0};
+            sb_append(&copy, hist.base ? hist.base : "", hist.len);
+            munmap(hist.base, hist.len);
+            close(hist.fd);
+            hist.fd = -1;
+            hist.mem = copy;
+        }
+        sb_append(&hist.mem, rec, len + HIST_OVERHEAD);
+    }
+    free(rec);
+}
+
+uint32_t trigram_key(const char *p) {
+    return ((uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 |
+            (unsigned char)p[2]) + 1;
+}
+
+struct hist_trigram *trigram_slot(uint32_t key) {
+    size_t mask = hist.trigram_cap - 1;
+    for (size_t i = (key * 2654435761u) & mask;; i = (i + 1) & mask) {
+        if (hist.trigrams[i].key == key || hist.trigrams[i].key == 0) {
+            return &hist.trigrams[i];
+        }
+    }
+}
+
+void trigram_grow(void) {
+    struct hist_trigram *old = hist.trigrams;
+    size_t old_cap = hist.trigram_cap;
+    hist.trigram_cap = old_cap ? old_cap * 2 : 4096;
+    hist.trigrams = calloc(hist.trigram_cap, sizeof(struct hist_trigram));
+    if (!hist.trigrams) {
+        fprintf(stderr, "allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key != 0) {
+            *trigram_slot(old[i].key) = old[i];
+        }
+    }
+    free(old);
+}
+
+void trigram_add(uint32_t key, uint32_t id) {
+    if ((hist.ntrigrams + 1) * 2 > hist.trigram_cap) {
+        trigram_grow();
+    }
+    struct hist_trigram *t = trigram_slot(key);
+    if (t->key == 0) {
+        t->key = key;
+        hist.ntrigrams++;
+    } else if (t->count > 0 && t->last_id == id) {
+        return;     // trigram repeats within the entry
+    }
+    uint32_t delta = t->count ? id - t->last_id : id;
+    if (t->postings.len + 5 >= t->postings.cap) {
+        t->postings.cap = t->postings.cap ? t->postings.cap * 2 : 16;
+        t->postings.data = xrealloc(t->postings.data, t->postings.cap);
+    }
+    unsigned char *p = (unsigned char *)t->postings.data + t->postings.len;
+    while (delta > 0x7f) {
+        *p++ = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    *p++ = delta;
+    t->postings.len = (char *)p - t->postings.data;
+    t->count++;
+    t->last_id = id;
+}
+
+// Finds or creates the distinct entry for the record at off.
+void history_index_record(size_t off) {
+    uint32_t len;
+    const char *text = history_text(off, &len);
+    uint32_t hash = hash_bytes(text, len);
+
+    if ((hist.nentries + 1) * 2 > hist.entry_cap) {
+        size_t cap = hist.entry_cap ? hist.entry_cap * 2 : 4096;
+        uint32_t (*slots)[2] = calloc(cap, sizeof(*slots));
+        if (!slots) {
+            fprintf(stderr, "allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < hist.nentries; i++) {
+            size_t j = hist.entries[i].hash & (cap - 1);
+            while (slots[j][1]) {
+                j = (j + 1) & (cap - 1);
+            }
+            slots[j][0] = hist.entries[i].hash;
+            slots[j][1] = i + 1;
+        }
+        free(hist.entry_slots);
+        hist.entry_slots = slots;
+        hist.entry_cap = cap;
+    }
+    size_t mask = hist.entry_cap - 1;
+    size_t i = hash & mask;
+    for (; hist.entry_slots[i][1]; i = (i + 1) & mask) {
+        if (hist.entry_slots[i][0] != hash) {
+            continue;   // the hash sits in the slot: no pointer chasing
+        }
+        struct hist_entry *e = &hist.entries[hist.entry_slots[i][1] - 1];
+        uint32_t elen;
+        const char *etext = history_text(e->off, &elen);
+        if (elen == len && memcmp(etext, text, len) == 0) {
+            e->off = off;   // seen before: only its recency changes
+            return;
+        }
+    }
+    if (hist.nentries == hist.entries_cap) {
+        hist.entries_cap = hist.entries_cap ? hist.entries_cap * 2 : 4096;
+        hist.entries = xrealloc(hist.entries, hist.entries_cap * sizeof(struct hist_entry));
+    }
+    uint32_t id = hist.nentries++;
+    hist.entries[id].off = off;
+    hist.entries[id].hash = hash;
+    hist.entry_slots[i][0] = hash;
+    hist.entry_slots[i][1] = id + 1;
+    for (uint32_t k = 0; k + 3 <= len; k++) {
+        trigram_add(trigram_key(text + k), id);
+    }
+}
+
+// Brings the index up to date with everything appended since last time.
+void history_index_update(void) {
+    history_refresh();
+    long off = hist.indexed;
+    while ((off = history_next(off)) >= 0) {
+        history_index_record(off);
+        off += HIST_OVERHEAD + get_u32(hist.base + off + 4);
+    }
+    hist.indexed = hist.len;
+}
+
+// Decodes a posting list into ids.
+size_t trigram_decode(struct hist_trigram *t, uint32_t *ids) {
+    const unsigned char *p = (const unsigned char *)t->postings.data;
+    uint32_t id = 0;
+    for (size_t n = 0; n < t->count; n++) {
+        uint32_t delta = 0;
+        int shift = 0;
+        do {
+            delta |= (uint32_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        id = n ? id + delta : delta;
+        ids[n] = id;
+    }
+    return t->count;
+}
+
+int compare_offsets_desc(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Runs query against the index; afterwards hist.results holds the offsets
+// of the matching distinct entries, most recent first.
+void history_search(const char *query) {
+    history_index_update();
+    free(hist.query);
+    hist.query = strdup(query);
+    hist.nresults = 0;
+    size_t qlen = strlen(query);
+
+    uint32_t *ids = NULL;
+    size_t nids = 0;
+    if (qlen >= 3) {
+        // Start from the rarest trigram and intersect the others into it
+        struct hist_trigram *rarest = NULL;
+        for (size_t k = 0; k + 3 <= qlen; k++) {
+            struct hist_trigram *t = hist.trigram_cap ? trigram_slot(trigram_key(query + k)) : NULL;
+            if (t == NULL || t->key == 0) {
+                return;
+            }
+            if (rarest == NULL || t->count < rarest->count) {
+                rarest = t;
+            }
+        }
+        ids = xmalloc(rarest->count * sizeof(uint32_t));
+        nids = trigram_decode(rarest, ids);
+        for (size_t k = 0; k + 3 <= qlen && nids > 0; k++) {
+            struct hist_trigram *t = trigram_slot(trigram_key(query + k));
+            if (t == rarest) {
+                continue;
+            }
+            uint32_t *other = xmalloc(t->count * sizeof(uint32_t));
+            size_t nother = trigram_decode(t, other), n = 0;
+            for (size_t a = 0, b = 0; a < nids && b < nother;) {
+                if (ids[a] < other[b]) {
+                    a++;
+                } else if (ids[a] > other[b]) {
+                    b++;
+                } else {
+                    ids[n++] = ids[a++];
+                    b++;
+                }
+            }
+            nids = n;
+            free(other);
+        }
+    } else {
+        // Too short for trigrams: every distinct entry is a candidate
+        nids = hist.nentries;
+        ids = xmalloc((nids ? nids : 1) * sizeof(uint32_t));
+        for (size_t i = 0; i < nids; i++) {
+            ids[i] = i;
+        }
+    }
+
+    hist.results = xrealloc(hist.results, (nids ? nids : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < nids; i++) {
+        uint32_t len;
+        uint32_t off = hist.entries[ids[i]].off;
+        const char *text = history_text(off, &len);
+        if (memmem(text, len, query, qlen) != NULL) {
+            hist.results[hist.nresults++] = off;
+        }
+    }
+    free(ids);
+    qsort(hist.results, hist.nresults, sizeof(uint32_t), compare_offsets_desc);
+}
+
+
+// ---------------------------------------------------------------------------
+// Directory and command caches.
+//
+// Tab completion is served from in-memory listings of directories and of
+// the commands on PATH.  The listings are filled by a background thread, so
+// a slow (e.g. NFS) directory never stalls the prompt: the editor asks for
+// a listing, keeps reading keys, and finishes the completion when the
+// worker signals through notify_fd.  A cached listing is used straight away
+// and revalidated in the background once it is a few seconds old.
+// ---------------------------------------------------------------------------
+
+#define DIRCACHE_REVALIDATE 2       // seconds before a listing is rechecked
+
+struct dir_listing {
+    char *path;                     // absolute
+    char *names;                    // NUL-separated names
+    uint32_t *offsets;              // into names, sorted by name
+    unsigned char *types;           // d_type per sorted entry
+    size_t n;
+    struct timespec mtime;
+    time_t checked;
+};
+
+struct path_command {
+    const char *name;               // points into cache.command_names
+    int dir;                        // index into PATH
+};
+
+struct dir_job {
+    char *path;
+    bool path_dir;                  // part of a PATH rescan
+};
+
+struct dircache {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool started;
+    int notify_fd[2];               // worker -> editor: a listing is ready
+
+    struct dir_listing **dirs;
+    size_t ndirs;
+
+    struct dir_job *queue;          // directories waiting to be read
+    size_t nqueue, queue_cap;
+
+    // commands on PATH, sorted by name; rebuilt once every PATH directory
+    // has been revalidated and at least one of them changed
+    char *path_value;
+    char **path_dirs;
+    size_t npath_dirs;
+    size_t path_jobs;               // PATH directories still being checked
+    bool path_changed;
+    struct path_command *commands;
+    char *command_names;            // the table's own copy of the names
+    size_t ncommands;
+    bool path_ready;
+};
+
+struct dircache cache = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// Callers hold cache.lock.
+struct dir_listing *dircache_find(const char *path) {
+    for (size_t i = 0; i < cache.ndirs; i++) {
+        if (strcmp(cache.dirs[i]->path, path) == 0) {
+            return cache.dirs[i];
+        }
+    }
+    return NULL;
+}
+
+// Orders offsets into the names buffer passed as arg.  (qsort_r: the pool
+// workers sort their listings concurrently.)
+int compare_name_offsets(const void *a, const void *b, void *arg) {
+    const char *names = arg;
+    return strcmp(names + *(const uint32_t *)a, names + *(const uint32_t *)b);
+}
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Calls fn for each entry of the open directory fd except . and .., reading
+// straight from getdents64 in large batches.  d_type comes with the entry,
+// so callers need no stat unless it is DT_UNKNOWN.  Returns -1 with errno
+// set if the directory could not be read.
+int dir_scan(int fd, void (*fn)(void *ctx, const char *name, unsigned char type), void *ctx) {
+    char buf[65536] __attribute__((aligned(8)));
+    long n;
+    while ((n = syscall(__NR_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *de = (struct linux_dirent64 *)(buf + off);
+            off += de->d_reclen;
+            const char *name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            fn(ctx, name, de->d_type);
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+struct listing_builder {
+    struct dir_listing *l;
+    struct strbuf names, types;
+    size_t cap;
+};
+
+void listing_add(void *ctx, const char *name, unsigned char type) {
+    struct listing_builder *b = ctx;
+    struct dir_listing *l = b->l;
+    if (l->n == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 64;
+        l->offsets = xrealloc(l->offsets, b->cap * sizeof(uint32_t));
+    }
+    l->offsets[l->n++] = b->names.len;
+    sb_append(&b->names, name, strlen(name) + 1);
+    sb_putc(&b->types, type);
+}
+
+// Reads a directory into a new listing.  Runs on the worker thread.
+struct dir_listing *dir_read(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct dir_listing *l = calloc(1, sizeof(*l));
+    struct listing_builder b = {l};
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        l->mtime = st.st_mtim;
+    }
+    dir_scan(fd, listing_add, &b);
+    close(fd);
+    struct strbuf names = b.names, types = b.types;
+    l->path = strdup(path);
+    l->names = names.data ? names.data : strdup("");
+
+    // Sort offsets by name, carrying the types along
+    unsigned char *by_offset = (unsigned char *)types.data;
+    uint32_t *unsorted = xmalloc((l->n + 1) * sizeof(uint32_t));
+    if (l->n > 0) {     // an empty directory has no offsets array at all
+        memcpy(unsorted, l->offsets, l->n * sizeof(uint32_t));
+        qsort_r(l->offsets, l->n, sizeof(uint32_t), compare_name_offsets, l->names);
+    }
+    l->types = xmalloc(l->n + 1);
+    for (size_t i = 0, j = 0; i < l->n; i++) {
+        // unsorted is ascending, so find each sorted offset by bisection
+        size_t lo = 0, hi = l->n;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (unsorted[mid] < l->offsets[i]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        j = lo;
+        l->types[i] = by_offset[j];
+    }
+    free(unsorted);
+    free(types.data);
+    l->checked = time(NULL);
+    return l;
+}
+
+void dir_free(struct dir_listing *l) {
+    if (l != NULL) {
+        free(l->path);
+        free(l->names);
+        free(l->offsets);
+        free(l->types);
+        free(l);
+    }
+}
+
+// Swaps in a fresh listing for its path.  Callers hold cache.lock.
+void dircache_store(struct dir_listing *l) {
+    for (size_t i = 0; i < cache.ndirs; i++) {
+        if (strcmp(cache.dirs[i]->path, l->path) == 0) {
+            dir_free(cache.dirs[i]);
+            cache.dirs[i] = l;
+            return;
+        }
+    }
+    cache.dirs = xrealloc(cache.dirs, (cache.ndirs + 1) * sizeof(*cache.dirs));
+    cache.dirs[cache.ndirs++] = l;
+}
+
+int compare_commands(const void *a, const void *b) {
+    const struct path_command *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    return c ? c : x->dir - y->dir;
+}
+
+// Rebuilds the command table from the cached PATH listings.  Earlier PATH
+// entries win.  The names are copied, as a listing can be replaced by a
+// fresh read before the table is rebuilt again.  Callers hold cache.lock.
+void path_commands_rebuild(void) {
+    size_t n = 0;
+    for (size_t d = 0; d < cache.npath_dirs; d++) {
+        struct dir_listing *l = dircache_find(cache.path_dirs[d]);
+        n += l ? l->n : 0;
+    }
+    struct path_command *cmds = xmalloc((n + 1) * sizeof(*cmds));
+    n = 0;
+    for (size_t d = 0; d < cache.npath_dirs; d++) {
+        struct dir_listing *l = dircache_find(cache.path_dirs[d]);
+        for (size_t i = 0; l && i < l->n; i++) {
+            if (l->types[i] != DT_DIR) {
+                cmds[n].name = l->names + l->offsets[i];
+                cmds[n++].dir = d;
+            }
+        }
+    }
+    qsort(cmds, n, sizeof(*cmds), compare_commands);
+    size_t m = 0, bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (m == 0 || strcmp(cmds[m - 1].name, cmds[i].name) != 0) {
+            cmds[m++] = cmds[i];
+            bytes += strlen(cmds[i].name) + 1;
+        }
+    }
+    char *names = xmalloc(bytes + 1), *p = names;
+    for (size_t i = 0; i < m; i++) {
+        size_t len = strlen(cmds[i].name) + 1;
+        memcpy(p, cmds[i].name, len);
+        cmds[i].name = p;
+        p += len;
+    }
+    free(cache.commands);
+    free(cache.command_names);
+    cache.commands = cmds;
+    cache.command_names = names;
+    cache.ncommands = m;
+    cache.path_ready = true;
+}
+
+// Splits the PATH value into cache.path_dirs.  Callers hold cache.lock.
+void path_dirs_set(const char *path) {
+    for (size_t i = 0; i < cache.npath_dirs; i++) {
+        free(cache.path_dirs[i]);
+    }
+    free(cache.path_value);
+    cache.path_value = strdup(path);
+    cache.npath_dirs = 0;
+    for (const char *p = path; *p != '\0';) {
+        size_t len = strcspn(p, ":");
+        cache.path_dirs = xrealloc(cache.path_dirs, (cache.npath_dirs + 1) * sizeof(char *));
+        cache.path_dirs[cache.npath_dirs++] = len ? strndup(p, len) : strdup(".");
+        p += len + (p[len] == ':');
+    }
+}
+
+void *dircache_worker(void *unused) {
+    pthread_mutex_lock(&cache.lock);
+    while (1) {
+        while (cache.nqueue == 0) {
+            pthread_cond_wait(&cache.wake, &cache.lock);
+        }
+        struct dir_job job = cache.queue[--cache.nqueue];
+        struct dir_listing *old = dircache_find(job.path);
+        struct timespec mtime = old ? old->mtime : (struct timespec){0};
+        pthread_mutex_unlock(&cache.lock);
+
+        // Revalidate with a stat before paying for a full re-read
+        struct stat st;
+        struct dir_listing *l = NULL;
+        bool unchanged = old && stat(job.path, &st) == 0 &&
+                         st.st_mtim.tv_sec == mtime.tv_sec &&
+                         st.st_mtim.tv_nsec == mtime.tv_nsec;
+        if (!unchanged) {
+            l = dir_read(job.path);
+        }
+
+        pthread_mutex_lock(&cache.lock);
+        if (l != NULL) {
+            dircache_store(l);
+        } else if (unchanged && (old = dircache_find(job.path)) != NULL) {
+            old->checked = time(NULL);
+        }
+        if (job.path_dir) {
+            cache.path_changed |= !unchanged;
+            if (--cache.path_jobs == 0 && cache.path_changed) {
+                path_commands_rebuild();
+                cache.path_changed = false;
+            }
+        }
+        free(job.path);
+        if (write(cache.notify_fd[1], "", 1) < 0) {
+            // the editor drains the pipe; a full pipe already means "ready"
+        }
+    }
+    return NULL;
+}
+
+// A worker may hold the lock when another thread forks; the child must not
+// inherit it locked.
+void dircache_prefork(void) {
+    pthread_mutex_lock(&cache.lock);
+}
+
+void dircache_postfork(void) {
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Starts the worker pool.  Directory reads mostly wait on the disk, so a
+// few threads are worth having even on one CPU.
+void dircache_start(void) {
+    if (cache.started) {
+        return;
+    }
+    if (pipe2(cache.notify_fd, O_CLOEXEC | O_NONBLOCK) == -1) {
+        return;
+    }
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = nworkers < 2 ? 2 : nworkers > 4 ? 4 : nworkers;
+    pthread_atfork(dircache_prefork, dircache_postfork, dircache_postfork);
+    for (long i = 0; i < nworkers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, dircache_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        cache.started = true;
+    }
+}
+
+// Asks the pool to (re)read a directory.  Callers hold cache.lock.
+void dircache_request(const char *path, bool path_dir) {
+    for (size_t i = 0; i < cache.nqueue; i++) {
+        if (strcmp(cache.queue[i].path, path) == 0) {
+            if (path_dir && !cache.queue[i].path_dir) {
+                cache.queue[i].path_dir = true;
+                cache.path_jobs++;
+            }
+            return;
+        }
+    }
+    if (cache.nqueue == cache.queue_cap) {
+        cache.queue_cap = cache.queue_cap ? cache.queue_cap * 2 : 16;
+        cache.queue = xrealloc(cache.queue, cache.queue_cap * sizeof(*cache.queue));
+    }
+    cache.queue[cache.nqueue++] = (struct dir_job){strdup(path), path_dir};
+    cache.path_jobs += path_dir;
+    pthread_cond_signal(&cache.wake);
+}
+
+// Called each time the prompt is shown: while the user types, the pool
+// re-stats every PATH directory (re-reading the ones that changed) and
+// reads the current directory, so that the command about to be entered
+// finds its executable and its glob matches already cached.
+void prefetch_idle(void) {
+    const char *path = var_get("PATH");
+    char cwd[4096];
+    if (path == NULL) {
+        path = "";
+    }
+    dircache_start();
+    if (!cache.started) {
+        return;
+    }
+    pthread_mutex_lock(&cache.lock);
+    if (cache.path_value == NULL || strcmp(cache.path_value, path) != 0) {
+        path_dirs_set(path);
+        cache.path_changed = true;
+    }
+    if (cache.path_jobs == 0) {
+        for (size_t i = 0; i < cache.npath_dirs; i++) {
+            dircache_request(cache.path_dirs[i], true);
+        }
+        if (cache.npath_dirs == 0 && cache.path_changed) {
+            path_commands_rebuild();
+            cache.path_changed = false;
+        }
+    }
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        dircache_request(cwd, false);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Where PATH lookup would find name, from the command table.  Returns NULL
+// when the table is not built or is for another PATH; the caller then lets
+// execvp() search.  The answer can only be stale if PATH changed on disk
+// since the last prompt, and execve() failing falls back to execvp().
+char *command_path(const char *name) {
+    char *result = NULL;
+    if (!cache.started || strchr(name, '/') != NULL) {
+        return NULL;
+    }
+    const char *path = var_get("PATH");
+    pthread_mutex_lock(&cache.lock);
+    if (cache.path_ready && path != NULL && strcmp(cache.path_value, path) == 0) {
+        size_t lo = 0, hi = cache.ncommands;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int c = strcmp(cache.commands[mid].name, name);
+            if (c == 0) {
+                const char *dir = cache.path_dirs[cache.commands[mid].dir];
+                size_t dlen = strlen(dir), nlen = strlen(name);
+                result = arena_alloc(&line_arena, dlen + nlen + 2);
+                memcpy(result, dir, dlen);
+                result[dlen] = '/';
+                memcpy(result + dlen + 1, name, nlen + 1);
+                break;
+            } else if (c < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return result;
+}
+
+// Expands a wildcard pattern for the current directory from the cached
+// listing, if that listing is still current (one stat instead of a full
+// directory read).  Returns false to let glob() do it; true means the
+// listing was used, even if nothing matched.
+bool glob_cached(const char *pattern, struct argv_buf *out) {
+    if (!cache.started || strchr(pattern, '/') != NULL || pattern[0] == '~') {
+        return false;
+    }
+    char cwd[4096];
+    struct stat st;
+    if (getcwd(cwd, sizeof(cwd)) == NULL || stat(cwd, &st) != 0) {
+        return false;
+    }
+    bool found = false;
+    pthread_mutex_lock(&cache.lock);
+    struct dir_listing *l = dircache_find(cwd);
+    if (l != NULL && l->mtime.tv_sec == st.st_mtim.tv_sec &&
+        l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        found = true;
+        for (size_t i = 0; i < l->n; i++) {
+            const char *name = l->names + l->offsets[i];
+            if (fnmatch(pattern, name, FNM_PERIOD) == 0) {
+                argv_push(out, arena_strndup(&line_arena, name, strlen(name)));
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return found;
+}
+
+// ---------------------------------------------------------------------------
+// io_uring backend.
+//
+// Launching a pipeline takes a run of independent syscalls: opening each
+// redirection target, probing PATH for each command and closing the
+// parent's copies of the pipe ends.  When the kernel
+// offers io_uring these are queued on a ring and issued with a single
+// io_uring_enter() per phase.  There is no liburing here; the ring is set
+// up by hand.  Any setup failure, or MYSH_IO_URING=0, leaves the plain
+// syscalls in place.
+// ---------------------------------------------------------------------------
+
+#define RING_ENTRIES 64
+
+struct ring {
+    enum { RING_UNTRIED, RING_READY, RING_UNAVAILABLE } state;
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned queued;                // SQEs filled in but not submitted
+    unsigned inflight;              // submitted, completion not reaped
+};
+
+struct ring ring = {RING_UNTRIED, -1};
+
+int ring_enter(unsigned submit, unsigned wait) {
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+void ring_teardown(void) {
+    if (ring.sq_map != NULL) {
+        munmap(ring.sq_map, ring.sq_map_len);
+    }
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqes_len);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    ring = (struct ring){RING_UNTRIED, -1};
+}
+
+// A forked child sets up its own ring on first use rather than sharing
+// the parent's.  The inherited mappings are left alone: the child is about
+// to exec (the ring fd is close-on-exec) or is a short-lived substitution.
+void ring_atfork_child(void) {
+    ring = (struct ring){RING_UNTRIED, -1};
+}
+
+bool ring_setup(void) {
+    struct io_uring_params p = {0};
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring.fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        return false;
+    }
+    ring.sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > ring.sq_map_len) {
+        ring.sq_map_len = cq_len;
+    }
+    ring.sq_map = mmap(NULL, ring.sq_map_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_map == MAP_FAILED) {
+        ring.sq_map = NULL;
+        return false;
+    }
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        return false;
+    }
+    char *sq = ring.sq_map;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    return true;
+}
+
+// Whether the backend is usable, setting it up on first call.
+bool ring_available(void) {
+    const char *opt = var_get("MYSH_IO_URING");
+    if (opt != NULL && strcmp(opt, "0") == 0) {
+        return false;
+    }
+    if (ring.state == RING_UNTRIED) {
+        static bool atfork = false;
+        if (!atfork) {
+            pthread_atfork(NULL, NULL, ring_atfork_child);
+            atfork = true;
+        }
+        if (ring_setup()) {
+            ring.state = RING_READY;
+        } else {
+            ring_teardown();
+            ring.state = RING_UNAVAILABLE;
+        }
+    }
+    return ring.state == RING_READY;
+}
+
+// Next free SQE, cleared.  When the queue is full what is there is
+// submitted first.  The completion's result is stored in *result.
+struct io_uring_sqe *ring_sqe(int *result) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > *ring.sq_mask) {
+        int n = ring_enter(ring.queued, 0);
+        if (n > 0) {
+            ring.inflight += n;
+            ring.queued -= n;
+        }
+    }
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)result;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return sqe;
+}
+
+// Submits everything queued and waits until every operation has completed.
+void ring_run(void) {
+    unsigned wait = ring.queued + ring.inflight;
+    while (wait > 0) {
+        int n = ring_enter(ring.queued, wait);
+        if (n < 0) {
+            err_perror("io_uring_enter");
+            break;
+        }
+        ring.inflight += n;
+        ring.queued -= n;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            if (cqe->user_data != 0) {
+                *(int *)(uintptr_t)cqe->user_data = cqe->res;
+            }
+            ring.inflight--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        wait = ring.queued + ring.inflight;
+    }
+}
+
+struct io_uring_sqe *ring_openat(const char *path, int flags, mode_t mode, int *result) {
+    struct io_uring_sqe *sqe = ring_sqe(result);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    return sqe;
+}
+
+void ring_statx(const char *path, struct statx *stx, int *result) {
+    struct io_uring_sqe *sqe = ring_sqe(result);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->len = STATX_TYPE | STATX_MODE;
+    sqe->off = (uintptr_t)stx;
+}
+
+void ring_close(int fd) {
+    struct io_uring_sqe *sqe = ring_sqe(NULL);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+// ---------------------------------------------------------------------------
+// Child processes and jobs.
+//
+// Every child is started with clone3(CLONE_PIDFD) (or fork() followed by
+// pidfd_open()) and its pidfd goes into one epoll set, the waiter.  Waiting
+// for a foreground pipeline, reaping background jobs and (at the prompt)
+// reading the terminal all happen on that set, so no SIGCHLD handler is
+// needed and a child can never be reaped by the wrong wait.  A job costs
+// one fd per running child and nothing per exited one.
+// ---------------------------------------------------------------------------
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+// Something the waiter's epoll set is watching.
+struct watch {
+    int fd;
+    void (*ready)(struct watch *w);
+    bool last;                      // handled after the rest of its batch
+};
+
+struct job;
+
+struct child {
+    struct watch watch;             // first: the epoll data points here
+    pid_t pid;
+    struct job *job;
+    struct child *prev, *next;      // the job's running children
+    bool ns_init;                   // init of a PID namespace of its own
+};
+
+struct job {
+    int id;                         // [id] of a background job, else 0
+    char *text;                     // the command, for job listings
+    pid_t last_pid;
+    int nrunning;
+    struct child *children;
+    int status;                     // wait status of the last stage
+    struct watch timer;             // timerfd for `timeout`, fd -1 if none
+    long kill_after;                // ms from SIGTERM to SIGKILL, 0: never
+    bool timed_out;
+    int nfailed;                    // children that exited non-zero
+    struct timespec start;
+    long user_us, sys_us, mem_kb;   // summed over the stages (peak for mem)
+    int cgroup_fd, cgroup_id;       // fd -1: no cgroup
+    struct job *next;
+};
+
+// Exit status of a finished job, as $? reports it.
+#define TIMEOUT_STATUS 124
+
+int job_exit_status(const struct job *job) {
+    if (job->timed_out) {
+        return TIMEOUT_STATUS;
+    }
+    return WIFEXITED(job->status) ? WEXITSTATUS(job->status) : 1;
+}
+
+// Resource limits set with ulimit.  They are applied in each child before
+// exec, never to the shell itself.
+struct child_limit {
+    int resource;
+    struct rlimit limit;
+};
+
+struct waiter {
+    int epfd;
+    struct job *jobs;               // background jobs, newest first
+    pid_t last_background;          // $!
+    struct rlimit nofile;           // the limit children get
+    bool nofile_raised;
+    struct child_limit limits[16];
+    int nlimits;
+};
+
+struct waiter waiter = {-1};
+
+// Runs in a new child: puts back the fd limit the shell raised for itself
+// and applies the ulimit settings.  Async-signal-safe.
+void child_apply_limits(void) {
+    if (waiter.nofile_raised) {
+        setrlimit(RLIMIT_NOFILE, &waiter.nofile);
+    }
+    for (int i = 0; i < waiter.nlimits; i++) {
+        setrlimit(waiter.limits[i].resource, &waiter.limits[i].limit);
+    }
+}
+
+// The wait status waitpid() would have reported for a waitid() result.
+int siginfo_status(const siginfo_t *info) {
+    if (info->si_code == CLD_EXITED) {
+        return (info->si_status & 0xff) << 8;
+    }
+    return (info->si_status & 0x7f) | (info->si_code == CLD_DUMPED ? 0x80 : 0);
+}
+
+bool waiter_start(void) {
+    if (waiter.epfd < 0) {
+        waiter.epfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    return waiter.epfd >= 0;
+}
+
+// In a forked copy of the shell that keeps running shell code: the epoll
+// set and the jobs are the parent's, so start afresh.
+void waiter_forget(void) {
+    if (waiter.epfd >= 0) {
+        close(waiter.epfd);
+        waiter.epfd = -1;
+    }
+    waiter.jobs = NULL;
+}
+
+// Watches fire once.  (A pidfd can outlive our close() in a child that has
+// not exec'd yet, which would keep a level-triggered watch alive.)
+bool waiter_add(struct watch *w) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = w};
+    return waiter_start() && epoll_ctl(waiter.epfd, EPOLL_CTL_ADD, w->fd, &ev) == 0;
+}
+
+// Handles whatever is ready, waiting up to timeout ms (-1: until something
+// is).  Returns the number of events handled.
+int waiter_run(int timeout) {
+    struct epoll_event events[64];
+    int n;
+    do {
+        n = epoll_wait(waiter.epfd, events, 64, timeout);
+    } while (n < 0 && errno == EINTR);
+    // Timeouts go last: a job whose last child exited in the same batch
+    // finished in time.  (They are picked out first, as a child's watch is
+    // freed by its handler.)
+    struct watch *later[64];
+    int nlater = 0;
+    for (int i = 0; i < n; i++) {
+        struct watch *w = events[i].data.ptr;
+        if (w->last) {
+            later[nlater++] = w;
+            events[i].data.ptr = NULL;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        struct watch *w = events[i].data.ptr;
+        if (w != NULL) {
+            w->ready(w);
+        }
+    }
+    for (int i = 0; i < nlater; i++) {
+        later[i]->ready(later[i]);
+    }
+    return n > 0 ? n : 0;
+}
+
+// Per-job accounting.  Every job records its wall time and, from the rusage
+// that waitid() hands back, CPU time and peak RSS.  With MYSH_CGROUP set,
+// each job also gets a cgroup v2 group of its own under mysh-PID: children
+// are born in it (clone3 with CLONE_INTO_CGROUP), it carries
+// MYSH_CGROUP_CPU_WEIGHT and MYSH_CGROUP_MEMORY_MAX, and its cpu.stat and
+// memory.peak replace the rusage figures, grandchildren included.  The
+// `stats` builtin shows the most recent jobs.
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+struct job_stats {
+    int seq;
+    char *text;
+    long wall_us, user_us, sys_us, mem_kb;
+    bool cgroup;
+};
+
+#define NUM_JOB_STATS 64
+
+struct {
+    struct job_stats jobs[NUM_JOB_STATS];
+    int count;                      // jobs finished so far
+} job_history;
+
+struct cgroups {
+    enum { CG_UNTRIED, CG_READY, CG_UNAVAILABLE } state;
+    int dirfd;                      // mysh-PID
+    char *path;
+    int next_id;
+    unsigned warned;                // bit per warning already given
+};
+
+struct cgroups cgroups = {CG_UNTRIED, -1};
+
+void cgroup_warn(unsigned bit, const char *what) {
+    if (!(cgroups.warned & bit)) {
+        err_printf("mysh: %s\n", what);
+        cgroups.warned |= bit;
+    }
+}
+
+bool cgroup_write(int dirfd, const char *file, const char *value) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+// Reads a small cgroup file into buf.  Returns false if it is missing.
+bool cgroup_read(int dirfd, const char *file, char *buf, size_t size) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n > 0;
+}
+
+// The cgroup v2 directory the shell itself is in.
+char *cgroup_own_path(void) {
+    char line[4096], mount[4096] = "";
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        char *sep = strstr(line, " - cgroup2 ");
+        char point[4096];
+        if (sep != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1) {
+            strcpy(mount, point);
+            break;
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    f = fopen("/proc/self/cgroup", "re");
+    char *path = NULL;
+    while (*mount && f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            path = xmalloc(strlen(mount) + strlen(line + 3) + 1);
+            sprintf(path, "%s%s", mount, line + 3);
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    return path;
+}
+
+void cgroups_cleanup(void) {
+    if (cgroups.dirfd >= 0) {
+        for (int id = 1; id < cgroups.next_id; id++) {
+            char name[32];
+            snprintf(name, sizeof(name), "job-%d", id);
+            unlinkat(cgroups.dirfd, name, AT_REMOVEDIR);
+        }
+        rmdir(cgroups.path);
+    }
+}
+
+// Whether jobs get cgroups: MYSH_CGROUP is an absolute cgroup2 directory
+// to work under, or 1 for the shell's own cgroup.  Set up on first use.
+bool cgroups_enabled(void) {
+    const char *opt = var_get("MYSH_CGROUP");
+    if (opt == NULL || *opt == '\0' || strcmp(opt, "0") == 0) {
+        return false;
+    }
+    if (cgroups.state == CG_UNTRIED) {
+        char *base = opt[0] == '/' ? strdup(opt) : cgroup_own_path();
+        cgroups.state = CG_UNAVAILABLE;
+        if (base == NULL) {
+            cgroup_warn(1, "no cgroup v2 hierarchy; jobs run without cgroups");
+            return false;
+        }
+        cgroups.path = xmalloc(strlen(base) + 32);
+        sprintf(cgroups.path, "%s/mysh-%d", base, (int)getpid());
+        if ((mkdir(cgroups.path, 0755) == -1 && errno != EEXIST) ||
+            (cgroups.dirfd = open(cgroups.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            char msg[4200];
+            snprintf(msg, sizeof(msg), "cannot create %s (%s); jobs run without cgroups",
+                     cgroups.path, strerror(errno));
+            cgroup_warn(1, msg);
+            free(base);
+            return false;
+        }
+        // Delegate cpu and memory downwards where the parent allows it;
+        // without them jobs still get groups, just no weight or limit
+        char file[4200];
+        snprintf(file, sizeof(file), "%s/cgroup.subtree_control", base);
+        int fd = open(file, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (write(fd, "+cpu", 4) < 0 || write(fd, "+memory", 7) < 0) {
+                // not fatal
+            }
+            close(fd);
+        }
+        cgroup_write(cgroups.dirfd, "cgroup.subtree_control", "+cpu");
+        cgroup_write(cgroups.dirfd, "cgroup.subtree_control", "+memory");
+        free(base);
+        cgroups.next_id = 1;
+        cgroups.state = CG_READY;
+        atexit(cgroups_cleanup);
+    }
+    return cgroups.state == CG_READY;
+}
+
+// Gives a job about to start its own cgroup.
+void job_cgroup_create(struct job *job) {
+    if (!cgroups_enabled()) {
+        return;
+    }
+    job->cgroup_id = cgroups.next_id++;
+    char name[32];
+    snprintf(name, sizeof(name), "job-%d", job->cgroup_id);
+    if (mkdirat(cgroups.dirfd, name, 0755) == -1 ||
+        (job->cgroup_fd = openat(cgroups.dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        cgroup_warn(2, "cannot create job cgroups; jobs run without them");
+        job->cgroup_fd = -1;
+        return;
+    }
+    const char *weight = var_get("MYSH_CGROUP_CPU_WEIGHT");
+    if (weight != NULL && *weight && !cgroup_write(job->cgroup_fd, "cpu.weight", weight)) {
+        cgroup_warn(4, "cpu.weight not available (cpu controller not delegated)");
+    }
+    const char *max = var_get("MYSH_CGROUP_MEMORY_MAX");
+    if (max != NULL && *max && !cgroup_write(job->cgroup_fd, "memory.max", max)) {
+        cgroup_warn(8, "memory.max not available (memory controller not delegated)");
+    }
+}
+
+// Records a job that has just finished and removes its cgroup.
+void job_finish(struct job *job) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct job_stats *st = &job_history.jobs[job_history.count % NUM_JOB_STATS];
+    free(st->text);
+    *st = (struct job_stats){
+        .seq = ++job_history.count,
+        .text = strdup(job->text ? job->text : ""),
+        .wall_us = (now.tv_sec - job->start.tv_sec) * 1000000L +
+                   (now.tv_nsec - job->start.tv_nsec) / 1000,
+        .user_us = job->user_us,
+        .sys_us = job->sys_us,
+        .mem_kb = job->mem_kb,
+    };
+    if (job->cgroup_fd < 0) {
+        return;
+    }
+    char buf[1024], *p;
+    if (cgroup_read(job->cgroup_fd, "cpu.stat", buf, sizeof(buf))) {
+        st->cgroup = true;
+        if ((p = strstr(buf, "user_usec ")) != NULL) {
+            st->user_us = atol(p + 10);
+        }
+        if ((p = strstr(buf, "system_usec ")) != NULL) {
+            st->sys_us = atol(p + 12);
+        }
+    }
+    if (cgroup_read(job->cgroup_fd, "memory.peak", buf, sizeof(buf))) {
+        st->mem_kb = atol(buf) / 1024;
+    }
+    close(job->cgroup_fd);
+    job->cgroup_fd = -1;
+    char name[32];
+    snprintf(name, sizeof(name), "job-%d", job->cgroup_id);
+    unlinkat(cgroups.dirfd, name, AT_REMOVEDIR);    // fails while stragglers live
+}
+
+void job_child_done(struct job *job, pid_t pid, int status) {
+    if (pid == job->last_pid) {
+        job->status = status;
+    }
+    job->nfailed += status != 0;
+    if (--job->nrunning > 0) {
+        return;
+    }
+    if (job->timer.fd >= 0) {
+        // Taken out of the set explicitly: a child that has not exec'd
+        // yet may still hold a copy of the timerfd
+        epoll_ctl(waiter.epfd, EPOLL_CTL_DEL, job->timer.fd, NULL);
+        close(job->timer.fd);
+        job->timer.fd = -1;
+    }
+    job_finish(job);
+}
+
+void child_exited(struct watch *w) {
+    struct child *c = (struct child *)w;
+    siginfo_t info = {0};
+    struct rusage ru = {0};
+    int r;
+    do {
+        // the raw syscall also reports the child's resource usage
+        r = syscall(__NR_waitid, P_PIDFD, w->fd, &info, WEXITED, &ru);
+    } while (r < 0 && errno == EINTR);
+    close(w->fd);
+    struct job *job = c->job;
+    job->user_us += ru.ru_utime.tv_sec * 1000000L + ru.ru_utime.tv_usec;
+    job->sys_us += ru.ru_stime.tv_sec * 1000000L + ru.ru_stime.tv_usec;
+    job->mem_kb = ru.ru_maxrss > job->mem_kb ? ru.ru_maxrss : job->mem_kb;
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        c->job->children = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    int status = r == 0 ? siginfo_status(&info) : 1 << 8;
+    if (c->ns_init && WIFEXITED(status) && WEXITSTATUS(status) > 128 &&
+        WEXITSTATUS(status) < 128 + NSIG) {
+        status = WEXITSTATUS(status) - 128;     // a sandbox's init reporting a signal
+    }
+    job_child_done(c->job, c->pid, status);
+    free(c);
+}
+
+// perror() for a child between clone3() and exec: no stdio, whose locks
+// another thread of the parent may have held, only write() of
+// prefix, what and errno's message.
+void child_perror(const char *prefix, const char *what) {
+    char buf[64];
+    const char *error = strerror_r(errno, buf, sizeof(buf));
+    struct iovec iov[] = {{(void *)prefix, strlen(prefix)}, {(void *)what, strlen(what)},
+                          {": ", 2}, {(void *)error, strlen(error)}, {"\n", 1}};
+    if (writev(STDERR_FILENO, iov, 5) < 0) {
+        // nowhere left to report it
+    }
+}
+
+// Sandboxed commands.  MYSH_SANDBOX is a comma-separated list of what the
+// commands the shell execs are confined by:
+//
+//     seccomp  a syscall filter: mount, namespace, ptrace, module, kexec,
+//              bpf, keyring and clock calls fail with EPERM
+//     ro       a mount namespace of their own in which every mount is
+//              read-only but the directories in MYSH_SANDBOX_WRITABLE
+//              (colon-separated)
+//     pid      a PID namespace of their own, with its own /proc
+//
+// or 1 for all three.  Both variables are read at startup and read-only
+// from then on.  The namespaces come from the clone3() that starts the
+// command (with a user namespace as well when the shell is not root) and
+// the rest is set up in the child before exec; under pid the child stays
+// on as the namespace's init.  The filter is compiled once and every child
+// installs the same program.  A child whose sandbox cannot be set up does
+// not exec: it exits 126.  Builtins and forked copies of the shell are not
+// confined, but the commands they run are, and under ro redirections are
+// held to the writable directories.
+
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS SECCOMP_RET_KILL
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x1
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+#if defined(__x86_64__)
+#define SANDBOX_AUDIT_ARCH AUDIT_ARCH_X86_64
+#ifndef __X32_SYSCALL_BIT
+#define __X32_SYSCALL_BIT 0x40000000
+#endif
+#elif defined(__aarch64__)
+#define SANDBOX_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+#define SANDBOX_SECCOMP 0x1
+#define SANDBOX_RO      0x2
+#define SANDBOX_PID     0x4
+
+struct sandbox {
+    unsigned what;                  // SANDBOX_* bits, 0: off
+    char *unusable;                 // why MYSH_SANDBOX cannot be had, or NULL
+    uint64_t clone_flags;           // namespaces for each confined child
+    char *writable;                 // MYSH_SANDBOX_WRITABLE
+    struct sock_fprog prog;         // the filter, built on first use
+    char uid_map[48], gid_map[48];  // for a child in a user namespace
+};
+
+struct sandbox sandbox;
+
+// What the filter refuses.  Anything else is allowed.
+const int sandbox_denied[] = {
+    __NR_mount, __NR_umount2, __NR_pivot_root, __NR_chroot, __NR_unshare, __NR_setns,
+    __NR_ptrace, __NR_process_vm_readv, __NR_process_vm_writev,
+    __NR_init_module, __NR_finit_module, __NR_delete_module, __NR_kexec_load,
+    __NR_reboot, __NR_swapon, __NR_swapoff, __NR_acct, __NR_quotactl, __NR_syslog,
+    __NR_bpf, __NR_perf_event_open, __NR_userfaultfd,
+    __NR_keyctl, __NR_add_key, __NR_request_key,
+    __NR_open_by_handle_at, __NR_name_to_handle_at,
+    __NR_settimeofday, __NR_clock_settime, __NR_clock_adjtime, __NR_adjtimex,
+    __NR_sethostname, __NR_setdomainname,
+#ifdef __NR_kexec_file_load
+    __NR_kexec_file_load,
+#endif
+#ifdef __NR_fsopen
+    __NR_open_tree, __NR_move_mount, __NR_fsopen, __NR_fsconfig, __NR_fsmount, __NR_fspick,
+    __NR_mount_setattr,
+#endif
+#ifdef __NR_iopl
+    __NR_iopl, __NR_ioperm,
+#endif
+};
+
+// Compiles the filter: a call from another ABI kills the process, the
+// calls above fail with EPERM.  False where there is no filter for the
+// architecture.
+bool sandbox_build_filter(void) {
+#ifdef SANDBOX_AUDIT_ARCH
+    size_t n = sizeof(sandbox_denied) / sizeof(sandbox_denied[0]);
+    struct sock_filter *f = xmalloc((n + 8) * sizeof(*f));
+    size_t len = 0;
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                            offsetof(struct seccomp_data, arch));
+    f[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SANDBOX_AUDIT_ARCH, 1, 0);
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                            offsetof(struct seccomp_data, nr));
+#ifdef __x86_64__
+    f[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1);
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+#endif
+    for (size_t i = 0; i < n; i++) {
+        // a match jumps over the checks left and the allow, to the refusal
+        f[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                (unsigned)sandbox_denied[i], n - i, 0);
+    }
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM);
+    sandbox.prog.filter = f;
+    sandbox.prog.len = len;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Reads MYSH_SANDBOX and MYSH_SANDBOX_WRITABLE, once at startup, and makes
+// both read-only: a script cannot loosen what confines its commands.
+void sandbox_init(void) {
+    const char *opt = var_get("MYSH_SANDBOX");
+    const char *writable = var_get("MYSH_SANDBOX_WRITABLE");
+    var_make_readonly("MYSH_SANDBOX");
+    var_make_readonly("MYSH_SANDBOX_WRITABLE");
+    free(sandbox.writable);
+    free(sandbox.unusable);
+    sandbox.writable = writable ? strdup(writable) : NULL;
+    sandbox.unusable = NULL;
+    sandbox.what = 0;
+    sandbox.clone_flags = 0;
+    if (opt == NULL || *opt == '\0' || strcmp(opt, "0") == 0) {
+        return;
+    }
+    unsigned what = 0;
+    char *copy = strdup(opt), *save = NULL;
+    for (char *word = strtok_r(copy, ",", &save); word != NULL; word = strtok_r(NULL, ",", &save)) {
+        if (strcmp(word, "1") == 0) {
+            what |= SANDBOX_SECCOMP | SANDBOX_RO | SANDBOX_PID;
+        } else if (strcmp(word, "seccomp") == 0) {
+            what |= SANDBOX_SECCOMP;
+        } else if (strcmp(word, "ro") == 0) {
+            what |= SANDBOX_RO;
+        } else if (strcmp(word, "pid") == 0) {
+            what |= SANDBOX_PID;
+        } else {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "unknown MYSH_SANDBOX setting '%s'", word);
+            sandbox.unusable = strdup(msg);
+            free(copy);
+            return;
+        }
+    }
+    free(copy);
+    if ((what & SANDBOX_SECCOMP) && sandbox.prog.filter == NULL && !sandbox_build_filter()) {
+        sandbox.unusable = strdup("no seccomp filter for this architecture");
+        return;
+    }
+    uint64_t flags = 0;
+    if (what & (SANDBOX_RO | SANDBOX_PID)) {
+        flags |= CLONE_NEWNS;       // pid needs it for its /proc
+    }
+    if (what & SANDBOX_PID) {
+        flags |= CLONE_NEWPID;
+    }
+    if (flags != 0 && geteuid() != 0) {
+        // Unprivileged: the namespaces belong to a user namespace in which
+        // the child keeps its own uid and gid
+        flags |= CLONE_NEWUSER;
+        snprintf(sandbox.uid_map, sizeof(sandbox.uid_map), "%d %d 1", (int)geteuid(),
+                 (int)geteuid());
+        snprintf(sandbox.gid_map, sizeof(sandbox.gid_map), "%d %d 1", (int)getegid(),
+                 (int)getegid());
+    }
+    sandbox.what = what;
+    sandbox.clone_flags = flags;
+}
+
+// Returns 1 if commands are to be confined, 0 if not, and -1 (with a
+// message) if they are but cannot be.
+int sandbox_setup(void) {
+    if (sandbox.unusable != NULL) {
+        err_printf("mysh: sandbox: %s\n", sandbox.unusable);
+        return -1;
+    }
+    return sandbox.what != 0;
+}
+
+// Whether a command confined by ro could write to path: it has to be in
+// one of the MYSH_SANDBOX_WRITABLE directories, or not be a file at all
+// (a device such as /dev/null, a FIFO).  Symlinks are followed first.
+bool sandbox_may_write(const char *path) {
+    if (!(sandbox.what & SANDBOX_RO)) {
+        return true;
+    }
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (realpath(path, resolved) != NULL) {
+        if (stat(resolved, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            return true;
+        }
+    } else {
+        // Not there yet: where it would be created decides
+        char dir[PATH_MAX];
+        const char *slash = strrchr(path, '/');
+        size_t len = slash == NULL ? 1 : slash == path ? 1 : (size_t)(slash - path);
+        if (len >= sizeof(dir)) {
+            return false;
+        }
+        memcpy(dir, slash == NULL ? "." : path, len);
+        dir[len] = '\0';
+        const char *base = slash == NULL ? path : slash + 1;
+        size_t n = realpath(dir, resolved) != NULL ? strlen(resolved) : 0;
+        if (n == 0 || n + strlen(base) + 2 > sizeof(resolved)) {
+            return false;
+        }
+        if (n > 1) {
+            resolved[n++] = '/';
+        }
+        memcpy(resolved + n, base, strlen(base) + 1);
+    }
+    for (const char *p = sandbox.writable; p != NULL && *p; p += *p == ':') {
+        size_t len = strcspn(p, ":");
+        char dir[PATH_MAX], real[PATH_MAX];
+        if (len > 0 && len < sizeof(dir)) {
+            memcpy(dir, p, len);
+            dir[len] = '\0';
+            size_t n = realpath(dir, real) != NULL ? strlen(real) : 0;
+            if (n > 0 && strncmp(resolved, real, n) == 0 &&
+                (resolved[n] == '/' || resolved[n] == '\0' || n == 1)) {
+                return true;
+            }
+        }
+        p += len;
+    }
+    return false;
+}
+
+void sandbox_fail(const char *what) {
+    child_perror("mysh: sandbox: ", what);
+    _exit(126);
+}
+
+bool sandbox_write(const char *file, const char *text) {
+    int fd = open(file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, text, strlen(text)) == (ssize_t)strlen(text);
+    close(fd);
+    return ok;
+}
+
+pid_t sandbox_command;              // in a sandbox's init: the command
+
+// In a sandbox's init: passes a signal sent to it on to the command.  One
+// the terminal sent the whole process group has reached the command too.
+void sandbox_relay(int sig, siginfo_t *info, void *context) {
+    if (info->si_code <= 0 && sandbox_command > 0) {
+        kill(sandbox_command, sig);
+    }
+}
+
+// The init of a PID namespace ignores every signal it has no handler for,
+// so the command is not made init.  The child stays on as a small one:
+// it relays signals to the command and reaps whatever is orphaned in the
+// namespace, then exits with the command's status (128 + N for a signal N,
+// which the shell turns back into one).  Returns in the command.
+void sandbox_run_init(void) {
+    static struct sigaction saved[NSIG];
+    struct sigaction relay = {.sa_sigaction = sandbox_relay, .sa_flags = SA_SIGINFO | SA_RESTART};
+    sigset_t all, old;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sig != SIGCHLD && sigaction(sig, &relay, &saved[sig]) != 0) {
+            saved[sig].sa_handler = SIG_ERR;
+        }
+    }
+    struct {
+        uint64_t flags, pidfd, child_tid, parent_tid, exit_signal, stack, stack_size, tls;
+    } args = {.exit_signal = SIGCHLD};
+    pid_t pid = syscall(__NR_clone3, &args, sizeof(args));
+    if (pid <= 0) {
+        // The command, or the child if there is none: as they were
+        for (int sig = 1; sig < NSIG; sig++) {
+            if (sig != SIGCHLD && saved[sig].sa_handler != SIG_ERR) {
+                sigaction(sig, &saved[sig], NULL);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    sandbox_command = pid;
+    // Nothing of the shell's is held open, a pipe end least of all
+    if (syscall(__NR_close_range, 0, ~0u, 0) != 0) {
+        for (int fd = 0; fd < 1024; fd++) {
+            close(fd);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    int status;
+    pid_t done;
+    while ((done = waitpid(-1, &status, 0)) != pid) {
+        if (done < 0 && errno != EINTR) {
+            _exit(126);
+        }
+    }
+    _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+// Runs in a new child, in the namespaces sandbox.clone_flags asked for,
+// just before it execs a command: finishes the confinement or exits.
+// Async-signal-safe.
+void sandbox_enter(void) {
+    if (sandbox.what == 0) {
+        return;
+    }
+    if ((sandbox.clone_flags & CLONE_NEWUSER) &&
+        (!sandbox_write("/proc/self/setgroups", "deny") ||
+         !sandbox_write("/proc/self/uid_map", sandbox.uid_map) ||
+         !sandbox_write("/proc/self/gid_map", sandbox.gid_map))) {
+        sandbox_fail("user namespace");
+    }
+    // Nothing mounted here may show up outside
+    if ((sandbox.clone_flags & CLONE_NEWNS) && mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        sandbox_fail("mount namespace");
+    }
+    if ((sandbox.what & SANDBOX_PID) &&
+        mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0) {
+        sandbox_fail("/proc");
+    }
+    if (sandbox.what & SANDBOX_RO) {
+        struct {
+            uint64_t attr_set, attr_clr, propagation, userns_fd;
+        } ro = {.attr_set = MOUNT_ATTR_RDONLY}, rw = {.attr_clr = MOUNT_ATTR_RDONLY};
+        if (syscall(__NR_mount_setattr, AT_FDCWD, "/", AT_RECURSIVE, &ro, sizeof(ro)) != 0) {
+            sandbox_fail("read-only mounts");
+        }
+        // Each writable directory becomes a mount of its own, writable again
+        for (const char *p = sandbox.writable; p != NULL && *p; p += *p == ':') {
+            size_t len = strcspn(p, ":");
+            char dir[PATH_MAX];
+            if (len >= sizeof(dir)) {
+                errno = ENAMETOOLONG;
+                sandbox_fail("MYSH_SANDBOX_WRITABLE");
+            }
+            memcpy(dir, p, len);
+            dir[len] = '\0';
+            p += len;
+            if (len > 0 && (mount(dir, dir, NULL, MS_BIND | MS_REC, NULL) != 0 ||
+                            syscall(__NR_mount_setattr, AT_FDCWD, dir, 0, &rw, sizeof(rw)) != 0)) {
+                sandbox_fail(dir);
+            }
+        }
+    }
+    // Last, as it refuses mount() itself
+    if ((sandbox.what & SANDBOX_SECCOMP) &&
+        (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ||
+         syscall(__NR_seccomp, SECCOMP_SET_MODE_FILTER, 0, &sandbox.prog) != 0)) {
+        sandbox_fail("seccomp");
+    }
+    if (sandbox.what & SANDBOX_PID) {
+        sandbox_run_init();
+    }
+}
+
+// Starts a child, in new namespaces if ns_flags asks for any.  Returns its
+// pid (0 in the child) and watches its pidfd on behalf of job; -1 if no
+// process could be created.  Where pidfds are unavailable *untracked is set
+// and the caller must waitpid() for it.
+//
+// A child that only sets up and execs comes from a bare clone3().  One
+// that goes on running shell code (runs_shell) comes from fork(), which
+// also runs the atfork handlers and leaves malloc's locks usable.
+pid_t spawn_child(struct job *job, uint64_t ns_flags, bool runs_shell, bool *untracked) {
+    struct child *c = xmalloc(sizeof(*c));
+    c->job = job;
+    c->watch.ready = child_exited;
+    c->watch.fd = -1;
+    c->watch.last = false;
+    c->ns_init = (ns_flags & CLONE_NEWPID) != 0;
+    *untracked = false;
+
+    pid_t pid = -1;
+    bool use_fork = runs_shell;
+    for (int attempt = 0; attempt < 3 && !use_fork; attempt++) {
+        struct {
+            uint64_t flags, pidfd, child_tid, parent_tid, exit_signal, stack, stack_size, tls;
+            uint64_t set_tid, set_tid_size, cgroup;
+        } args = {.flags = CLONE_PIDFD | ns_flags, .pidfd = (uintptr_t)&c->watch.fd, .exit_signal = SIGCHLD};
+        if (job->cgroup_fd >= 0) {
+            args.flags |= CLONE_INTO_CGROUP;
+            args.cgroup = job->cgroup_fd;
+        }
+        pid = syscall(__NR_clone3, &args, sizeof(args));
+        if (pid >= 0) {
+            break;
+        }
+        if (errno == EMFILE && !waiter.nofile_raised) {
+            // Thousands of children mean thousands of pidfds: use the hard
+            // limit for ourselves, but hand children the usual one
+            struct rlimit raised;
+            getrlimit(RLIMIT_NOFILE, &waiter.nofile);
+            raised = waiter.nofile;
+            raised.rlim_cur = raised.rlim_max;
+            waiter.nofile_raised = setrlimit(RLIMIT_NOFILE, &raised) == 0;
+            continue;
+        }
+        if (job->cgroup_fd >= 0 && errno != ENOSYS) {
+            // e.g. the group is not a valid target: run without it
+            cgroup_warn(16, "cannot start jobs inside their cgroups; running without");
+            close(job->cgroup_fd);
+            job->cgroup_fd = -1;
+            continue;
+        }
+        if (ns_flags != 0) {
+            // A sandbox that cannot be had is not quietly done without
+            err_printf("mysh: sandbox: cannot create namespaces: %s\n", strerror(errno));
+            free(c);
+            return -1;
+        }
+        if (errno != ENOSYS && errno != EINVAL && errno != EPERM) {
+            break;
+        }
+        use_fork = true;    // no clone3 (or a seccomp policy refusing it)
+    }
+    if (use_fork) {
+        pid = fork();
+        if (pid == 0 && job->cgroup_fd >= 0) {
+            cgroup_write(job->cgroup_fd, "cgroup.procs", "0");
+        }
+        if (pid > 0) {
+            c->watch.fd = syscall(__NR_pidfd_open, pid, 0);
+        }
+    }
+    if (pid <= 0) {
+        free(c);
+        return pid;
+    }
+    c->pid = pid;
+    job->last_pid = c->pid;
+    if (c->watch.fd < 0 || !waiter_add(&c->watch)) {
+        if (c->watch.fd >= 0) {
+            close(c->watch.fd);
+        }
+        *untracked = true;
+        pid_t pid = c->pid;
+        free(c);
+        return pid;
+    }
+    c->prev = NULL;
+    c->next = job->children;
+    if (c->next != NULL) {
+        c->next->prev = c;
+    }
+    job->children = c;
+    job->nrunning++;
+    return c->pid;
+}
+
+// The job's time is up: SIGTERM to every stage still running, then SIGKILL
+// after the grace period if one was given.  Signals go through the pidfds,
+// so a pid that was reaped and reused is never hit.
+void job_timer_fired(struct watch *w) {
+    struct job *job = (struct job *)((char *)w - offsetof(struct job, timer));
+    if (w->fd < 0 || job->nrunning == 0) {
+        return;     // the job ended earlier in this batch
+    }
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+        // cannot happen once epoll reported it readable
+    }
+    int sig = job->timed_out ? SIGKILL : SIGTERM;
+    job->timed_out = true;
+    for (struct child *c = job->children; c != NULL; c = c->next) {
+        syscall(__NR_pidfd_send_signal, c->watch.fd, sig, NULL, 0);
+    }
+    if (sig == SIGKILL && job->cgroup_fd >= 0) {
+        cgroup_write(job->cgroup_fd, "cgroup.kill", "1");   // grandchildren too
+    }
+    if (sig == SIGTERM && job->kill_after > 0) {
+        struct itimerspec its = {.it_value = {job->kill_after / 1000,
+                                              job->kill_after % 1000 * 1000000}};
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = w};
+        timerfd_settime(w->fd, 0, &its, NULL);
+        epoll_ctl(waiter.epfd, EPOLL_CTL_MOD, w->fd, &ev);
+    }
+}
+
+// Arms a timeout of ms milliseconds for a job whose children have started.
+void job_set_timeout(struct job *job, long ms, long kill_after) {
+    struct itimerspec its = {.it_value = {ms / 1000, ms % 1000 * 1000000}};
+    job->kill_after = kill_after;
+    job->timer.ready = job_timer_fired;
+    job->timer.last = true;
+    job->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (job->timer.fd < 0) {
+        err_perror("timeout");
+        return;
+    }
+    if (timerfd_settime(job->timer.fd, 0, &its, NULL) == -1 || !waiter_add(&job->timer)) {
+        err_perror("timeout");
+        close(job->timer.fd);
+        job->timer.fd = -1;
+    }
+}
+
+// Waits until every process of a foreground job has exited.
+void job_wait(struct job *job) {
+    while (job->nrunning > 0) {
+        waiter_run(-1);
+    }
+}
+
+// Puts a started pipeline in the background job list.
+void job_background(struct job *job) {
+    job->id = waiter.jobs ? waiter.jobs->id + 1 : 1;
+    job->next = waiter.jobs;
+    waiter.jobs = job;
+    waiter.last_background = job->last_pid;
+}
+
+// Reaps finished background jobs, reporting them when interactive.
+void jobs_reap(bool report) {
+    if (waiter.jobs == NULL) {
+        return;
+    }
+    while (waiter_run(0) > 0) {
+    }
+    for (struct job **pj = &waiter.jobs; *pj != NULL;) {
+        struct job *job = *pj;
+        if (job->nrunning > 0) {
+            pj = &job->next;
+            continue;
+        }
+        if (report) {
+            int st = job->status;
+            if (job->timed_out) {
+                out_printf("[%d]  Timed out\t\t%s\n", job->id, job->text);
+            } else if (WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+                out_printf("[%d]  Done\t\t%s\n", job->id, job->text);
+            } else if (WIFEXITED(st)) {
+                out_printf("[%d]  Exit %d\t\t%s\n", job->id, WEXITSTATUS(st), job->text);
+            } else {
+                out_printf("[%d]  %s\t\t%s\n", job->id, strsignal(WTERMSIG(st)), job->text);
+            }
+        }
+        *pj = job->next;
+        free(job->text);
+        free(job);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Line editor.
+//
+// With a terminal on stdin the prompt is read in raw mode.  Every change is
+// rendered into the line we want on screen (prompt + visible part of the
+// buffer) and compared with what is there already; only the cells from the
+// first difference onwards are rewritten, in a single write().
+// ---------------------------------------------------------------------------
+
+struct editor {
+    const char *prompt;
+    struct strbuf buf;
+    size_t pos;                     // cursor, byte offset into buf
+    unsigned version;               // bumped on every edit
+
+    struct strbuf shown;            // what is on the screen right now
+    size_t shown_col;               // where the terminal cursor is
+    int cols;
+
+    // history recall: offset of the record being shown, or hist.len for
+    // the line being typed (saved in draft)
+    long hist_pos;
+    char *draft;
+
+    // incremental search
+    bool searching;
+    struct strbuf query;
+    size_t match;                   // index into hist.results
+
+    // completion waiting for the cache worker
+    bool completion_pending;
+    unsigned completion_version;
+    bool last_key_tab;
+};
+
+struct termios saved_termios;
+bool raw_mode = false;
+
+// While the prompt is up the shell sleeps in one epoll_wait() on the
+// terminal, the worker pool's notify pipe, a signalfd for SIGWINCH and the
+// child waiter (background jobs finishing).
+struct event_loop {
+    int epfd;
+    int sigfd;
+};
+
+struct event_loop loop = {-1, -1};
+sigset_t child_sigmask;             // mask to restore before exec
+
+// Sets up the event loop and the worker pool.  Signals read through the
+// signalfd are blocked first, so the workers inherit the blocked mask.
+bool event_loop_start(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, &child_sigmask) == -1) {
+        return false;
+    }
+    loop.sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.sigfd == -1 || loop.epfd == -1) {
+        return false;
+    }
+    if (!waiter_start()) {
+        return false;
+    }
+    int fds[4] = {STDIN_FILENO, loop.sigfd, waiter.epfd, -1};
+    dircache_start();
+    if (cache.started) {
+        fds[3] = cache.notify_fd[0];
+    }
+    for (int i = 0; i < 4 && fds[i] >= 0; i++) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void editor_cooked(void) {
+    if (raw_mode) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+        raw_mode = false;
+    }
+}
+
+bool editor_raw(void) {
+    if (raw_mode) {
+        return true;
+    }
+    struct termios raw;
+    if (tcgetattr(STDIN_FILENO, &saved_termios) == -1) {
+        return false;
+    }
+    raw = saved_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        return false;
+    }
+    raw_mode = true;
+    return true;
+}
+
+// Number of terminal columns taken by s (UTF-8 continuation bytes are free).
+size_t text_cols(const char *s, size_t n) {
+    size_t cols = 0;
+    for (size_t i = 0; i < n; i++) {
+        cols += ((unsigned char)s[i] & 0xc0) != 0x80;
+    }
+    return cols;
+}
+
+void editor_refresh(struct editor *ed) {
+    struct strbuf want = {0};
+    size_t cursor;
+
+    if (ed->searching) {
+        uint32_t len = 0;
+        const char *text = "";
+        if (ed->match < hist.nresults) {
+            text = history_text(hist.results[ed->match], &len);
+        }
+        sb_append(&want, "(reverse-i-search)`", 19);
+        sb_append(&want, ed->query.data ? ed->query.data : "", ed->query.len);
+        sb_append(&want, "': ", 3);
+        cursor = text_cols(want.data, want.len);
+        sb_append(&want, text, len);
+    } else {
+        // Scroll horizontally so the cursor stays on screen
+        size_t plen = strlen(ed->prompt);
+        size_t room = ed->cols > (int)plen + 2 ? ed->cols - plen - 1 : 1;
+        size_t start = 0;
+        const char *b = ed->buf.data ? ed->buf.data : "";
+        while (text_cols(b + start, ed->pos - start) >= room) {
+            start++;
+        }
+        size_t end = start;
+        while (end < ed->buf.len && text_cols(b + start, end - start) < room) {
+            end++;
+        }
+        sb_append(&want, ed->prompt, plen);
+        sb_append(&want, b + start, end - start);
+        cursor = text_cols(ed->prompt, plen) + text_cols(b + start, ed->pos - start);
+    }
+    if (want.data == NULL) {
+        sb_append(&want, "", 0);
+    }
+    if ((size_t)ed->cols <= text_cols(want.data, want.len)) {
+        // Keep off the last column so the terminal never wraps
+        size_t cut = want.len;
+        while (cut > 0 && text_cols(want.data, cut) >= (size_t)ed->cols) {
+            cut--;
+        }
+        want.len = cut;
+        want.data[cut] = '\0';
+        if (cursor > text_cols(want.data, want.len)) {
+            cursor = text_cols(want.data, want.len);
+        }
+    }
+
+    // Find the first cell that differs from what is on screen
+    size_t same = 0;
+    while (same < want.len && same < ed->shown.len && want.data[same] == ed->shown.data[same]) {
+        same++;
+    }
+    while (same > 0 && ((unsigned char)want.data[same] & 0xc0) == 0x80) {
+        same--;    // don't split a UTF-8 sequence
+    }
+    if (same == want.len && same == ed->shown.len && cursor == ed->shown_col) {
+        free(want.data);
+        return;
+    }
+
+    struct strbuf out = {0};
+    char seq[32];
+    size_t same_col = text_cols(want.data, same);
+    if (same < want.len || same < ed->shown.len) {
+        if (ed->shown_col > same_col) {
+            sb_append(&out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", ed->shown_col - same_col));
+        } else if (ed->shown_col < same_col) {
+            sb_append(&out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", same_col - ed->shown_col));
+        }
+        sb_append(&out, want.data + same, want.len - same);
+        if (text_cols(ed->shown.data ? ed->shown.data : "", ed->shown.len) >
+            text_cols(want.data, want.len)) {
+            sb_append(&out, "\x1b[K", 3);
+        }
+        ed->shown_col = text_cols(want.data, want.len);
+    }
+    if (cursor < ed->shown_col) {
+        sb_append(&out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", ed->shown_col - cursor));
+    } else if (cursor > ed->shown_col) {
+        sb_append(&out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", cursor - ed->shown_col));
+    }
+    ed->shown_col = cursor;
+    out_queue(STDOUT_FILENO, out.data, out.len);
+    out_flush();
+    free(out.data);
+    free(ed->shown.data);
+    ed->shown = want;
+}
+
+void editor_set(struct editor *ed, const char *text, size_t len) {
+    ed->buf.len = 0;
+    sb_append(&ed->buf, text, len);
+    ed->pos = len;
+    ed->version++;
+}
+
+void editor_insert(struct editor *ed, const char *s, size_t n) {
+    sb_append(&ed->buf, s, n);      // grow, then shift the tail right
+    memmove(ed->buf.data + ed->pos + n, ed->buf.data + ed->pos, ed->buf.len - n - ed->pos);
+    memcpy(ed->buf.data + ed->pos, s, n);
+    ed->pos += n;
+    ed->version++;
+}
+
+void editor_delete(struct editor *ed, size_t from, size_t to) {
+    memmove(ed->buf.data + from, ed->buf.data + to, ed->buf.len - to + 1);
+    ed->buf.len -= to - from;
+    ed->pos = from;
+    ed->version++;
+}
+
+size_t utf8_prev(const char *s, size_t pos) {
+    while (pos > 0 && ((unsigned char)s[--pos] & 0xc0) == 0x80) {
+    }
+    return pos;
+}
+
+size_t utf8_next(const char *s, size_t len, size_t pos) {
+    while (pos < len && ((unsigned char)s[++pos] & 0xc0) == 0x80) {
+    }
+    return pos;
+}
+
+// Moves through history: dir -1 is older, +1 is newer.
+void editor_history(struct editor *ed, int dir) {
+    long pos;
+    if (dir < 0) {
+        pos = history_prev(ed->hist_pos);
+        if (pos < 0) {
+            return;
+        }
+        if ((size_t)ed->hist_pos == hist.len) {
+            free(ed->draft);
+            ed->draft = strndup(ed->buf.data ? ed->buf.data : "", ed->buf.len);
+        }
+    } else {
+        if ((size_t)ed->hist_pos == hist.len) {
+            return;
+        }
+        pos = history_next(ed->hist_pos + HIST_OVERHEAD + get_u32(hist.base + ed->hist_pos + 4));
+    }
+    if (pos < 0) {
+        ed->hist_pos = hist.len;
+        editor_set(ed, ed->draft ? ed->draft : "", ed->draft ? strlen(ed->draft) : 0);
+        return;
+    }
+    uint32_t len;
+    const char *text = history_text(pos, &len);
+    ed->hist_pos = pos;
+    editor_set(ed, text, len);
+}
+
+// Prints candidates under the prompt, then redraws the prompt.
+void editor_list(struct editor *ed, char **names, size_t n) {
+    struct strbuf out = {0};
+    sb_append(&out, "\r\n", 2);
+    size_t width = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(names[i]);
+        width = len > width ? len : width;
+    }
+    width += 2;
+    size_t per_row = ed->cols > (int)width ? ed->cols / width : 1;
+    for (size_t i = 0; i < n; i++) {
+        sb_append(&out, names[i], strlen(names[i]));
+        if ((i + 1) % per_row == 0 || i + 1 == n) {
+            sb_append(&out, "\r\n", 2);
+        } else {
+            for (size_t pad = strlen(names[i]); pad < width; pad++) {
+                sb_putc(&out, ' ');
+            }
+        }
+    }
+    if (write(STDOUT_FILENO, out.data, out.len) < 0) {
+        // ignore
+    }
+    free(out.data);
+    ed->shown.len = 0;
+    ed->shown_col = 0;
+}
+
+// Completes the word before the cursor.  Returns false if the listing it
+// needs is not cached yet (the worker has been asked for it).
+bool editor_complete(struct editor *ed) {
+    const char *b = ed->buf.data ? ed->buf.data : "";
+    size_t start = ed->pos;
+    while (start > 0 && strchr(" \t|<>;", b[start - 1]) == NULL) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && (b[before - 1] == ' ' || b[before - 1] == '\t')) {
+        before--;
+    }
+    bool command = before == 0 || b[before - 1] == '|' || b[before - 1] == ';';
+    if (before >= 4 && (strncmp(b + before - 4, "then", 4) == 0 ||
+                        strncmp(b + before - 4, "else", 4) == 0) &&
+        (before == 4 || b[before - 5] == ' ')) {
+        command = true;
+    }
+    char *word = strndup(b + start, ed->pos - start);
+    char *slash = strrchr(word, '/');
+    command = command && slash == NULL;
+
+    const char *prefix = slash ? slash + 1 : word;
+    size_t plen = strlen(prefix);
+    char dir[4096];
+    if (!command) {
+        char cwd[2048] = ".";
+        if (slash != NULL && word[0] == '/') {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word + 1), word);
+        } else {
+            if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                strcpy(cwd, ".");
+            }
+            snprintf(dir, sizeof(dir), "%s/%.*s", cwd, slash ? (int)(slash - word + 1) : 0, word);
+        }
+        // Listings are keyed like getcwd() spells them: no trailing slash
+        size_t dlen = strlen(dir);
+        while (dlen > 1 && dir[dlen - 1] == '/') {
+            dir[--dlen] = '\0';
+        }
+    }
+
+    // Collect the matches under the lock; the worker may swap listings
+    struct argv_buf matches = {0};
+    struct strbuf dirs = {0};
+    bool ready = true;
+    pthread_mutex_lock(&cache.lock);
+    if (command) {
+        for (int i = 0; i < num_builtins(); i++) {
+            if (strncmp(builtins[i].name, prefix, plen) == 0) {
+                argv_push(&matches, strdup(builtins[i].name));
+                sb_putc(&dirs, 0);
+            }
+        }
+        if (!cache.path_ready) {
+            ready = false;
+        }
+        // Binary search for the first command with the prefix
+        size_t lo = 0, hi = cache.ncommands;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (strncmp(cache.commands[mid].name, prefix, plen) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < cache.ncommands && strncmp(cache.commands[lo].name, prefix, plen) == 0; lo++) {
+            argv_push(&matches, strdup(cache.commands[lo].name));
+            sb_putc(&dirs, 0);
+        }
+    } else {
+        struct dir_listing *l = dircache_find(dir);
+        if (l == NULL) {
+            ready = false;
+            dircache_request(dir, false);
+        } else {
+            if (time(NULL) - l->checked >= DIRCACHE_REVALIDATE) {
+                dircache_request(dir, false);
+            }
+            for (size_t i = 0; i < l->n; i++) {
+                const char *name = l->names + l->offsets[i];
+                if (strncmp(name, prefix, plen) == 0 && (name[0] != '.' || prefix[0] == '.')) {
+                    argv_push(&matches, strdup(name));
+                    sb_putc(&dirs, l->types[i] == DT_DIR);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (!ready && matches.n == 0) {
+        free(word);
+        free(dirs.data);
+        free(matches.v);
+        return false;
+    }
+    if (matches.n == 1) {
+        const char *rest = matches.v[0] + plen;
+        editor_insert(ed, rest, strlen(rest));
+        editor_insert(ed, dirs.data[0] ? "/" : " ", 1);
+    } else if (matches.n > 1) {
+        // Extend to the longest common prefix; list on a second Tab
+        size_t common = strlen(matches.v[0]);
+        for (int i = 1; i < matches.n; i++) {
+            size_t j = 0;
+            while (j < common && matches.v[i][j] == matches.v[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+        if (common > plen) {
+            editor_insert(ed, matches.v[0] + plen, common - plen);
+        } else if (ed->last_key_tab) {
+            editor_list(ed, matches.v, matches.n);
+        }
+    }
+    for (int i = 0; i < matches.n; i++) {
+        free(matches.v[i]);
+    }
+    free(matches.v);
+    free(dirs.data);
+    free(word);
+    return true;
+}
+
+void editor_search_update(struct editor *ed) {
+    history_search(ed->query.data ? ed->query.data : "");
+    ed->match = 0;
+}
+
+// Leaves search mode, keeping the match in the buffer.
+void editor_search_accept(struct editor *ed) {
+    ed->searching = false;
+    if (ed->match < hist.nresults) {
+        uint32_t len;
+        const char *text = history_text(hist.results[ed->match], &len);
+        editor_set(ed, text, len);
+    }
+}
+
+// Reads a key, collapsing escape sequences into one code.
+enum {
+    KEY_LEFT = 1000, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DELETE, KEY_ESC
+};
+
+int editor_read_key(void) {
+    unsigned char c;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    if (c != 0x1b) {
+        return c;
+    }
+    // An escape sequence arrives in one burst; a lone ESC does not
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    unsigned char seq[3];
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1) {
+        return KEY_ESC;
+    }
+    if (seq[0] != '[' && seq[0] != 'O') {
+        return KEY_ESC;
+    }
+    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        return KEY_ESC;
+    }
+    if (seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') {
+            return KEY_ESC;
+        }
+        switch (seq[1]) {
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '3': return KEY_DELETE;
+        }
+        return KEY_ESC;
+    }
+    switch (seq[1]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    }
+    return KEY_ESC;
+}
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+
+// Reads one line with editing.  Returns it malloc'd with a trailing newline,
+// or NULL at end of input.
+char *editor_read_line(const char *prompt) {
+    struct editor ed = {0};
+    struct winsize ws;
+    char *result = NULL;
+
+    if (!editor_raw()) {
+        out_flush();
+        return NULL;
+    }
+    ed.prompt = prompt;
+    ed.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    history_open();
+    history_refresh();
+    ed.hist_pos = hist.len;
+    prefetch_idle();
+    sb_append(&ed.buf, "", 0);
+    out_queue(STDOUT_FILENO, "\r", 1);     // goes out with the prompt
+
+    while (1) {
+        editor_refresh(&ed);
+
+        struct epoll_event events[4];
+        int nevents = epoll_wait(loop.epfd, events, 4, -1);
+        bool key_ready = false;
+        for (int i = 0; i < nevents; i++) {
+            int fd = events[i].data.fd;
+            if (fd == STDIN_FILENO) {
+                key_ready = true;
+            } else if (fd == loop.sigfd) {
+                struct signalfd_siginfo si;
+                while (read(loop.sigfd, &si, sizeof(si)) == sizeof(si)) {
+                }
+                // Resized: redraw the whole line at the new width
+                if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+                    ed.cols = ws.ws_col;
+                }
+                if (write(STDOUT_FILENO, "\r\x1b[K", 4) < 0) {
+                    // ignore
+                }
+                ed.shown.len = ed.shown_col = 0;
+            } else if (fd == waiter.epfd) {
+                waiter_run(0);      // reaped now, reported at the next prompt
+            } else {
+                char drain[64];
+                while (read(cache.notify_fd[0], drain, sizeof(drain)) > 0) {
+                }
+                // Finish a completion if nothing was typed in the meantime
+                if (ed.completion_pending && ed.completion_version == ed.version) {
+                    ed.completion_pending = !editor_complete(&ed);
+                }
+            }
+        }
+        if (!key_ready) {
+            continue;
+        }
+
+        int key = editor_read_key();
+        bool tab = key == '\t';
+        if (ed.searching) {
+            if (key == KEY_CTRL('r')) {
+                if (ed.match + 1 < hist.nresults) {
+                    ed.match++;
+                }
+                continue;
+            } else if (key == 127 || key == KEY_CTRL('h')) {
+                if (ed.query.len > 0) {
+                    ed.query.data[--ed.query.len] = '\0';
+                    editor_search_update(&ed);
+                }
+                continue;
+            } else if (key == KEY_CTRL('g') || key == KEY_ESC) {
+                ed.searching = false;
+                continue;
+            } else if (key >= 32 && key < 127) {
+                sb_putc(&ed.query, key);
+                editor_search_update(&ed);
+                continue;
+            }
+            editor_search_accept(&ed);   // any other key acts on the match
+        }
+
+        const char *b = ed.buf.data;
+        switch (key) {
+        case -1:
+        case KEY_CTRL('d'):
+            if (key == KEY_CTRL('d') && ed.buf.len > 0) {
+                if (ed.pos < ed.buf.len) {
+                    editor_delete(&ed, ed.pos, utf8_next(b, ed.buf.len, ed.pos));
+                }
+                break;
+            }
+            goto done;
+        case '\r':
+        case '\n':
+            ed.pos = ed.buf.len;
+            editor_refresh(&ed);
+            result = xmalloc(ed.buf.len + 2);
+            memcpy(result, ed.buf.data, ed.buf.len);
+            memcpy(result + ed.buf.len, "\n", 2);
+            goto done;
+        case KEY_CTRL('c'):
+            if (write(STDOUT_FILENO, "^C\r\n", 4) < 0) {
+                // ignore
+            }
+            ed.shown.len = ed.shown_col = 0;
+            editor_set(&ed, "", 0);
+            ed.hist_pos = hist.len;
+            break;
+        case 127:
+        case KEY_CTRL('h'):
+            if (ed.pos > 0) {
+                editor_delete(&ed, utf8_prev(b, ed.pos), ed.pos);
+            }
+            break;
+        case KEY_DELETE:
+            if (ed.pos < ed.buf.len) {
+                editor_delete(&ed, ed.pos, utf8_next(b, ed.buf.len, ed.pos));
+            }
+            break;
+        case KEY_LEFT:
+        case KEY_CTRL('b'):
+            ed.pos = utf8_prev(b, ed.pos);
+            break;
+        case KEY_RIGHT:
+        case KEY_CTRL('f'):
+            ed.pos = utf8_next(b, ed.buf.len, ed.pos);
+            break;
+        case KEY_HOME:
+        case KEY_CTRL('a'):
+            ed.pos = 0;
+            break;
+        case KEY_END:
+        case KEY_CTRL('e'):
+            ed.pos = ed.buf.len;
+            break;
+        case KEY_CTRL('k'):
+            editor_delete(&ed, ed.pos, ed.buf.len);
+            break;
+        case KEY_CTRL('u'):
+            editor_delete(&ed, 0, ed.pos);
+            break;
+        case KEY_CTRL('w'): {
+            size_t from = ed.pos;
+            while (from > 0 && b[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && b[from - 1] != ' ') {
+                from--;
+            }
+            editor_delete(&ed, from, ed.pos);
+            break;
+        }
+        case KEY_CTRL('l'):
+            if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0) {
+                // ignore
+            }
+            ed.shown.len = ed.shown_col = 0;
+            break;
+        case KEY_UP:
+        case KEY_CTRL('p'):
+            editor_history(&ed, -1);
+            break;
+        case KEY_DOWN:
+        case KEY_CTRL('n'):
+            editor_history(&ed, 1);
+            break;
+        case KEY_CTRL('r'):
+            ed.searching = true;
+            ed.query.len = 0;
+            sb_append(&ed.query, "", 0);
+            editor_search_update(&ed);
+            break;
+        case '\t':
+            ed.completion_pending = !editor_complete(&ed);
+            ed.completion_version = ed.version;
+            break;
+        default:
+            if (key >= 32 && key < 256 && key != 127) {
+                char c = key;
+                editor_insert(&ed, &c, 1);
+            }
+        }
+        ed.last_key_tab = tab;
+    }
+
+done:
+    if (write(STDOUT_FILENO, "\r\n", 2) < 0) {
+        // ignore
+    }
+    editor_cooked();
+    free(ed.buf.data);
+    free(ed.shown.data);
+    free(ed.query.data);
+    free(ed.draft);
+    return result;
+}
+
+
+char *read_line_fd(int fd) {
+    // Lines are cut out of our own read() buffer rather than a stdio stream.
+    // A FILE on the script would be synced by exit() in any forked child,
+    // seeking the shared descriptor back so the parent re-reads lines.
+    static char buf[65536];
+    static size_t start = 0, end = 0;
+    static int buf_fd = -1;
+    if (buf_fd != fd) {
+        start = end = 0;
+        buf_fd = fd;
+    }
+
+    struct strbuf line = {0};
+    while (1) {
+        char *nl = memchr(buf + start, '\n', end - start);
+        if (nl != NULL) {
+            sb_append(&line, buf + start, nl + 1 - (buf + start));
+            start = nl + 1 - buf;
+            return line.data;
+        }
+        sb_append(&line, buf + start, end - start);
+        start = end = 0;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Return NULL to indicate end-of-file or error
+            return line.len > 0 ? line.data : (free(line.data), NULL);
+        }
+        end = n;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Lexing and expansion.
+//
+// lex_line() cuts a line into raw words (quotes still in place) and operator
+// tokens.  Operators are returned as pointers into op_table, so a quoted word
+// that merely looks like one (e.g. "|") is never mistaken for an operator.
+// expand_word() then performs $ expansion, quote removal, field splitting
+// and wildcard expansion on each raw word.
+// ---------------------------------------------------------------------------
+
+// The two here-document operators differ only in whether the body is
+// expanded (unquoted delimiter) or taken literally (quoted delimiter).
+enum {
+    OP_PIPE, OP_IN, OP_OUT, OP_APPEND, OP_HEREDOC, OP_HEREDOC_RAW, OP_HERESTR,
+    OP_DUP_IN, OP_DUP_OUT, OP_SEMI, OP_BG, NUM_OPS
+};
+char op_table[NUM_OPS][4] = {"|", "<", ">", ">>", "<<", "<<", "<<<", "<&", ">&", ";", "&"};
+
+#define IS_OP(tok, kind) ((tok) == op_table[kind])
+
+bool is_op(const char *tok) {
+    return (uintptr_t)tok >= (uintptr_t)op_table[0] &&
+           (uintptr_t)tok < (uintptr_t)op_table[NUM_OPS];
+}
+
+char *read_line_fd(int fd);
+
+bool is_op_char(char c) {
+    return c == '|' || c == '<' || c == '>' || c == '&' || c == ';';
+}
+
+const char *skip_subst(const char *p);
+
+// Skips a quoted string or backquoted command starting at p.  Returns the
+// position after the closing quote, or NULL if it is never closed.
+const char *skip_quoted(const char *p) {
+    char quote = *p;
+    if (quote == '\'') {
+        p = strchr(p + 1, '\'');
+        return p ? p + 1 : NULL;
+    }
+    for (p++; *p != quote; p++) {
+        if (*p == '\0') {
+            return NULL;
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (quote == '"' && p[0] == '$' && p[1] == '(') {
+            p = skip_subst(p);
+            if (p == NULL) {
+                return NULL;
+            }
+            p--;
+        } else if (quote == '"' && *p == '`') {
+            p = skip_quoted(p);
+            if (p == NULL) {
+                return NULL;
+            }
+            p--;
+        }
+    }
+    return p + 1;
+}
+
+// Skips "$(...)" starting at p (p points at '$'), honouring nested
+// parentheses and quotes.  Returns the position after the closing ')'.
+const char *skip_subst(const char *p) {
+    int depth = 0;
+    for (p++; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (--depth == 0) {
+                return p + 1;
+            }
+        } else if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+            if (p == NULL) {
+                return NULL;
+            }
+            p--;
+        }
+    }
+    return NULL;
+}
+
+// Returns a pointer just past the word starting at p, or NULL if a quote or
+// substitution is left open.
+const char *scan_word(const char *p) {
+    while (*p != '\0' && strchr(DELIM, *p) == NULL && !is_op_char(*p)) {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+        } else if (p[0] == '$' && p[1] == '(') {
+            p = skip_subst(p);
+        } else {
+            p++;
+        }
+        if (p == NULL) {
+            return NULL;
+        }
+    }
+    return p;
+}
+
+// Where here-document bodies are read from: the fd main_loop() reads
+// commands from, or -1 when there is no such input (command substitution).
+int script_fd = -1;
+bool show_prompts = false;
+bool use_editor = false;
+
+char *editor_read_line(const char *prompt);
+
+// Next line of shell input, prompting first in interactive mode.
+char *read_input_line(const char *prompt) {
+    if (script_fd < 0) {
+        return NULL;
+    }
+    if (use_editor) {
+        return editor_read_line(prompt);
+    }
+    if (show_prompts) {
+        out_queue(STDOUT_FILENO, prompt, strlen(prompt));
+    }
+    out_flush();        // with the prompt, if any, in one writev()
+    return read_line_fd(script_fd);
+}
+
+// Reads a here-document body up to the delimiter line.  With strip, leading
+// tabs are removed from every line (<<-).
+char *read_heredoc_body(const char *delim, bool strip) {
+    struct strbuf body = {0};
+    char *line;
+    while (1) {
+        line = read_input_line("> ");
+        if (line == NULL) {
+            err_printf("mysh: here-document delimited by end-of-file (wanted `%s')\n", delim);
+            break;
+        }
+        char *text = line;
+        while (strip && *text == '\t') {
+            text++;
+        }
+        size_t len = strcspn(text, "\n");
+        if (len == strlen(delim) && strncmp(text, delim, len) == 0) {
+            free(line);
+            break;
+        }
+        sb_append(&body, text, strlen(text));
+        free(line);
+    }
+    char *result = arena_strndup(&line_arena, body.data ? body.data : "", body.len);
+    free(body.data);
+    return result;
+}
+
+// Splits line into raw tokens allocated in line_arena.  A here-document's
+// body is read from script_fd once the line is done and stored as the token
+// after its operator.  Returns NULL after printing a message on a syntax
+// error.
+char **lex_line(const char *line) {
+    struct argv_buf tokens = {0};
+    const char *p = line;
+    int pending[16], npending = 0;    // token indices of unread bodies
+    bool strip[16];
+
+    argv_push(&tokens, NULL);
+    tokens.n = 0;
+    while (1) {
+        while (*p != '\0' && strchr(DELIM, *p) != NULL) {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            break;
+        }
+        if (*p == '|') {
+            argv_push(&tokens, op_table[OP_PIPE]);
+            p++;
+        } else if (*p == '&') {
+            argv_push(&tokens, op_table[OP_BG]);
+            p++;
+        } else if (*p == ';') {
+            argv_push(&tokens, op_table[OP_SEMI]);
+            p++;
+        } else if (strncmp(p, "<<<", 3) == 0) {
+            argv_push(&tokens, op_table[OP_HERESTR]);
+            p += 3;
+        } else if (strncmp(p, "<<", 2) == 0) {
+            bool tabs = p[2] == '-';
+            p += tabs ? 3 : 2;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            const char *end = *p ? scan_word(p) : p;
+            if (end == NULL || end == p || npending == 16) {
+                err_printf("Syntax error: bad here-document delimiter\n");
+                free(tokens.v);
+                return NULL;
+            }
+            // Quoting any part of the delimiter turns off expansion.
+            bool quoted = false;
+            char *delim = arena_alloc(&line_arena, end - p + 1), *d = delim;
+            for (; p < end; p++) {
+                if (*p == '\'' || *p == '"' || *p == '\\') {
+                    quoted = true;
+                } else {
+                    *d++ = *p;
+                }
+            }
+            *d = '\0';
+            argv_push(&tokens, op_table[quoted ? OP_HEREDOC_RAW : OP_HEREDOC]);
+            strip[npending] = tabs;
+            pending[npending++] = tokens.n;
+            argv_push(&tokens, delim);
+        } else if ((*p == '<' || *p == '>') && p[1] == '&') {
+            argv_push(&tokens, op_table[*p == '<' ? OP_DUP_IN : OP_DUP_OUT]);
+            p += 2;
+        } else if (*p == '<') {
+            argv_push(&tokens, op_table[OP_IN]);
+            p++;
+        } else if (*p == '>' && p[1] == '>') {
+            argv_push(&tokens, op_table[OP_APPEND]);
+            p += 2;
+        } else if (*p == '>') {
+            argv_push(&tokens, op_table[OP_OUT]);
+            p++;
+        } else {
+            const char *end = scan_word(p);
+            if (end == NULL) {
+                err_printf("Syntax error: unterminated quote or substitution\n");
+                free(tokens.v);
+                return NULL;
+            }
+            argv_push(&tokens, arena_strndup(&line_arena, p, end - p));
+            p = end;
+        }
+    }
+    for (int i = 0; i < npending; i++) {
+        tokens.v[pending[i]] = read_heredoc_body(tokens.v[pending[i]], strip[i]);
+    }
+    char **out = arena_alloc(&line_arena, (tokens.n + 1) * sizeof(char *));
+    memcpy(out, tokens.v, (tokens.n + 1) * sizeof(char *));
+    free(tokens.v);
+    return out;
+}
+
+// Word being assembled by expand_word().  pattern mirrors text but with the
+// quoted glob characters escaped, so it can be handed to glob() when the word
+// contains an unquoted wildcard.
+struct word_state {
+    struct strbuf text;
+    struct strbuf pattern;
+    bool started;          // a field exists even if empty (e.g. "")
+    bool has_glob;
+    bool split;
+    struct argv_buf *out;
+};
+
+char *command_subst(const char *text, size_t len);
+bool arith_expand(const char *text, size_t len, long long *v);
+
+// Set by an expansion that failed, with the error reported; the command
+// is then not run
+bool expansion_error = false;
+
+void word_add(struct word_state *w, char c, bool quoted) {
+    sb_putc(&w->text, c);
+    if (quoted && strchr("*?[]\\", c) != NULL) {
+        sb_putc(&w->pattern, '\\');
+    } else if (!quoted && (c == '*' || c == '?' || c == '[')) {
+        w->has_glob = true;
+    }
+    sb_putc(&w->pattern, c);
+    w->started = true;
+}
+
+void word_finish(struct word_state *w) {
+    if (w->started) {
+        glob_t glob_result;
+        int n = w->out->n;
+        if (w->split && w->has_glob && glob_cached(w->pattern.data, w->out)) {
+            if (w->out->n == n) {
+                argv_push(w->out, arena_strndup(&line_arena, w->text.data, w->text.len));
+            }
+        } else if (w->split && w->has_glob &&
+                   glob(w->pattern.data, GLOB_TILDE, NULL, &glob_result) == 0) {
+            for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
+                char *path = glob_result.gl_pathv[i];
+                argv_push(w->out, arena_strndup(&line_arena, path, strlen(path)));
+            }
+            globfree(&glob_result);
+        } else {
+            argv_push(w->out, arena_strndup(&line_arena, w->text.data ? w->text.data : "",
+                                            w->text.len));
+        }
+    }
+    w->text.len = w->pattern.len = 0;
+    w->started = w->has_glob = false;
+}
+
+// Appends the result of an expansion.  Unquoted results are split on IFS
+// when the word allows splitting; the characters themselves are literal.
+void word_add_expansion(struct word_state *w, const char *value, bool quoted) {
+    if (quoted) {
+        w->started = true;
+    }
+    for (const char *p = value; *p != '\0'; p++) {
+        if (!quoted && w->split && strchr(IFS, *p) != NULL) {
+            word_finish(w);
+        } else {
+            word_add(w, *p, true);
+        }
+    }
+}
+
+// Appends the output of a backquoted command starting at p.  Backslashes
+// only escape $, ` and \ inside backquotes.  An unclosed backquote (only
+// possible in a here-document) is literal.
+const char *expand_backquote(struct word_state *w, const char *p, bool quoted) {
+    const char *end = skip_quoted(p);
+    if (end == NULL) {
+        word_add(w, '`', quoted);
+        return p + 1;
+    }
+    struct strbuf text = {0};
+    for (p++; p < end - 1; p++) {
+        if (*p == '\\' && strchr("$`\\", p[1]) != NULL) {
+            p++;
+        }
+        sb_putc(&text, *p);
+    }
+    word_add_expansion(w, command_subst(text.data ? text.data : "", text.len), quoted);
+    free(text.data);
+    return end;
+}
+
+// Parses the $-expression at p (p points at '$') and appends its value.
+// Returns the position after it.
+const char *expand_dollar(struct word_state *w, const char *p, bool quoted) {
+    char num[32];
+    const char *name;
+    size_t len;
+
+    p++;
+    if (*p == '?') {
+        snprintf(num, sizeof(num), "%d", last_exit_status);
+        word_add_expansion(w, num, quoted);
+        return p + 1;
+    }
+    if (*p == '$') {
+        snprintf(num, sizeof(num), "%d", (int)getpid());
+        word_add_expansion(w, num, quoted);
+        return p + 1;
+    }
+    if (*p == '!') {
+        if (waiter.last_background > 0) {
+            snprintf(num, sizeof(num), "%d", (int)waiter.last_background);
+            word_add_expansion(w, num, quoted);
+        }
+        return p + 1;
+    }
+    if (*p == '#') {
+        snprintf(num, sizeof(num), "%d", params.argc);
+        word_add_expansion(w, num, quoted);
+        return p + 1;
+    }
+    if (*p == '@' || *p == '*') {
+        // "$@" is one field per parameter, and none without parameters
+        bool fields = *p == '@' && quoted && w->split;
+        if (fields && params.argc == 0 && w->text.len == 0) {
+            w->started = false;
+        }
+        for (int i = 0; i < params.argc; i++) {
+            if (i > 0 && fields) {
+                word_finish(w);
+                w->started = true;
+            } else if (i > 0) {
+                word_add_expansion(w, " ", quoted);
+            }
+            word_add_expansion(w, params.argv[i], quoted);
+        }
+        return p + 1;
+    }
+    if (*p >= '0' && *p <= '9') {
+        const char *value = param_get(*p - '0');
+        if (value != NULL) {
+            word_add_expansion(w, value, quoted);
+        }
+        return p + 1;
+    }
+    if (*p == '(') {
+        const char *end = skip_subst(p - 1);
+        if (end == NULL) {
+            word_add(w, '$', quoted);   // unclosed, as in a here-document
+            return p;
+        }
+        if (p[1] == '(' && end[-2] == ')') {
+            long long v;
+            if (arith_expand(p + 2, end - 2 - (p + 2), &v)) {
+                snprintf(num, sizeof(num), "%lld", v);
+                word_add_expansion(w, num, quoted);
+            }
+            return end;
+        }
+        word_add_expansion(w, command_subst(p + 1, end - 1 - (p + 1)), quoted);
+        return end;
+    }
+    if (*p == '{') {
+        const char *close = strchr(p, '}');
+        if (close == NULL || close == p + 1) {
+            word_add(w, '$', quoted);
+            return p;
+        }
+        name = p + 1;
+        len = close - name;
+        p = close + 1;
+    } else if (is_name_start(*p)) {
+        name = p;
+        while (is_name_char(*p)) {
+            p++;
+        }
+        len = p - name;
+    } else {
+        word_add(w, '$', quoted);   // a lone '$' is literal
+        return p;
+    }
+    const char *value;
+    if (name[0] >= '0' && name[0] <= '9') {
+        value = param_get(atoi(name));     // ${10}
+    } else {
+        value = var_get_n(name, len);
+    }
+    if (value != NULL) {
+        word_add_expansion(w, value, quoted);
+    }
+    return p;
+}
+
+// How expand_word() treats a word: split into fields and globbed (command
+// words), kept as one field (assignments, redirection targets), or treated
+// as a here-document body where only $, ` and \ are special.
+enum { WORD_SPLIT, WORD_SINGLE, WORD_HEREDOC };
+
+// Expands one raw word and appends the resulting field(s) to out.
+void expand_word(const char *raw, int mode, struct argv_buf *out) {
+    // Command substitutions expand words recursively; keep one state per
+    // nesting level so the buffers are reused rather than reallocated.
+    static struct word_state states[16];
+    static int depth = 0;
+    if (depth == sizeof(states) / sizeof(states[0])) {
+        err_printf("mysh: substitution nested too deeply\n");
+        return;
+    }
+    struct word_state w = states[depth++];
+    w.split = mode == WORD_SPLIT;
+    w.out = out;
+    w.text.len = w.pattern.len = 0;
+    w.started = w.has_glob = false;
+
+    const char *p = raw;
+    while (mode == WORD_HEREDOC && *p != '\0') {
+        if (*p == '\\' && strchr("$`\\", p[1]) != NULL) {
+            word_add(&w, p[1], true);
+            p += 2;
+        } else if (*p == '$') {
+            p = expand_dollar(&w, p, true);
+        } else if (*p == '`') {
+            p = expand_backquote(&w, p, true);
+        } else {
+            word_add(&w, *p++, true);
+        }
+    }
+    while (*p != '\0') {
+        if (*p == '\'') {
+            w.started = true;
+            for (p++; *p != '\''; p++) {
+                word_add(&w, *p, true);
+            }
+            p++;
+        } else if (*p == '"') {
+            w.started = true;
+            for (p++; *p != '"';) {
+                if (*p == '\\' && strchr("$`\"\\", p[1]) != NULL) {
+                    word_add(&w, p[1], true);
+                    p += 2;
+                } else if (*p == '$') {
+                    p = expand_dollar(&w, p, true);
+                } else if (*p == '`') {
+                    p = expand_backquote(&w, p, true);
+                } else {
+                    word_add(&w, *p++, true);
+                }
+            }
+            p++;
+        } else if (*p == '\\' && p[1] != '\0') {
+            word_add(&w, p[1], true);
+            p += 2;
+        } else if (*p == '$') {
+            p = expand_dollar(&w, p, false);
+        } else if (*p == '`') {
+            p = expand_backquote(&w, p, false);
+        } else {
+            word_add(&w, *p++, false);
+        }
+    }
+    if (mode != WORD_SPLIT) {
+        w.started = true;
+    }
+    word_finish(&w);
+    states[--depth] = w;
+}
+
+// A malloc'd empty argument vector.
+char **empty_args(void) {
+    return calloc(1, sizeof(char *));
+}
+
+// Expands the raw tokens of one command.  The returned vector is malloc'd;
+// the strings in it live in line_arena.  Returns NULL on a syntax error or
+// a failed expansion.
+char **expand_tokens(char **raw) {
+    struct argv_buf tokens = {0};
+    bool outer_error = expansion_error;     // of an enclosing substitution
+    expansion_error = false;
+    bool command_position = true;   // only leading NAME=value words assign
+    argv_push(&tokens, NULL);
+    tokens.n = 0;
+    for (int i = 0; raw[i] != NULL; i++) {
+        char *token = raw[i];
+        if (IS_OP(token, OP_HEREDOC) || IS_OP(token, OP_HEREDOC_RAW)) {
+            // The lexer already put the body in the next token
+            argv_push(&tokens, op_table[OP_HEREDOC]);
+            token = raw[++i];
+            if (IS_OP(raw[i - 1], OP_HEREDOC)) {
+                expand_word(token, WORD_HEREDOC, &tokens);
+            } else {
+                argv_push(&tokens, token);
+            }
+        } else if (IS_OP(token, OP_IN) || IS_OP(token, OP_OUT) || IS_OP(token, OP_APPEND) ||
+                   IS_OP(token, OP_HERESTR) || IS_OP(token, OP_DUP_IN) ||
+                   IS_OP(token, OP_DUP_OUT)) {
+            // Handle redirection
+            argv_push(&tokens, token);  // Add the redirection token
+            token = raw[++i];           // The redirection file name
+            if (token == NULL || is_op(token)) {
+                err_printf("Syntax error: Missing file name after redirection\n");
+                free(tokens.v);
+                expansion_error = outer_error;
+                return NULL;
+            }
+            expand_word(token, WORD_SINGLE, &tokens);
+            if (IS_OP(tokens.v[tokens.n - 2], OP_HERESTR)) {
+                // A here-string is a one-line here-document
+                char *word = tokens.v[tokens.n - 1];
+                size_t len = strlen(word);
+                char *body = arena_alloc(&line_arena, len + 2);
+                memcpy(body, word, len);
+                memcpy(body + len, "\n", 2);
+                tokens.v[tokens.n - 2] = op_table[OP_HEREDOC];
+                tokens.v[tokens.n - 1] = body;
+            }
+        } else if (IS_OP(token, OP_BG) && (raw[i + 1] != NULL || i == 0)) {
+            err_printf("Syntax error: '&' must end a command\n");
+            free(tokens.v);
+            expansion_error = outer_error;
+            return NULL;
+        } else if (is_op(token)) {
+            argv_push(&tokens, token);
+            command_position = IS_OP(token, OP_PIPE);
+        } else if (command_position && is_assignment(token)) {
+            expand_word(token, WORD_SINGLE, &tokens);
+        } else {
+            // then/else prefix the command rather than being it
+            if (i > 0 || (strcmp(token, "then") != 0 && strcmp(token, "else") != 0)) {
+                command_position = false;
+            }
+            expand_word(token, WORD_SPLIT, &tokens);
+        }
+    }
+    bool failed = expansion_error;
+    expansion_error = outer_error;
+    if (failed) {
+        free(tokens.v);
+        return NULL;
+    }
+    return tokens.v;
+}
+
+int find_builtin(const char *name) {
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strcmp(name, builtins[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// envp for a command run with leading NAME=value words: the exported
+// environment with those names overridden.  Allocated in line_arena.
+char **command_env(char **assigns, int nassign) {
+    char **base = env_get();
+    size_t n = 0;
+    while (base[n] != NULL) {
+        n++;
+    }
+    char **envp = arena_alloc(&line_arena, (n + nassign + 1) * sizeof(char *));
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool overridden = false;
+        for (int j = 0; j < nassign && !overridden; j++) {
+            size_t len = strchr(assigns[j], '=') - assigns[j] + 1;
+            overridden = strncmp(base[i], assigns[j], len) == 0;
+        }
+        if (!overridden) {
+            envp[m++] = base[i];
+        }
+    }
+    for (int j = 0; j < nassign; j++) {
+        envp[m++] = assigns[j];
+    }
+    envp[m] = NULL;
+    return envp;
+}
+
+// Creates a readable fd holding body for a here-document.  A body that fits
+// in the pipe buffer goes into a pipe (the write cannot block); a larger one
+// goes into a memfd.  Nothing ever touches the filesystem.
+int here_fd(const char *body) {
+    static int pipe_capacity = 0;
+    size_t len = strlen(body);
+    int fds[2];
+
+    if (pipe_capacity == 0) {
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            return -1;
+        }
+        pipe_capacity = fcntl(fds[0], F_GETPIPE_SZ);
+        if (pipe_capacity <= 0) {
+            pipe_capacity = 4096;   // POSIX PIPE_BUF guarantee
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+    if (len <= (size_t)pipe_capacity) {
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            return -1;
+        }
+        if (len > 0 && write(fds[1], body, len) != (ssize_t)len) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    int fd = memfd_create("mysh-heredoc", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(fd, body + off, len - off);
+        if (n < 0 && errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+        off += n > 0 ? n : 0;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// How launch_process() runs a pipeline, from its prefixes and suffix.
+struct launch_opts {
+    bool background;                // trailing &
+    long timeout;                   // ms, 0: none
+    long kill_after;                // ms after the SIGTERM, 0: never
+    int in_fd, out_fd;              // coprocess pipe ends, 0: none
+    struct node **compounds;        // per stage: a loop, or NULL
+};
+
+// One command of a pipeline, with its redirections opened.
+struct stage {
+    char **argv;
+    int in_fd, out_fd;      // -1: inherit, or the pipe
+    char *path;             // resolved from the command cache, or NULL
+    struct stage *run;      // in-process stages run as this one, or NULL
+    int nrun;
+    struct node *compound;  // a loop, run by a forked shell; argv holds
+                            // only its redirections
+    struct function *function;      // a shell function, likewise
+    const struct builtin *builtin;  // a byte builtin, likewise
+};
+
+// A coprocess: a background command whose stdin and stdout are pipes held
+// by the shell, for >&NAME and <&NAME.
+struct coproc {
+    char *name;
+    pid_t pid;
+    int read_fd, write_fd;          // -1 once closed
+    struct coproc *next;
+} *coprocs = NULL;
+
+struct coproc *coproc_find(const char *name) {
+    struct coproc *cp = coprocs;
+    while (cp != NULL && strcmp(cp->name, name) != 0) {
+        cp = cp->next;
+    }
+    return cp;
+}
+
+// Opens the target of <&TARGET or >&TARGET: a copy of a coprocess's pipe
+// end, or of the shell's descriptor TARGET.  Returns -1 with errno set.
+int redirect_dup(const char *target, bool in) {
+    struct coproc *cp = coproc_find(target);
+    char *end;
+    long fd = cp != NULL ? (in ? cp->read_fd : cp->write_fd) : strtol(target, &end, 10);
+    if (cp == NULL && (*target == '\0' || *end != '\0' || fd > INT_MAX)) {
+        fd = -1;
+    }
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+// Strips the redirections out of each stage's argv and opens their targets
+// in the shell, close-on-exec, so that errors show up before anything is
+// forked.  Under MYSH_SANDBOX=ro they are first held to the writable
+// directories.  With io_uring the opens of the whole pipeline go out as one
+// linked batch: they still happen in order and stop at the first failure.
+// Returns -1 (with everything closed again) if a target cannot be opened.
+int open_redirections(struct stage *stages, int nstages) {
+    struct redirection {
+        int *slot;
+        const char *op, *target;
+        int fd;                     // or -errno
+    } *redirs = NULL;
+    int n = 0, cap = 0, nopen = 0;
+
+    for (int k = 0; k < nstages; k++) {
+        char **args = stages[k].argv;
+        int m = 0;
+        stages[k].in_fd = stages[k].out_fd = -1;
+        for (int i = 0; args[i] != NULL; i++) {
+            bool in = IS_OP(args[i], OP_IN) || IS_OP(args[i], OP_HEREDOC) ||
+                      IS_OP(args[i], OP_DUP_IN);
+            if (!in && !IS_OP(args[i], OP_OUT) && !IS_OP(args[i], OP_APPEND) &&
+                !IS_OP(args[i], OP_DUP_OUT)) {
+                args[m++] = args[i];
+                continue;
+            }
+            if (n == cap) {
+                cap = cap ? cap * 2 : 8;
+                struct redirection *grown = arena_alloc(&line_arena, cap * sizeof(*redirs));
+                if (n > 0) {
+                    memcpy(grown, redirs, n * sizeof(*redirs));
+                }
+                redirs = grown;
+            }
+            redirs[n++] = (struct redirection){in ? &stages[k].in_fd : &stages[k].out_fd,
+                                               args[i], args[i + 1], -1};
+            nopen += !IS_OP(args[i], OP_HEREDOC) && !IS_OP(args[i], OP_DUP_IN) &&
+                     !IS_OP(args[i], OP_DUP_OUT);
+            i++;
+        }
+        args[m] = NULL;
+    }
+
+    // Under MYSH_SANDBOX=ro a file the command could not write is not
+    // written for it either
+    for (int i = 0; i < n; i++) {
+        if ((IS_OP(redirs[i].op, OP_OUT) || IS_OP(redirs[i].op, OP_APPEND)) &&
+            !sandbox_may_write(redirs[i].target)) {
+            errno = EROFS;
+            err_perror(redirs[i].target);
+            return -1;
+        }
+    }
+
+    bool batch = nopen > 1 && ring_available();
+    struct io_uring_sqe *last = NULL;
+    for (int i = 0; i < n; i++) {
+        struct redirection *r = &redirs[i];
+        int flags = IS_OP(r->op, OP_IN) ? O_RDONLY
+                  : IS_OP(r->op, OP_OUT) ? O_WRONLY | O_CREAT | O_TRUNC
+                  : O_WRONLY | O_CREAT | O_APPEND;
+        if (IS_OP(r->op, OP_HEREDOC)) {
+            r->fd = here_fd(r->target);
+        } else if (IS_OP(r->op, OP_DUP_IN) || IS_OP(r->op, OP_DUP_OUT)) {
+            r->fd = redirect_dup(r->target, IS_OP(r->op, OP_DUP_IN));
+        } else if (batch) {
+            last = ring_openat(r->target, flags | O_CLOEXEC, 0644, &r->fd);
+            last->flags |= IOSQE_IO_LINK;
+            continue;
+        } else {
+            r->fd = open(r->target, flags | O_CLOEXEC, 0644);
+        }
+        if (r->fd < 0) {
+            r->fd = -errno;
+            if (!batch) {
+                n = i + 1;      // the rest is never attempted
+                break;
+            }
+        }
+    }
+    if (batch) {
+        last->flags &= ~IOSQE_IO_LINK;
+        ring_run();
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct redirection *r = &redirs[i];
+        if (r->fd < 0) {
+            errno = -r->fd;
+            err_perror(IS_OP(r->op, OP_HEREDOC) ? "here-document" : r->target);
+            for (int j = i + 1; j < n; j++) {
+                if (redirs[j].fd >= 0) {
+                    close(redirs[j].fd);
+                }
+            }
+            for (int k = 0; k < nstages; k++) {
+                close_redirections(&stages[k]);
+            }
+            return -1;
+        }
+        if (*r->slot >= 0) {
+            close(*r->slot);
+        }
+        *r->slot = r->fd;
+    }
+    return 0;
+}
+
+void close_redirections(struct stage *st) {
+    if (st->in_fd >= 0) {
+        close(st->in_fd);
+    }
+    if (st->out_fd >= 0) {
+        close(st->out_fd);
+    }
+    st->in_fd = st->out_fd = -1;
+}
+
+// Looks every PATH-searched command of a pipeline up with one batch of
+// statx calls, instead of execvp() trying execve() in each directory.
+// Stages that are not found keep path NULL and fall back to execvp().
+void ring_resolve_paths(struct stage *stages, int nstages) {
+    const char *path = var_get("PATH");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    size_t ndirs = 1;
+    for (const char *p = path; *p; p++) {
+        ndirs += *p == ':';
+    }
+    size_t total = ndirs * nstages;
+    struct statx *stx = arena_alloc(&line_arena, total * sizeof(struct statx));
+    int *res = arena_alloc(&line_arena, total * sizeof(int));
+    char **candidates = arena_alloc(&line_arena, total * sizeof(char *));
+    memset(candidates, 0, total * sizeof(char *));
+
+    bool queued = false;
+    for (int k = 0; k < nstages; k++) {
+        const char *name = stages[k].argv[0];
+        if (stages[k].path != NULL || name == NULL || strchr(name, '/') != NULL) {
+            continue;
+        }
+        size_t nlen = strlen(name);
+        const char *p = path;
+        for (size_t d = 0; d < ndirs; d++) {
+            size_t len = strcspn(p, ":");
+            const char *dir = len ? p : ".";    // an empty entry is the cwd
+            size_t dlen = len ? len : 1;
+            char *c = arena_alloc(&line_arena, dlen + nlen + 2);
+            memcpy(c, dir, dlen);
+            c[dlen] = '/';
+            memcpy(c + dlen + 1, name, nlen + 1);
+            candidates[k * ndirs + d] = c;
+            ring_statx(c, &stx[k * ndirs + d], &res[k * ndirs + d]);
+            queued = true;
+            p += len + (p[len] == ':');
+        }
+    }
+    if (!queued) {
+        return;
+    }
+    ring_run();
+    for (int k = 0; k < nstages; k++) {
+        for (size_t d = 0; d < ndirs && candidates[k * ndirs + d] != NULL; d++) {
+            struct statx *s = &stx[k * ndirs + d];
+            if (res[k * ndirs + d] == 0 && S_ISREG(s->stx_mode) && (s->stx_mode & 0111)) {
+                stages[k].path = candidates[k * ndirs + d];
+                break;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Arithmetic expansion.
+//
+// A $(( )) expression is compiled to a tree, with constant subexpressions
+// folded, and the tree is cached by the expression's text: one in a loop
+// body is parsed on its first pass only.  Variables are read, and assigned
+// by = or ++, when the tree is evaluated.  Integers are 64-bit, as in bash.
+// ---------------------------------------------------------------------------
+
+enum arith_op {
+    A_NUM, A_VAR, A_NEG, A_NOT, A_BITNOT, A_PREINC, A_PREDEC, A_POSTINC, A_POSTDEC,
+    A_POW, A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR, A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE,
+    A_BAND, A_BXOR, A_BOR, A_AND, A_OR, A_COND, A_ASSIGN, A_COMMA
+};
+
+struct arith {
+    enum arith_op op;
+    enum arith_op assign_op;    // A_ASSIGN: the operator of +=, -=...; A_NUM for =
+    long long value;            // A_NUM
+    char *name;                 // A_VAR, A_ASSIGN and the increments
+    struct arith *a, *b, *c;
+};
+
+struct arith_parser {
+    const char *p;              // NUL-terminated
+    struct arena *arena;
+    const char *error;
+};
+
+struct arith_binop {
+    const char *text;
+    enum arith_op op;
+    int prec;
+};
+
+// Binary operators, longer ones first so that "<<" is not taken for "<"
+struct arith_binop arith_binops[] = {
+    {"||", A_OR, 1},  {"&&", A_AND, 2}, {"==", A_EQ, 6},  {"!=", A_NE, 6},  {"<=", A_LE, 7},
+    {">=", A_GE, 7},  {"<<", A_SHL, 8}, {">>", A_SHR, 8}, {"|", A_BOR, 3},  {"^", A_BXOR, 4},
+    {"&", A_BAND, 5}, {"<", A_LT, 7},   {">", A_GT, 7},   {"+", A_ADD, 9},  {"-", A_SUB, 9},
+    {"**", A_POW, 11}, {"*", A_MUL, 10}, {"/", A_DIV, 10}, {"%", A_MOD, 10},
+};
+
+// Assignment operators, with the binary operator each one applies
+struct arith_binop arith_assigns[] = {
+    {"<<=", A_SHL}, {">>=", A_SHR}, {"+=", A_ADD},  {"-=", A_SUB},  {"*=", A_MUL}, {"/=", A_DIV},
+    {"%=", A_MOD},  {"&=", A_BAND}, {"^=", A_BXOR}, {"|=", A_BOR}, {"=", A_NUM},
+};
+
+bool arith_binary(enum arith_op op, long long a, long long b, long long *v, const char **error) {
+    switch (op) {
+    case A_DIV:
+    case A_MOD:
+        if (b == 0) {
+            *error = "division by 0";
+            return false;
+        }
+        if (b == -1) {          // LLONG_MIN / -1 would trap
+            *v = op == A_DIV ? (long long)(0ULL - a) : 0;
+        } else {
+            *v = op == A_DIV ? a / b : a % b;
+        }
+        return true;
+    case A_POW:
+        if (b < 0) {
+            *error = "exponent less than 0";
+            return false;
+        }
+        for (unsigned long long r = 1, x = a;; x *= x) {    // by squaring
+            if (b & 1) {
+                r *= x;
+            }
+            if ((b >>= 1) == 0) {
+                *v = (long long)r;
+                return true;
+            }
+        }
+    case A_MUL: *v = (long long)((unsigned long long)a * b); return true;
+    case A_ADD: *v = (long long)((unsigned long long)a + b); return true;
+    case A_SUB: *v = (long long)((unsigned long long)a - b); return true;
+    case A_SHL: *v = (long long)((unsigned long long)a << (b & 63)); return true;
+    case A_SHR: *v = a >> (b & 63); return true;
+    case A_LT: *v = a < b; return true;
+    case A_LE: *v = a <= b; return true;
+    case A_GT: *v = a > b; return true;
+    case A_GE: *v = a >= b; return true;
+    case A_EQ: *v = a == b; return true;
+    case A_NE: *v = a != b; return true;
+    case A_BAND: *v = a & b; return true;
+    case A_BXOR: *v = a ^ b; return true;
+    case A_BOR: *v = a | b; return true;
+    case A_COMMA: *v = b; return true;
+    default: *v = 0; return true;
+    }
+}
+
+bool arith_run(const char *text, size_t len, long long *v, const char **error, bool cached);
+
+int arith_depth = 0;        // variables whose values are expressions, nested
+
+// The value of a variable or parameter.  Unset or empty is 0; a value that
+// is not a number is evaluated as an expression in turn.
+bool arith_var(const char *name, long long *v, const char **error) {
+    if (name[0] == '#' || name[0] == '?' || name[0] == '$') {
+        *v = name[0] == '#' ? params.argc : name[0] == '?' ? last_exit_status : getpid();
+        return true;
+    }
+    const char *s = name[0] >= '0' && name[0] <= '9' ? param_get(atoi(name)) : var_get(name);
+    *v = 0;
+    if (s == NULL) {
+        return true;
+    }
+    char *end;
+    long long n = strtoll(s, &end, 0);
+    while (*end == ' ' || *end == '\t' || *end == '\n') {
+        end++;
+    }
+    if (*end == '\0') {
+        *v = n;
+        return true;
+    }
+    if (arith_depth == 32) {
+        *error = "expression recursion level exceeded";
+        return false;
+    }
+    arith_depth++;
+    bool ok = arith_run(s, strlen(s), v, error, false);
+    arith_depth--;
+    return ok;
+}
+
+void arith_set(const char *name, long long v) {
+    char num[32];
+    snprintf(num, sizeof(num), "%lld", v);
+    var_set(name, num, 0);
+}
+
+bool arith_eval(const struct arith *e, long long *v, const char **error) {
+    long long a, b;
+    switch (e->op) {
+    case A_NUM:
+        *v = e->value;
+        return true;
+    case A_VAR:
+        return arith_var(e->name, v, error);
+    case A_NEG:
+    case A_NOT:
+    case A_BITNOT:
+        if (!arith_eval(e->a, &a, error)) {
+            return false;
+        }
+        *v = e->op == A_NEG ? (long long)(0ULL - a) : e->op == A_NOT ? !a : ~a;
+        return true;
+    case A_PREINC:
+    case A_PREDEC:
+    case A_POSTINC:
+    case A_POSTDEC:
+        if (!arith_var(e->name, &a, error)) {
+            return false;
+        }
+        b = e->op == A_PREINC || e->op == A_POSTINC ? a + 1 : a - 1;
+        arith_set(e->name, b);
+        *v = e->op == A_PREINC || e->op == A_PREDEC ? b : a;
+        return true;
+    case A_AND:
+    case A_OR:
+        if (!arith_eval(e->a, &a, error)) {
+            return false;
+        }
+        if ((e->op == A_AND) != (a != 0)) {     // decided by the left side
+            *v = a != 0;
+            return true;
+        }
+        if (!arith_eval(e->b, &b, error)) {
+            return false;
+        }
+        *v = b != 0;
+        return true;
+    case A_COND:
+        if (!arith_eval(e->a, &a, error)) {
+            return false;
+        }
+        return arith_eval(a ? e->b : e->c, v, error);
+    case A_ASSIGN:
+        if (!arith_eval(e->a, &b, error)) {
+            return false;
+        }
+        if (e->assign_op != A_NUM &&
+            (!arith_var(e->name, &a, error) || !arith_binary(e->assign_op, a, b, &b, error))) {
+            return false;
+        }
+        arith_set(e->name, b);
+        *v = b;
+        return true;
+    default:
+        if (!arith_eval(e->a, &a, error) || !arith_eval(e->b, &b, error)) {
+            return false;
+        }
+        return arith_binary(e->op, a, b, v, error);
+    }
+}
+
+struct arith *arith_alloc(struct arith_parser *ap, enum arith_op op) {
+    struct arith *e = arena_alloc(ap->arena, sizeof(*e));
+    *e = (struct arith){op};
+    return e;
+}
+
+struct arith *arith_number(struct arith_parser *ap, long long v) {
+    struct arith *e = arith_alloc(ap, A_NUM);
+    e->value = v;
+    return e;
+}
+
+// A node for a pure operator.  If its operands are all constants it is
+// folded into a constant; one that fails (1/0) is left for evaluation to
+// report.
+struct arith *arith_node(struct arith_parser *ap, enum arith_op op, struct arith *a,
+                         struct arith *b, struct arith *c) {
+    struct arith *e = arith_alloc(ap, op);
+    e->a = a;
+    e->b = b;
+    e->c = c;
+    long long v;
+    const char *error = NULL;
+    if (a->op == A_NUM && (b == NULL || b->op == A_NUM) && (c == NULL || c->op == A_NUM) &&
+        arith_eval(e, &v, &error)) {
+        *e = (struct arith){A_NUM, .value = v};
+    }
+    return e;
+}
+
+struct arith *arith_fail(struct arith_parser *ap, const char *error) {
+    if (ap->error == NULL) {
+        ap->error = error;
+    }
+    return NULL;
+}
+
+void arith_skip(struct arith_parser *ap) {
+    while (*ap->p == ' ' || *ap->p == '\t' || *ap->p == '\n') {
+        ap->p++;
+    }
+}
+
+bool arith_accept(struct arith_parser *ap, const char *s) {
+    arith_skip(ap);
+    size_t n = strlen(s);
+    if (strncmp(ap->p, s, n) != 0) {
+        return false;
+    }
+    ap->p += n;
+    return true;
+}
+
+char *arith_name(struct arith_parser *ap) {
+    const char *start = ap->p;
+    if (!is_name_start(*ap->p)) {
+        return NULL;
+    }
+    while (is_name_char(*ap->p)) {
+        ap->p++;
+    }
+    return arena_strndup(ap->arena, start, ap->p - start);
+}
+
+struct arith *arith_expr(struct arith_parser *ap);
+
+// A number, a variable (with or without $), or a parenthesised expression
+struct arith *arith_primary(struct arith_parser *ap) {
+    arith_skip(ap);
+    if (*ap->p == '(') {
+        ap->p++;
+        struct arith *e = arith_expr(ap);
+        if (e != NULL && !arith_accept(ap, ")")) {
+            return arith_fail(ap, "missing `)'");
+        }
+        return e;
+    }
+    if (*ap->p >= '0' && *ap->p <= '9') {
+        char *end;
+        long long v = strtoll(ap->p, &end, 0);
+        if (is_name_char(*end)) {
+            return arith_fail(ap, "value too great for base");
+        }
+        ap->p = end;
+        return arith_number(ap, v);
+    }
+    struct arith *e = arith_alloc(ap, A_VAR);
+    if (*ap->p == '$') {
+        const char *p = ++ap->p;
+        if (*p == '{') {
+            const char *close = strchr(p, '}');
+            if (close == NULL || close == p + 1) {
+                return arith_fail(ap, "bad substitution");
+            }
+            e->name = arena_strndup(ap->arena, p + 1, close - p - 1);
+            ap->p = close + 1;
+            return e;
+        }
+        if ((*p >= '0' && *p <= '9') || *p == '#' || *p == '?' || *p == '$') {
+            e->name = arena_strndup(ap->arena, p, 1);
+            ap->p++;
+            return e;
+        }
+    }
+    e->name = arith_name(ap);
+    if (e->name == NULL) {
+        return arith_fail(ap, *ap->p ? "syntax error: operand expected" : "operand expected");
+    }
+    if (arith_accept(ap, "++") || arith_accept(ap, "--")) {
+        e->op = ap->p[-1] == '+' ? A_POSTINC : A_POSTDEC;
+    }
+    return e;
+}
+
+struct arith *arith_unary(struct arith_parser *ap) {
+    arith_skip(ap);
+    const char *start = ap->p;
+    if (arith_accept(ap, "++") || arith_accept(ap, "--")) {
+        enum arith_op op = ap->p[-1] == '+' ? A_PREINC : A_PREDEC;
+        arith_skip(ap);
+        char *name = arith_name(ap);
+        if (name != NULL) {
+            struct arith *e = arith_alloc(ap, op);
+            e->name = name;
+            return e;
+        }
+        ap->p = start;      // "--5" is minus minus five
+    }
+    char c = *ap->p;
+    if (c == '-' || c == '+' || c == '!' || c == '~') {
+        ap->p++;
+        struct arith *e = arith_unary(ap);
+        if (e == NULL || c == '+') {
+            return e;
+        }
+        return arith_node(ap, c == '-' ? A_NEG : c == '!' ? A_NOT : A_BITNOT, e, NULL, NULL);
+    }
+    return arith_primary(ap);
+}
+
+// The binary operator at the current position, but not the start of an
+// assignment operator such as "+=" or "<<="
+const struct arith_binop *arith_binop(struct arith_parser *ap) {
+    arith_skip(ap);
+    for (size_t i = 0; i < sizeof(arith_binops) / sizeof(arith_binops[0]); i++) {
+        const struct arith_binop *op = &arith_binops[i];
+        size_t n = strlen(op->text);
+        if (strncmp(ap->p, op->text, n) == 0) {
+            bool compares = op->op == A_EQ || op->op == A_NE || op->op == A_LE || op->op == A_GE;
+            return ap->p[n] == '=' && !compares ? NULL : op;
+        }
+    }
+    return NULL;
+}
+
+// Binary operators by precedence climbing.  ** groups to the right.
+struct arith *arith_binary_expr(struct arith_parser *ap, int min_prec) {
+    struct arith *lhs = arith_unary(ap);
+    while (lhs != NULL) {
+        const struct arith_binop *op = arith_binop(ap);
+        if (op == NULL || op->prec < min_prec) {
+            break;
+        }
+        ap->p += strlen(op->text);
+        struct arith *rhs = arith_binary_expr(ap, op->prec + (op->op != A_POW));
+        if (rhs == NULL) {
+            return NULL;
+        }
+        lhs = arith_node(ap, op->op, lhs, rhs, NULL);
+    }
+    return lhs;
+}
+
+struct arith *arith_assign(struct arith_parser *ap);
+
+struct arith *arith_cond(struct arith_parser *ap) {
+    struct arith *cond = arith_binary_expr(ap, 1);
+    if (cond == NULL || !arith_accept(ap, "?")) {
+        return cond;
+    }
+    struct arith *a = arith_expr(ap);
+    if (a == NULL) {
+        return NULL;
+    }
+    if (!arith_accept(ap, ":")) {
+        return arith_fail(ap, "`:' expected for conditional expression");
+    }
+    struct arith *b = arith_assign(ap);
+    return b ? arith_node(ap, A_COND, cond, a, b) : NULL;
+}
+
+struct arith *arith_assign(struct arith_parser *ap) {
+    arith_skip(ap);
+    const char *start = ap->p;
+    char *name = arith_name(ap);
+    if (name != NULL) {
+        arith_skip(ap);
+        for (size_t i = 0; i < sizeof(arith_assigns) / sizeof(arith_assigns[0]); i++) {
+            size_t n = strlen(arith_assigns[i].text);
+            if (strncmp(ap->p, arith_assigns[i].text, n) == 0 && !(n == 1 && ap->p[1] == '=')) {
+                ap->p += n;
+                struct arith *value = arith_assign(ap);
+                if (value == NULL) {
+                    return NULL;
+                }
+                struct arith *e = arith_alloc(ap, A_ASSIGN);
+                e->name = name;
+                e->assign_op = arith_assigns[i].op;
+                e->a = value;
+                return e;
+            }
+        }
+        ap->p = start;
+    }
+    return arith_cond(ap);
+}
+
+struct arith *arith_expr(struct arith_parser *ap) {
+    struct arith *e = arith_assign(ap);
+    while (e != NULL && arith_accept(ap, ",")) {
+        struct arith *next = arith_assign(ap);
+        if (next == NULL) {
+            return NULL;
+        }
+        e = arith_node(ap, A_COMMA, e, next, NULL);
+    }
+    return e;
+}
+
+// Compiles NUL-terminated text into arena.  An empty expression is 0.
+struct arith *arith_compile(const char *text, struct arena *arena, const char **error) {
+    struct arith_parser ap = {text, arena};
+    arith_skip(&ap);
+    if (*ap.p == '\0') {
+        return arith_number(&ap, 0);
+    }
+    struct arith *e = arith_expr(&ap);
+    arith_skip(&ap);
+    if (e != NULL && *ap.p != '\0') {
+        e = arith_fail(&ap, "syntax error in expression");
+    }
+    if (e == NULL) {
+        *error = ap.error;
+    }
+    return e;
+}
+
+#define ARITH_CACHE_SIZE 64
+
+// Compiled expressions by text, direct-mapped
+struct arith_entry {
+    char *text;
+    struct arith *expr;
+    struct arena arena;         // text and tree
+} arith_cache[ARITH_CACHE_SIZE];
+
+struct arith *arith_cached(const char *text, size_t len, const char **error) {
+    struct arith_entry *e = &arith_cache[hash_bytes(text, len) % ARITH_CACHE_SIZE];
+    if (e->text != NULL && strncmp(e->text, text, len) == 0 && e->text[len] == '\0') {
+        return e->expr;
+    }
+    arena_release(&e->arena, (struct arena_mark){NULL, 0});
+    e->text = arena_strndup(&e->arena, text, len);
+    e->expr = arith_compile(e->text, &e->arena, error);
+    if (e->expr == NULL) {
+        e->text = NULL;
+    }
+    return e->expr;
+}
+
+// Compiles (through the cache, if cached) and evaluates an expression.
+// Nested evaluations compile into line_arena instead, so that they cannot
+// evict the tree being evaluated.
+bool arith_run(const char *text, size_t len, long long *v, const char **error, bool cached) {
+    struct arith *e = cached ? arith_cached(text, len, error)
+                             : arith_compile(arena_strndup(&line_arena, text, len), &line_arena,
+                                             error);
+    return e != NULL && arith_eval(e, v, error);
+}
+
+// $((text)).  A command substitution inside is run before the expression is
+// compiled, and the result is not cached.  Errors are reported here and fail
+// the expansion.
+bool arith_expand(const char *text, size_t len, long long *v) {
+    const char *error = "syntax error";
+    const char *expr = text;
+    bool ok;
+    if (memchr(text, '`', len) != NULL || memmem(text, len, "$(", 2) != NULL) {
+        struct argv_buf out = {0};
+        expand_word(arena_strndup(&line_arena, text, len), WORD_HEREDOC, &out);
+        expr = out.n > 0 ? out.v[0] : "";
+        free(out.v);
+        len = strlen(expr);
+        ok = arith_run(expr, len, v, &error, false);
+    } else {
+        ok = arith_run(text, len, v, &error, true);
+    }
+    if (!ok) {
+        err_printf("mysh: %.*s: %s\n", (int)len, expr, error);
+        expansion_error = true;
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Record streams between in-process stages.
+//
+// Adjacent builtins of a pipeline run in one process (the shell itself when
+// they are the whole pipeline) as one chain of iterators, the way a query
+// engine fuses its operators: the end of the run pulls a record from the
+// last stage, which pulls from the one before it as it needs to, and so
+// on, in a single thread with no pipe in between.  A record is a pointer
+// into the buffer of the stage that produced it (a read buffer, a list of
+// glob matches, a chunk of walk results), valid until that stage is
+// pulled again, so `glob '*.c' | filter 'm*'` neither copies, formats nor
+// parses anything in between.  Builtins without a record interface
+// contribute their output split into lines.  Only where a run meets a file
+// or an external command does it become a byte stream, one record per
+// line, or NUL-terminated after -0.
+
+// A stage of a run.  next() gives its next record, or NULL when it has no
+// more, after which status is the stage's exit status.
+struct rec_iter {
+    char *(*next)(struct rec_iter *it);
+    void (*close)(struct rec_iter *it);     // frees state, or NULL
+    struct rec_iter *in;                    // the stage before, or NULL
+    char delim;                             // record terminator as bytes
+    int status;
+    void *state;
+    // In a threaded run, does up front on the shell's thread what next()
+    // could not do on a thread of its own (use line_arena, run a builtin)
+    void (*prepare)(struct rec_iter *it);
+};
+
+char *rec_none(struct rec_iter *it) {
+    return NULL;
+}
+
+// Records read from a byte stream, split in place in the read buffer.
+struct rec_reader {
+    int fd;
+    char *buf;
+    size_t pos, len, cap;
+    bool eof;
+};
+
+char *reader_next(struct rec_iter *it) {
+    struct rec_reader *r = it->state;
+    while (1) {
+        char *start = r->buf + r->pos;
+        char *end = memchr(start, it->delim, r->len - r->pos);
+        if (end != NULL) {
+            *end = '\0';
+            r->pos = end + 1 - r->buf;
+            return start;
+        }
+        if (r->eof) {
+            if (r->pos == r->len) {
+                return NULL;
+            }
+            r->buf[r->len] = '\0';  // a last record without its terminator
+            r->pos = r->len;
+            return start;
+        }
+        // Keep the partial record and read more behind it
+        memmove(r->buf, start, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if (r->len + 1 == r->cap) {
+            r->cap *= 2;
+            r->buf = xrealloc(r->buf, r->cap);
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            r->eof = true;
+        } else {
+            r->len += n;
+        }
+    }
+}
+
+void reader_close(struct rec_iter *it) {
+    struct rec_reader *r = it->state;
+    free(r->buf);
+    free(r);
+}
+
+// Makes it a stage reading fd.  Nothing is read until it is pulled, so a
+// run that takes no input never touches stdin.
+void reader_open(struct rec_iter *it, int fd) {
+    struct rec_reader *r = xmalloc(sizeof(*r));
+    *r = (struct rec_reader){fd, xmalloc(65536), 0, 0, 65536};
+    *it = (struct rec_iter){reader_next, reader_close, NULL, '\n', 0, r};
+}
+
+// Pulls every record out of it, writing them to fd (-1: nowhere).  Stdout
+// is the builtin output, so a run can be captured by $(...).
+void rec_drain(struct rec_iter *it, int fd) {
+    char *r;
+    while ((r = it->next(it)) != NULL) {
+        if (fd == STDOUT_FILENO) {
+            out_write(r, strlen(r));
+            out_write(&it->delim, 1);
+        } else if (fd >= 0) {
+            out_queue(fd, r, strlen(r));
+            out_queue(fd, &it->delim, 1);
+        }
+    }
+}
+
+// A builtin without a record interface: once the stages before it have run
+// (their records going nowhere), its output is captured and handed on line
+// by line.
+struct rec_text {
+    int builtin;
+    char **argv;
+    struct capture text;
+    size_t pos;
+    bool ran;
+};
+
+void text_run(struct rec_iter *it) {
+    struct rec_text *t = it->state;
+    if (it->in != NULL) {
+        rec_drain(it->in, -1);
+    }
+    struct capture *saved = builtin_capture;
+    builtin_capture = &t->text;
+    it->status = builtins[t->builtin].func(t->argv);
+    builtin_capture = saved;
+    t->ran = true;
+}
+
+char *text_next(struct rec_iter *it) {
+    struct rec_text *t = it->state;
+    if (!t->ran) {
+        text_run(it);
+    }
+    if (t->pos >= t->text.len) {
+        return NULL;
+    }
+    char *start = t->text.data + t->pos;
+    char *end = memchr(start, '\n', t->text.len - t->pos);
+    end = end != NULL ? end : t->text.data + t->text.len;
+    *end = '\0';
+    t->pos = end + 1 - t->text.data;
+    return start;
+}
+
+void text_close(struct rec_iter *it) {
+    free(it->state);
+}
+
+// Whether stage k of a pipeline can be part of an in-process run that
+// begins at start.  A byte builtin (echo, cat) can only begin one, and
+// only in front of a record stage: that stage wants lines anyway, while
+// at the end of a run its exact bytes would be lost.
+bool stage_in_run(struct stage *stages, int k, int start, int nstages) {
+    int b = stages[k].argv[0] && !stages[k].function ? find_builtin(stages[k].argv[0]) : -1;
+    if (b < 0 || !(builtins[b].stream != NULL || (builtins[b].flags & BUILTIN_PURE))) {
+        return false;
+    }
+    if (builtins[b].flags & BUILTIN_RAW) {
+        return k == start && k + 1 < nstages && stage_in_run(stages, k + 1, k + 1, nstages) &&
+               !(builtins[find_builtin(stages[k + 1].argv[0])].flags & BUILTIN_RAW);
+    }
+    return true;
+}
+
+// Threaded runs.  With MYSH_PIPELINE=threads, every stage of a run but the
+// last gets a thread of its own, so that heavy stages (walk, filters) work
+// at the same time instead of taking turns in one chain.  Neighbouring
+// stages are linked by a lock-free single-producer, single-consumer ring
+// of record blocks, which behaves like a pipe: it holds 64KB, a producer
+// that fills it waits for the consumer, a consumer that empties it waits
+// for the producer or sees the end once the producer is done, and a
+// producer whose consumer has gone stops as if on EPIPE.  Records are
+// copied into the blocks, since a stage may reuse its buffer on the next
+// pull.  Waiting spins briefly and then sleeps on a futex; a wake-up is
+// only sent when the other side said it was going to sleep.
+#define LINK_SLOTS 16
+#define LINK_BLOCK 4096
+#define LINK_SPIN 200
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+struct rec_block {
+    size_t len, cap;
+    char data[];                    // NUL-terminated records
+};
+
+struct rec_link {
+    // Written by the producer only
+    unsigned tail __attribute__((aligned(64)));
+    unsigned head_seen;             // the consumer's head, last looked at
+    struct rec_block *filling;
+    // Written by the consumer only
+    unsigned head __attribute__((aligned(64)));
+    unsigned tail_seen;
+    struct rec_block *draining;
+    size_t pos;
+    // Both sides, rarely
+    int sleeping __attribute__((aligned(64)));  // 1: consumer, 2: producer
+    int closed;                     // the producer is done
+    int abandoned;                  // the consumer is done
+    struct rec_block *slots[LINK_SLOTS];
+};
+
+__thread bool stage_thread = false;
+int link_spin;                      // 0 on one CPU, where spinning is no use
+
+void futex_wait(int *addr, int value) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(int *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Waits until ready(l) holds, as side (1: consumer, 2: producer).  The
+// index the other side moves is also what the futex sleeps on, by way of
+// the sleeping word.
+void link_wait(struct rec_link *l, int side, bool (*ready)(struct rec_link *)) {
+    for (int spin = 0; spin < link_spin; spin++) {
+        if (ready(l)) {
+            return;
+        }
+        cpu_relax();
+    }
+    while (!ready(l)) {
+        __atomic_store_n(&l->sleeping, side, __ATOMIC_SEQ_CST);
+        if (ready(l)) {
+            __atomic_store_n(&l->sleeping, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+        futex_wait(&l->sleeping, side);
+    }
+}
+
+// After moving its index, a side wakes the other if it went to sleep.
+void link_wake(struct rec_link *l, int other) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);    // the index store before the load
+    if (__atomic_load_n(&l->sleeping, __ATOMIC_SEQ_CST) == other &&
+        __atomic_compare_exchange_n(&l->sleeping, &other, 0, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST)) {
+        futex_wake(&l->sleeping);
+    }
+}
+
+bool link_has_room(struct rec_link *l) {
+    return __atomic_load_n(&l->tail, __ATOMIC_RELAXED) -
+               __atomic_load_n(&l->head, __ATOMIC_ACQUIRE) < LINK_SLOTS ||
+           __atomic_load_n(&l->abandoned, __ATOMIC_ACQUIRE);
+}
+
+bool link_has_data(struct rec_link *l) {
+    return __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&l->head, __ATOMIC_RELAXED) ||
+           __atomic_load_n(&l->closed, __ATOMIC_ACQUIRE);
+}
+
+// Producer: hands the block being filled to the consumer.  False once the
+// consumer has gone.
+bool link_send(struct rec_link *l) {
+    struct rec_block *b = l->filling;
+    l->filling = NULL;
+    if (b == NULL || b->len == 0) {
+        free(b);
+        return !__atomic_load_n(&l->abandoned, __ATOMIC_ACQUIRE);
+    }
+    if (l->tail - l->head_seen == LINK_SLOTS) {
+        l->head_seen = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+        if (l->tail - l->head_seen == LINK_SLOTS) {
+            link_wait(l, 2, link_has_room);
+            l->head_seen = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+        }
+    }
+    if (__atomic_load_n(&l->abandoned, __ATOMIC_ACQUIRE)) {
+        free(b);
+        return false;
+    }
+    l->slots[l->tail % LINK_SLOTS] = b;
+    __atomic_store_n(&l->tail, l->tail + 1, __ATOMIC_RELEASE);
+    link_wake(l, 1);
+    return true;
+}
+
+// Producer: adds a record, sending the block when it is full.
+bool link_put(struct rec_link *l, const char *r) {
+    size_t n = strlen(r) + 1;
+    struct rec_block *b = l->filling;
+    if (b != NULL && b->len + n > b->cap && !link_send(l)) {
+        return false;
+    }
+    if (l->filling == NULL) {
+        size_t cap = n > LINK_BLOCK ? n : LINK_BLOCK;
+        l->filling = xmalloc(sizeof(*l->filling) + cap);
+        l->filling->len = 0;
+        l->filling->cap = cap;
+    }
+    b = l->filling;
+    memcpy(b->data + b->len, r, n);
+    b->len += n;
+    return true;
+}
+
+void link_close(struct rec_link *l) {
+    link_send(l);
+    __atomic_store_n(&l->closed, 1, __ATOMIC_RELEASE);
+    link_wake(l, 1);
+}
+
+// Consumer: the link's records, as an iterator for the next stage.
+char *link_next(struct rec_iter *it) {
+    struct rec_link *l = it->state;
+    while (l->draining == NULL || l->pos == l->draining->len) {
+        free(l->draining);
+        l->draining = NULL;
+        if (l->tail_seen == l->head) {
+            l->tail_seen = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE);
+            if (l->tail_seen == l->head) {
+                link_wait(l, 1, link_has_data);
+                l->tail_seen = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE);
+                if (l->tail_seen == l->head) {
+                    return NULL;        // closed and empty
+                }
+            }
+        }
+        l->draining = l->slots[l->head % LINK_SLOTS];
+        l->pos = 0;
+        __atomic_store_n(&l->head, l->head + 1, __ATOMIC_RELEASE);
+        link_wake(l, 2);
+    }
+    char *r = l->draining->data + l->pos;
+    l->pos += strlen(r) + 1;
+    return r;
+}
+
+// A stage thread: pulls its stage dry into the link to the next one.
+struct stage_thread_arg {
+    struct rec_iter *it;
+    struct rec_link *link;
+};
+
+void *stage_thread_run(void *arg) {
+    struct stage_thread_arg *a = arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);     // signals are the shell's
+    stage_thread = true;
+    char *r;
+    while ((r = a->it->next(a->it)) != NULL && link_put(a->link, r)) {
+    }
+    link_close(a->link);
+    return NULL;
+}
+
+bool pipeline_threads(void) {
+    const char *opt = var_get("MYSH_PIPELINE");
+    return opt != NULL && strcmp(opt, "threads") == 0;
+}
+
+// Runs stages its[1..n] with a thread each but the last, which the caller
+// drains.  Returns once every thread is done.
+void run_threaded(struct rec_iter *its, int n, int out_fd) {
+    struct rec_link *links = aligned_alloc(64, (n - 1) * sizeof(*links));
+    memset(links, 0, (n - 1) * sizeof(*links));
+    struct rec_iter *ends = arena_alloc(&line_arena, (n - 1) * sizeof(*ends));
+    struct stage_thread_arg *args = arena_alloc(&line_arena, (n - 1) * sizeof(*args));
+    pthread_t *threads = arena_alloc(&line_arena, (n - 1) * sizeof(*threads));
+    bool *started = arena_alloc(&line_arena, (n - 1) * sizeof(*started));
+    link_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? LINK_SPIN : 0;
+    for (int i = 1; i <= n; i++) {
+        if (its[i].prepare != NULL) {
+            its[i].prepare(&its[i]);
+        }
+    }
+    for (int i = 1; i < n; i++) {
+        ends[i - 1] = (struct rec_iter){link_next, NULL, NULL, its[i].delim, 0, &links[i - 1]};
+        its[i + 1].in = &ends[i - 1];
+    }
+    for (int i = 1; i < n; i++) {
+        args[i - 1] = (struct stage_thread_arg){&its[i], &links[i - 1]};
+        started[i - 1] = pthread_create(&threads[i - 1], NULL, stage_thread_run, &args[i - 1]) == 0;
+        if (!started[i - 1]) {
+            its[i + 1].in = &its[i];    // no thread: the next stage pulls it, unthreaded
+        }
+    }
+    rec_drain(&its[n], out_fd);
+    for (int i = 0; i < n - 1; i++) {
+        __atomic_store_n(&links[i].abandoned, 1, __ATOMIC_RELEASE);
+        link_wake(&links[i], 2);
+    }
+    for (int i = 0; i < n - 1; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        free(links[i].filling);
+        free(links[i].draining);
+        while (links[i].head != links[i].tail) {
+            free(links[i].slots[links[i].head++ % LINK_SLOTS]);
+        }
+    }
+    free(links);
+}
+
+// Runs n adjacent in-process stages as a chain of iterators, and writes
+// the last one's records to stdout.  A stage's own redirections still
+// apply: an input redirection replaces the records (the stages before it
+// still run, their records going nowhere), an output one takes them.
+int run_records(struct stage *run, int n) {
+    struct rec_iter *its = arena_alloc(&line_arena, (n + 1) * sizeof(*its));
+    reader_open(&its[0], run[0].in_fd >= 0 ? run[0].in_fd : STDIN_FILENO);
+    for (int i = 0; i < n; i++) {
+        struct rec_iter *it = &its[i + 1], *in = &its[i];
+        if (i > 0 && run[i].in_fd >= 0) {
+            rec_drain(in, -1);
+            in->close(in);
+            reader_open(in, run[i].in_fd);
+        }
+        *it = (struct rec_iter){rec_none, NULL, in, '\n'};
+        int b = find_builtin(run[i].argv[0]);
+        if (builtins[b].stream != NULL) {
+            it->status = builtins[b].stream(run[i].argv, it);
+        } else {
+            struct rec_text *t = xmalloc(sizeof(*t));
+            *t = (struct rec_text){b, run[i].argv};
+            *it = (struct rec_iter){text_next, text_close, i > 0 ? in : NULL, '\n', 0, t, text_run};
+        }
+        if (run[i].out_fd >= 0 && i < n - 1) {
+            rec_drain(it, run[i].out_fd);
+            it->next = rec_none;
+        }
+    }
+    int out_fd = run[n - 1].out_fd >= 0 ? run[n - 1].out_fd : STDOUT_FILENO;
+    if (n > 1 && pipeline_threads()) {
+        run_threaded(its, n, out_fd);
+    } else {
+        rec_drain(&its[n], out_fd);
+    }
+    int status = its[n].status;
+    for (int i = 0; i <= n; i++) {
+        if (its[i].close != NULL) {
+            its[i].close(&its[i]);
+        }
+    }
+    out_flush();        // before the redirections are closed
+    return status;
+}
+
+// Turns each run of adjacent in-process stages into one stage whose run
+// field holds them.  A sink (a stage whose output comes from its own
+// children) ends a run.  Returns the new number of stages.
+int fuse_in_process_stages(struct stage *stages, int nstages) {
+    int m = 0;
+    for (int k = 0; k < nstages;) {
+        int end = k;
+        while (end < nstages && stage_in_run(stages, end, k, nstages)) {
+            if (builtins[find_builtin(stages[end++].argv[0])].flags & BUILTIN_SINK) {
+                break;
+            }
+        }
+        if (end == k) {
+            stages[m++] = stages[k++];
+            continue;
+        }
+        struct stage *run = arena_alloc(&line_arena, (end - k) * sizeof(*run));
+        memcpy(run, &stages[k], (end - k) * sizeof(*run));
+        int last = end - k - 1;
+        stages[m++] = (struct stage){run[0].argv, run[0].in_fd, run[last].out_fd, NULL,
+                                     run, end - k};
+        run[0].in_fd = run[last].out_fd = -1;
+        k = end;
+    }
+    return m;
+}
+
+// Runs a builtin on its own.  A record builtin reads stdin if it wants
+// input and writes its records as lines.
+int call_builtin(int builtin, char **args) {
+    if (builtins[builtin].stream == NULL) {
+        return (*builtins[builtin].func)(args);
+    }
+    struct stage st = {args, -1, -1};
+    return run_records(&st, 1);
+}
+
+// glob [-0] PATTERN...: the paths matching each pattern, as records.
+// Fails if nothing matched.
+struct glob_iter {
+    char **patterns;                // those not expanded yet
+    struct argv_buf matches;
+    int pos;
+};
+
+// Adds the matches of the next pattern.
+void glob_expand_next(struct glob_iter *g) {
+    const char *pattern = *g->patterns++;
+    if (!glob_cached(pattern, &g->matches)) {
+        glob_t gl;
+        if (glob(pattern, GLOB_TILDE, NULL, &gl) == 0) {
+            for (size_t j = 0; j < gl.gl_pathc; j++) {
+                argv_push(&g->matches, arena_strndup(&line_arena, gl.gl_pathv[j],
+                                                     strlen(gl.gl_pathv[j])));
+            }
+            globfree(&gl);
+        }
+    }
+}
+
+char *glob_next(struct rec_iter *it) {
+    struct glob_iter *g = it->state;
+    while (g->pos == g->matches.n) {
+        if (*g->patterns == NULL) {
+            it->status = g->matches.n > 0 ? 0 : 1;
+            return NULL;
+        }
+        glob_expand_next(g);
+    }
+    return g->matches.v[g->pos++];
+}
+
+void glob_prepare(struct rec_iter *it) {
+    struct glob_iter *g = it->state;
+    while (*g->patterns != NULL) {
+        glob_expand_next(g);
+    }
+}
+
+void glob_close(struct rec_iter *it) {
+    struct glob_iter *g = it->state;
+    free(g->matches.v);
+    free(g);
+}
+
+int stream_glob(char **args, struct rec_iter *it) {
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-0") == 0) {
+        it->delim = '\0';
+        i++;
+    }
+    struct glob_iter *g = xmalloc(sizeof(*g));
+    *g = (struct glob_iter){args + i};
+    it->next = glob_next;
+    it->close = glob_close;
+    it->prepare = glob_prepare;
+    it->state = g;
+    return 0;
+}
+
+// filter [-v] [-0] PATTERN: the input records that match (or with -v, do
+// not match) the wildcard PATTERN.  The records themselves are passed on.
+// A pattern that is plain text with at most a leading and a trailing '*'
+// (the usual '*.c', 'build*', '*error*') is matched without fnmatch().
+struct filter_iter {
+    const char *pattern;
+    bool invert;
+    long passed;
+    bool plain, head, tail;         // plain: text, any head, any tail
+    const char *text;
+    size_t len;
+};
+
+bool filter_match(struct filter_iter *f, const char *r) {
+    if (!f->plain) {
+        return fnmatch(f->pattern, r, 0) == 0;
+    }
+    size_t n = strlen(r);
+    if (n < f->len) {
+        return false;
+    }
+    if (f->head && f->tail) {
+        return memmem(r, n, f->text, f->len) != NULL;
+    }
+    if (f->head) {
+        return memcmp(r + n - f->len, f->text, f->len) == 0;
+    }
+    return (f->tail || n == f->len) && memcmp(r, f->text, f->len) == 0;
+}
+
+char *filter_next(struct rec_iter *it) {
+    struct filter_iter *f = it->state;
+    char *r;
+    while ((r = it->in->next(it->in)) != NULL) {
+        if (filter_match(f, r) != f->invert) {
+            f->passed++;
+            return r;
+        }
+    }
+    it->status = f->passed > 0 ? 0 : 1;
+    return NULL;
+}
+
+void filter_close(struct rec_iter *it) {
+    free(it->state);
+}
+
+int stream_filter(char **args, struct rec_iter *it) {
+    bool invert = false;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-v") == 0) {
+            invert = true;
+        } else if (strcmp(args[i], "-0") == 0) {
+            it->in->delim = '\0';
+        } else {
+            break;
+        }
+    }
+    if (args[i] == NULL || args[i + 1] != NULL) {
+        err_printf("usage: filter [-v] [-0] PATTERN\n");
+        return 2;
+    }
+    struct filter_iter *f = xmalloc(sizeof(*f));
+    *f = (struct filter_iter){args[i], invert};
+    f->text = args[i];
+    f->len = strlen(f->text);
+    f->head = f->len > 0 && f->text[0] == '*';
+    f->text += f->head;
+    f->len -= f->head;
+    f->tail = f->len > 0 && f->text[f->len - 1] == '*';
+    f->len -= f->tail;
+    f->plain = strcspn(f->text, "*?[\\") >= f->len;
+    it->delim = it->in->delim;
+    it->next = filter_next;
+    it->close = filter_close;
+    it->state = f;
+    return 0;
+}
+
+// parallel [-j N] [-0] command [args]: runs command once per input record,
+// with the record as its last argument, up to N at a time (default: one
+// per CPU).  Their output is the stage's output.  Fails if any run did.
+// Records are taken as they come, so the first runs start while the
+// stages before are still producing.
+struct parallel_iter {
+    char **argv;
+    int nargs;
+    long width;
+};
+
+char *parallel_next(struct rec_iter *it) {
+    struct parallel_iter *p = it->state;
+    char **argv = p->argv;
+    int nargs = p->nargs;
+
+    // Held at one until every record is started, so the job ends once
+    struct job job = {.timer.fd = -1, .cgroup_fd = -1, .nrunning = 1};
+    job.text = xmalloc(strlen(argv[0]) + 10);
+    sprintf(job.text, "parallel %s", argv[0]);
+    clock_gettime(CLOCK_MONOTONIC, &job.start);
+    char *record;
+    bool refused = sandbox_setup() < 0;
+    job.nfailed += refused;
+    char **envp = env_get();    // built here: the child may not allocate
+    while (!refused && (record = it->in->next(it->in)) != NULL) {
+        while (job.nrunning > p->width) {
+            waiter_run(-1);
+        }
+        argv[nargs] = record;
+        bool untracked;
+        out_flush();
+        pid_t pid = spawn_child(&job, sandbox.clone_flags, false, &untracked);
+        if (pid == 0) {
+            child_apply_limits();
+            environ = envp;
+            sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+            sandbox_enter();
+            execvp(argv[0], argv);
+            child_perror("", argv[0]);
+            _exit(127);
+        }
+        if (pid < 0) {
+            err_perror("fork");
+            job.nfailed++;
+            break;
+        }
+        if (untracked) {
+            int status;
+            waitpid(pid, &status, 0);
+            job.nfailed += status != 0;
+        }
+    }
+    if (--job.nrunning == 0) {
+        job_finish(&job);
+    }
+    job_wait(&job);
+    free(job.text);
+    it->status = job.nfailed > 0 ? 1 : 0;
+    it->next = rec_none;
+    return NULL;
+}
+
+void parallel_close(struct rec_iter *it) {
+    free(it->state);
+}
+
+int stream_parallel(char **args, struct rec_iter *it) {
+    long width = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-0") == 0) {
+            it->in->delim = '\0';
+        } else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atol(args[i + 1]) > 0) {
+            width = atol(args[++i]);
+        } else {
+            break;
+        }
+    }
+    if (args[i] == NULL) {
+        err_printf("usage: parallel [-j N] [-0] command [args]\n");
+        return 2;
+    }
+    struct parallel_iter *p = xmalloc(sizeof(*p));
+    *p = (struct parallel_iter){.width = width};
+    while (args[i + p->nargs] != NULL) {
+        p->nargs++;
+    }
+    p->argv = arena_alloc(&line_arena, (p->nargs + 2) * sizeof(char *));
+    memcpy(p->argv, args + i, p->nargs * sizeof(char *));
+    p->argv[p->nargs + 1] = NULL;
+    it->next = parallel_next;
+    it->close = parallel_close;
+    it->state = p;
+    return 0;
+}
+
+// walk [-0] [-j N] [-name PATTERN] [-type f|d|l] [-mtime [+-]DAYS]
+//      [-maxdepth N] [DIR...]: the paths under each DIR (default .), like
+// find.  Directories are read by a pool of threads with openat() and
+// getdents64; d_type decides what is a directory, so entries are only
+// stat'ed for -mtime or on filesystems that do not fill it in.  Matches go
+// to the next stage in chunks as they are found.
+struct walk_dir {
+    char *path;
+    int depth;
+};
+
+struct walk_chunk {
+    struct strbuf paths;            // NUL-separated
+    struct walk_chunk *next;
+};
+
+struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t work, results;
+    struct walk_dir *queue;
+    size_t nqueue, queue_cap;
+    int busy;                       // directories being read
+    struct walk_chunk *chunks;
+    struct strbuf errors;           // messages for the consumer to print
+    bool failed;
+    bool stop;                      // the consumer is done: read no more
+
+    const char *name;
+    char type;                      // 'f', 'd', 'l' or 0
+    int mtime_cmp;                  // -1, 0, 1: newer, exactly, older
+    long mtime_days;
+    bool has_mtime;
+    int maxdepth;                   // -1: unlimited
+    time_t now;
+};
+
+// Per thread: the directory being read and the matches not yet handed over
+struct walk_scan {
+    struct walk *w;
+    int fd;
+    const char *dir;
+    int depth;
+    struct walk_chunk *out;
+};
+
+void walk_queue(struct walk *w, char *path, int depth) {
+    if (w->nqueue == w->queue_cap) {
+        w->queue_cap = w->queue_cap ? w->queue_cap * 2 : 256;
+        w->queue = xrealloc(w->queue, w->queue_cap * sizeof(*w->queue));
+    }
+    w->queue[w->nqueue++] = (struct walk_dir){path, depth};
+    pthread_cond_signal(&w->work);
+}
+
+// Hands a thread's chunk of matches to the consumer.  Callers hold w->lock.
+void walk_publish(struct walk_scan *sc) {
+    if (sc->out != NULL && sc->out->paths.len > 0) {
+        sc->out->next = sc->w->chunks;
+        sc->w->chunks = sc->out;
+        sc->out = NULL;
+        pthread_cond_signal(&sc->w->results);
+    }
+}
+
+bool walk_matches(struct walk *w, int dirfd, const char *name, unsigned char type) {
+    if (w->name != NULL && fnmatch(w->name, name, 0) != 0) {
+        return false;
+    }
+    struct stat st;
+    bool have_stat = false;
+    if (type == DT_UNKNOWN || w->has_mtime) {
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return false;
+        }
+        have_stat = true;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK
+             : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (w->type && w->type != (type == DT_REG ? 'f' : type == DT_DIR ? 'd' : type == DT_LNK ? 'l' : '?')) {
+        return false;
+    }
+    if (have_stat && w->has_mtime) {
+        long age = (w->now - st.st_mtime) / 86400;
+        int cmp = age < w->mtime_days ? -1 : age > w->mtime_days;
+        if (cmp != w->mtime_cmp) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void walk_entry(void *ctx, const char *name, unsigned char type) {
+    struct walk_scan *sc = ctx;
+    struct walk *w = sc->w;
+    size_t dlen = strlen(sc->dir), nlen = strlen(name);
+    bool descend = w->maxdepth < 0 || sc->depth < w->maxdepth;
+    if (type == DT_UNKNOWN && descend) {
+        struct stat st;
+        if (fstatat(sc->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            type = DT_DIR;
+        }
+    }
+    bool match = walk_matches(w, sc->fd, name, type);
+    if (match) {
+        if (sc->out == NULL) {
+            sc->out = xmalloc(sizeof(*sc->out));
+            *sc->out = (struct walk_chunk){0};
+        }
+        sb_append(&sc->out->paths, sc->dir, dlen);
+        if (dlen > 0 && sc->dir[dlen - 1] != '/') {
+            sb_putc(&sc->out->paths, '/');
+        }
+        sb_append(&sc->out->paths, name, nlen + 1);
+    }
+    if (type == DT_DIR && descend) {
+        char *path = xmalloc(dlen + nlen + 2);
+        sprintf(path, dlen > 0 && sc->dir[dlen - 1] == '/' ? "%s%s" : "%s/%s", sc->dir, name);
+        pthread_mutex_lock(&w->lock);
+        walk_queue(w, path, sc->depth + 1);
+        if (match && sc->out->paths.len >= 65536) {
+            walk_publish(sc);
+        }
+        pthread_mutex_unlock(&w->lock);
+    } else if (match && sc->out->paths.len >= 65536) {
+        pthread_mutex_lock(&w->lock);
+        walk_publish(sc);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+void *walk_worker(void *arg) {
+    struct walk *w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->nqueue == 0 && w->busy > 0 && !w->stop) {
+            pthread_cond_wait(&w->work, &w->lock);
+        }
+        if (w->nqueue == 0 || w->stop) {
+            break;                  // nothing queued and nobody reading
+        }
+        struct walk_dir d = w->queue[--w->nqueue];
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        struct walk_scan sc = {w, -1, d.path, d.depth, NULL};
+        sc.fd = open(d.path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        bool ok = sc.fd >= 0 && dir_scan(sc.fd, walk_entry, &sc) == 0;
+        const char *error = ok ? NULL : strerror(errno);
+        if (sc.fd >= 0) {
+            close(sc.fd);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (!ok) {
+            sb_append(&w->errors, "walk: ", 6);
+            sb_append(&w->errors, d.path, strlen(d.path));
+            sb_append(&w->errors, ": ", 2);
+            sb_append(&w->errors, error, strlen(error));
+            sb_putc(&w->errors, '\n');
+        }
+        free(d.path);
+        w->failed |= !ok;
+        walk_publish(&sc);
+        if (--w->busy == 0 && w->nqueue == 0) {
+            pthread_cond_broadcast(&w->work);
+            pthread_cond_broadcast(&w->results);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// The walk as a stage: the starting points, then the chunks of matches as
+// the threads publish them.  Records point into the chunk being handed out.
+struct walk_iter {
+    struct walk w;
+    struct argv_buf first;          // starting points that match
+    int nfirst;
+    struct walk_chunk *ready, *chunk;
+    size_t pos;
+    pthread_t threads[16];
+    int started;
+};
+
+// Prints the threads' error messages gathered so far.
+void walk_report(struct walk *w) {
+    pthread_mutex_lock(&w->lock);
+    struct strbuf errors = w->errors;
+    w->errors = (struct strbuf){0};
+    pthread_mutex_unlock(&w->lock);
+    if (errors.len > 0) {
+        err_printf("%.*s", (int)errors.len, errors.data);
+    }
+    free(errors.data);
+}
+
+char *walk_next(struct rec_iter *it) {
+    struct walk_iter *wi = it->state;
+    struct walk *w = &wi->w;
+    if (wi->nfirst < wi->first.n) {
+        return wi->first.v[wi->nfirst++];
+    }
+    while (wi->chunk == NULL || wi->pos == wi->chunk->paths.len) {
+        if (wi->chunk != NULL) {
+            free(wi->chunk->paths.data);
+            free(wi->chunk);
+            wi->chunk = NULL;
+        }
+        if (wi->ready == NULL) {
+            pthread_mutex_lock(&w->lock);
+            if (w->chunks == NULL && (w->busy > 0 || w->nqueue > 0) && !stage_thread) {
+                // Hand on what the run has so far before waiting for more
+                pthread_mutex_unlock(&w->lock);
+                out_flush();
+                pthread_mutex_lock(&w->lock);
+            }
+            while (w->chunks == NULL && (w->busy > 0 || w->nqueue > 0)) {
+                pthread_cond_wait(&w->results, &w->lock);
+            }
+            wi->ready = w->chunks;
+            w->chunks = NULL;
+            pthread_mutex_unlock(&w->lock);
+            walk_report(w);
+            if (wi->ready == NULL) {
+                it->status = w->failed ? 1 : 0;
+                return NULL;
+            }
+        }
+        wi->chunk = wi->ready;
+        wi->ready = wi->ready->next;
+        wi->pos = 0;
+    }
+    char *path = wi->chunk->paths.data + wi->pos;
+    wi->pos += strlen(path) + 1;
+    return path;
+}
+
+void walk_free_chunks(struct walk_chunk *c) {
+    while (c != NULL) {
+        struct walk_chunk *next = c->next;
+        free(c->paths.data);
+        free(c);
+        c = next;
+    }
+}
+
+// Stops the walk where it is: a consumer that has had enough (head, a
+// match found) does not wait for the rest of the tree to be read.
+void walk_close(struct rec_iter *it) {
+    struct walk_iter *wi = it->state;
+    struct walk *w = &wi->w;
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    for (int t = 0; t < wi->started; t++) {
+        pthread_join(wi->threads[t], NULL);
+    }
+    walk_report(w);
+    it->status = w->failed ? 1 : 0;
+    for (size_t i = 0; i < w->nqueue; i++) {
+        free(w->queue[i].path);
+    }
+    if (wi->chunk != NULL) {
+        free(wi->chunk->paths.data);
+        free(wi->chunk);
+    }
+    walk_free_chunks(wi->ready);
+    walk_free_chunks(w->chunks);
+    free(wi->first.v);
+    free(w->queue);
+    free(wi);
+}
+
+int stream_walk(char **args, struct rec_iter *it) {
+    struct walk_iter *wi = xmalloc(sizeof(*wi));
+    *wi = (struct walk_iter){{PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                              PTHREAD_COND_INITIALIZER, .maxdepth = -1, .now = time(NULL)}};
+    struct walk *w = &wi->w;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct argv_buf dirs = {0};
+    for (int i = 1; args[i] != NULL; i++) {
+        const char *opt = args[i], *val = args[i + 1];
+        if (opt[0] != '-' || opt[1] == '\0') {
+            argv_push(&dirs, args[i]);
+            continue;
+        }
+        if (strcmp(opt, "-0") == 0) {
+            it->delim = '\0';
+            continue;
+        }
+        if (val == NULL) {
+            err_printf("walk: %s needs a value\n", opt);
+            free(dirs.v);
+            free(wi);
+            return 2;
+        }
+        if (strcmp(opt, "-name") == 0) {
+            w->name = val;
+        } else if (strcmp(opt, "-type") == 0 && strchr("fdl", val[0]) && val[1] == '\0') {
+            w->type = val[0];
+        } else if (strcmp(opt, "-mtime") == 0) {
+            w->has_mtime = true;
+            w->mtime_cmp = val[0] == '-' ? -1 : val[0] == '+' ? 1 : 0;
+            w->mtime_days = atol(val + (w->mtime_cmp != 0));
+        } else if (strcmp(opt, "-maxdepth") == 0) {
+            w->maxdepth = atoi(val);
+        } else if (strcmp(opt, "-j") == 0 && atol(val) > 0) {
+            nthreads = atol(val);
+        } else {
+            err_printf("walk: bad option %s %s\n", opt, val);
+            free(dirs.v);
+            free(wi);
+            return 2;
+        }
+        i++;
+    }
+    nthreads = nthreads < 2 ? 2 : nthreads > 16 ? 16 : nthreads;
+
+    // The starting points themselves are matched as well, like find
+    char *dot[] = {".", NULL};
+    for (char **dir = dirs.n > 0 ? dirs.v : dot; *dir != NULL; dir++) {
+        struct stat st;
+        if (lstat(*dir, &st) != 0) {
+            err_printf("walk: %s: %s\n", *dir, strerror(errno));
+            w->failed = true;
+            continue;
+        }
+        unsigned char type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        if (walk_matches(w, AT_FDCWD, *dir, type)) {
+            argv_push(&wi->first, *dir);
+        }
+        if (S_ISDIR(st.st_mode) && w->maxdepth != 0) {
+            walk_queue(w, strdup(*dir), 1);
+        }
+    }
+    free(dirs.v);
+
+    bool queued = w->nqueue > 0;   // the threads take from the queue at once
+    for (int t = 0; t < nthreads && queued; t++) {
+        wi->started += pthread_create(&wi->threads[wi->started], NULL, walk_worker, w) == 0;
+    }
+    if (wi->started == 0) {
+        walk_worker(w);             // no threads to be had: walk here
+    }
+    it->next = walk_next;
+    it->close = walk_close;
+    it->state = wi;
+    return 0;
+}
+
+int run_node(struct node *n);
+int call_function(struct function *f, char **args);
+
+// What a stage runs without an exec: a loop, a function, a fused run of
+// in-process stages, a byte builtin, or a builtin.
+int run_stage(struct stage *st, int builtin) {
+    if (st->compound != NULL) {
+        return run_node(st->compound);
+    }
+    if (st->function != NULL) {
+        return call_function(st->function, st->argv);
+    }
+    if (st->run != NULL) {
+        return run_records(st->run, st->nrun);
+    }
+    if (st->builtin != NULL) {
+        return st->builtin->func(st->argv);
+    }
+    return builtin >= 0 ? call_builtin(builtin, st->argv) : 1;
+}
+
+// Runs a builtin, a function, a fused run of in-process stages or a loop in the shell
+// with st's redirections applied to it for the duration.
+int run_in_shell(struct stage *st, int builtin) {
+    if (st->in_fd < 0 && st->out_fd < 0) {
+        return run_stage(st, builtin);
+    }
+    int saved_in = -1, saved_out = -1;
+    bool line_flush = outq.line_flush[STDOUT_FILENO], shared = outq.shared;
+    out_flush();
+    if (st->in_fd >= 0) {
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(st->in_fd, STDIN_FILENO);
+    }
+    if (st->out_fd >= 0) {
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(st->out_fd, STDOUT_FILENO);
+        outq.line_flush[STDOUT_FILENO] = outq.shared = false;
+    }
+    close_redirections(st);
+    int status = run_stage(st, builtin);
+    out_flush();
+    outq.line_flush[STDOUT_FILENO] = line_flush;
+    outq.shared = shared;
+    if (saved_in >= 0) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    if (saved_out >= 0) {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    return status;
+}
+
+// Runs a builtin.  Its redirections are applied to the shell itself for the
+// duration of the call.
+int run_builtin(int builtin, char **args) {
+    struct stage st = {args, -1, -1};
+    if (open_redirections(&st, 1) != 0) {
+        return 1;
+    }
+    return run_in_shell(&st, builtin);
+}
+
+bool assign_word(const char *word) {
+    const char *eq = strchr(word, '=');
+    return var_set_n(word, eq - word, eq + 1, 0);
+}
+
+// Parses a duration such as 10, 1.5s, 2m, 1h or 1d into milliseconds.
+bool parse_duration(const char *text, long *ms) {
+    char *end;
+    double value = strtod(text, &end);
+    double scale = *end == 's' || *end == '\0' ? 1 : *end == 'm' ? 60
+                 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : -1;
+    if (end == text || scale < 0 || (*end != '\0' && end[1] != '\0') || value < 0) {
+        return false;
+    }
+    *ms = (long)(value * scale * 1000 + 0.5);
+    return true;
+}
+
+// Parses "timeout [-k GRACE] DURATION" at the start of args into opts.
+// The shortest of nested timeouts wins.  Returns the number of words used,
+// or -1 after printing a message.
+int parse_timeout(char **args, struct launch_opts *opts) {
+    int i = 1;
+    long ms, grace = 0;
+    if (args[i] != NULL && strcmp(args[i], "-k") == 0) {
+        if (args[i + 1] == NULL || !parse_duration(args[i + 1], &grace)) {
+            err_printf("timeout: invalid kill-after duration\n");
+            return -1;
+        }
+        i += 2;
+    }
+    if (args[i] == NULL || !parse_duration(args[i], &ms)) {
+        err_printf("timeout: invalid duration '%s'\n", args[i] ? args[i] : "");
+        return -1;
+    }
+    if (args[i + 1] == NULL || is_op(args[i + 1])) {
+        err_printf("timeout: missing command\n");
+        return -1;
+    }
+    if (ms > 0 && (opts->timeout == 0 || ms < opts->timeout)) {
+        opts->timeout = ms;
+        opts->kill_after = grace;
+    }
+    return i + 1;
+}
+
+// ---------------------------------------------------------------------------
+// Incremental runs.
+//
+// With MYSH_INCREMENTAL set to an index file, a command that writes its
+// result with > (cmd < in > out, or a pipeline of such) is a step that can
+// be skipped.  Its key is a hash of its words and the current directory.
+// The index maps the key to a hash of the contents of its < inputs and to
+// the stamp (inode, size, mtime) of its > outputs as of its last success.
+// A step is skipped while both still match, so a rerun only does the
+// steps downstream of what changed.  Inputs are compared by contents, so a
+// step whose input an earlier step rewrote with the same bytes is still
+// skipped.  A file is only read again when its stamp has changed: the
+// index also maps each file to its stamp when last hashed and the hash.
+//
+// The index is a log of fixed 32-byte records, each appended with one
+// O_APPEND write:
+//
+//     magic (4) | kind (4) | key (8) | value (8) | value (8)
+//
+// It is mmap'd into two hash tables when opened, and rewritten without its
+// superseded records once they make up most of it.  Appends hold a shared
+// flock and the rewrite an exclusive one, and a shell that finds another
+// file at the path when it appends reopens it first.
+// ---------------------------------------------------------------------------
+
+#define INC_MAGIC 0x434e494du       // "MINC"
+#define INC_STEP 1                  // key: words, a: inputs, b: outputs
+#define INC_FILE 2                  // key: path, a: stamp, b: contents
+
+struct inc_record {
+    uint32_t magic, kind;
+    uint64_t key, a, b;
+};
+
+struct inc_table {
+    struct inc_record *slots;       // open-addressed, key 0 is empty
+    size_t cap, count;
+};
+
+struct incremental {
+    char *path;                     // MYSH_INCREMENTAL the index is open for
+    int fd;
+    size_t read;                    // bytes of the index in the tables
+    struct inc_table steps, files;
+} inc = {.fd = -1};
+
+// A step of the current line: its key and its redirection targets.
+struct step {
+    uint64_t key, inputs;
+    bool inputs_ok;
+    struct argv_buf in, out;
+};
+
+void step_free(struct step *s) {
+    free(s->in.v);
+    free(s->out.v);
+}
+
+uint64_t hash64(uint64_t h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    uint64_t w = (uint64_t)n << 56;
+    memcpy(&w, p, n);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    return h ^ h >> 32;
+}
+
+uint64_t hash64_field(uint64_t h, const char *s) {
+    size_t n = strlen(s);
+    h = hash64(h, &n, sizeof(n));
+    return hash64(h, s, n);
+}
+
+struct inc_record *inc_get(struct inc_table *t, uint64_t key) {
+    for (size_t i = key & (t->cap - 1); t->cap && t->slots[i].key; i = (i + 1) & (t->cap - 1)) {
+        if (t->slots[i].key == key) {
+            return &t->slots[i];
+        }
+    }
+    return NULL;
+}
+
+void inc_put(struct inc_table *t, const struct inc_record *r) {
+    if ((t->count + 1) * 2 > t->cap) {
+        struct inc_table grown = {xmalloc((t->cap ? t->cap * 2 : 256) * sizeof(*r)),
+                                  t->cap ? t->cap * 2 : 256, 0};
+        memset(grown.slots, 0, grown.cap * sizeof(*r));
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].key) {
+                inc_put(&grown, &t->slots[i]);
+            }
+        }
+        free(t->slots);
+        *t = grown;
+    }
+    size_t i = r->key & (t->cap - 1);
+    while (t->slots[i].key && t->slots[i].key != r->key) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    t->count += t->slots[i].key == 0;
+    t->slots[i] = *r;
+}
+
+// Reads the records from inc.read to the end of the index into the tables,
+// up to one that is only partly written.  Returns how many were read.
+size_t inc_read(void) {
+    struct stat st;
+    size_t len = fstat(inc.fd, &st) == 0 ? st.st_size : 0;
+    if (len <= inc.read) {
+        return 0;
+    }
+    char *base = mmap(NULL, len, PROT_READ, MAP_SHARED, inc.fd, 0);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    size_t nrecords = 0, off = inc.read;
+    while (off + sizeof(struct inc_record) <= len) {
+        struct inc_record r;
+        memcpy(&r, base + off, sizeof(r));
+        if (r.magic != INC_MAGIC || (r.kind != INC_STEP && r.kind != INC_FILE) || r.key == 0) {
+            off++;                  // torn or foreign data: look for the next record
+            continue;
+        }
+        inc_put(r.kind == INC_STEP ? &inc.steps : &inc.files, &r);
+        nrecords++;
+        off += sizeof(r);
+    }
+    munmap(base, len);
+    inc.read = off;
+    return nrecords;
+}
+
+// Whether inc.fd is still the file at inc.path, or it cannot be told.
+bool inc_current(void) {
+    struct stat st, at_path;
+    return stat(inc.path, &at_path) != 0 || fstat(inc.fd, &st) != 0 ||
+           (st.st_ino == at_path.st_ino && st.st_dev == at_path.st_dev);
+}
+
+// Writes the live records to a new index and puts it in place of the old.
+// The lock keeps other shells' appends out until they can see the new one.
+void inc_compact(void) {
+    if (flock(inc.fd, LOCK_EX) != 0) {
+        return;
+    }
+    if (!inc_current()) {
+        flock(inc.fd, LOCK_UN);     // another shell has just done it
+        return;
+    }
+    inc_read();
+    struct strbuf tmp = {0};
+    sb_append(&tmp, inc.path, strlen(inc.path));
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+    sb_append(&tmp, suffix, strlen(suffix));
+    int fd = open(tmp.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0;
+    size_t written = 0;
+    struct inc_table *tables[] = {&inc.steps, &inc.files};
+    for (int k = 0; k < 2 && ok; k++) {
+        for (size_t i = 0; i < tables[k]->cap && ok; i++) {
+            if (tables[k]->slots[i].key) {
+                ok = write(fd, &tables[k]->slots[i], sizeof(struct inc_record)) ==
+                     sizeof(struct inc_record);
+                written += sizeof(struct inc_record);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ok && rename(tmp.data, inc.path) == 0) {
+        close(inc.fd);              // and with it the lock
+        inc.fd = open(inc.path, O_RDWR | O_APPEND | O_CLOEXEC);
+        inc.read = written;
+    } else {
+        unlink(tmp.data);
+        flock(inc.fd, LOCK_UN);
+    }
+    free(tmp.data);
+}
+
+// Opens the index named by MYSH_INCREMENTAL, or drops the one in use when
+// it has been changed or unset.  Returns whether there is one.
+bool inc_open(void) {
+    const char *path = var_get("MYSH_INCREMENTAL");
+    if (path != NULL && *path == '\0') {
+        path = NULL;
+    }
+    if (path == NULL ? inc.path == NULL : inc.path != NULL && strcmp(path, inc.path) == 0) {
+        return inc.fd >= 0;
+    }
+    if (inc.fd >= 0) {
+        close(inc.fd);
+    }
+    free(inc.path);
+    free(inc.steps.slots);
+    free(inc.files.slots);
+    inc = (struct incremental){.fd = -1};
+    if (path == NULL) {
+        return false;
+    }
+    inc.path = strdup(path);
+    inc.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (inc.fd < 0) {
+        err_printf("%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t nrecords = inc_read();
+    if (nrecords > 1024 && nrecords > 2 * (inc.steps.count + inc.files.count)) {
+        inc_compact();
+    }
+    return inc.fd >= 0;
+}
+
+void inc_append(uint32_t kind, uint64_t key, uint64_t a, uint64_t b) {
+    struct inc_record r = {INC_MAGIC, kind, key, a, b};
+    inc_put(kind == INC_STEP ? &inc.steps : &inc.files, &r);
+    // After another shell's compaction the record goes in the new file
+    while (flock(inc.fd, LOCK_SH) == 0 && !inc_current()) {
+        int fd = open(inc.path, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (fd < 0) {
+            break;
+        }
+        close(inc.fd);
+        inc.fd = fd;
+        inc.read = 0;
+    }
+    if (write(inc.fd, &r, sizeof(r)) < 0) {
+        // the table still has it; only later shells will not
+    }
+    flock(inc.fd, LOCK_UN);
+}
+
+uint64_t file_stamp(const struct stat *st) {
+    uint64_t stamp[6] = {st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec,
+                         st->st_mtim.tv_nsec, st->st_ctim.tv_nsec};
+    return hash64(0, stamp, sizeof(stamp));
+}
+
+// Hash of the contents of a regular file, read only if it has changed
+// since it was last hashed.
+bool file_digest(const char *cwd, const char *path, uint64_t *digest) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    uint64_t key = hash64_field(path[0] == '/' ? 0 : hash64_field(0, cwd), path) | 1;
+    uint64_t stamp = file_stamp(&st);
+    struct inc_record *known = inc_get(&inc.files, key);
+    if (known != NULL && known->a == stamp) {
+        *digest = known->b;
+        return true;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *digest = hash64(st.st_size, data, st.st_size);
+    if (data != NULL) {
+        munmap(data, st.st_size);
+    }
+    inc_append(INC_FILE, key, stamp, *digest);
+    return true;
+}
+
+// Stamp of all of a step's outputs, or false if one is missing.
+bool outputs_stamp(struct step *s, uint64_t *stamp) {
+    *stamp = 0;
+    for (int i = 0; i < s->out.n; i++) {
+        struct stat st;
+        if (stat(s->out.v[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        *stamp = hash64(*stamp, &(uint64_t){file_stamp(&st)}, 8);
+    }
+    return true;
+}
+
+// Whether args is a step: with an index, writing at least one file with >
+// and otherwise only reading files, no functions or appends.
+bool step_plan(char **args, struct step *s) {
+    if (!inc_open()) {
+        return false;
+    }
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return false;
+    }
+    *s = (struct step){0};
+    uint64_t h = hash64_field(0, cwd);
+    bool stage_start = true, plain = true;
+    for (int i = 0; args[i] != NULL && plain; i++) {
+        if (is_op(args[i])) {
+            plain = !IS_OP(args[i], OP_APPEND) && !IS_OP(args[i], OP_DUP_IN) &&
+                    !IS_OP(args[i], OP_DUP_OUT) && !IS_OP(args[i], OP_BG);
+            if ((IS_OP(args[i], OP_IN) || IS_OP(args[i], OP_OUT)) && args[i + 1] != NULL) {
+                argv_push(IS_OP(args[i], OP_IN) ? &s->in : &s->out, args[i + 1]);
+            }
+            stage_start = IS_OP(args[i], OP_PIPE);
+            h = hash64(h, &(uint64_t){args[i] - op_table[0]}, 8);
+            continue;
+        }
+        if (stage_start && !is_assignment(args[i])) {
+            plain = function_find(args[i]) == NULL;     // its body is not in the key
+            stage_start = false;
+        }
+        h = hash64_field(h, args[i]);
+    }
+    s->key = h | 1;
+    if (!plain || s->out.n == 0) {
+        step_free(s);
+        return false;
+    }
+    s->inputs = hash64(0, &(uint64_t){s->in.n}, 8);
+    s->inputs_ok = true;
+    for (int i = 0; i < s->in.n && s->inputs_ok; i++) {
+        uint64_t digest;
+        s->inputs_ok = file_digest(cwd, s->in.v[i], &digest);
+        s->inputs = hash64(s->inputs, &digest, 8);
+    }
+    return true;
+}
+
+bool step_current(struct step *s) {
+    struct inc_record *done = inc_get(&inc.steps, s->key);
+    uint64_t stamp;
+    return done != NULL && s->inputs_ok && done->a == s->inputs &&
+           outputs_stamp(s, &stamp) && done->b == stamp;
+}
+
+void step_record(struct step *s) {
+    uint64_t stamp;
+    if (s->inputs_ok && outputs_stamp(s, &stamp)) {
+        inc_append(INC_STEP, s->key, s->inputs, stamp);
+    }
+}
+
+// Example of handling commands, including built-ins like "cd"
+int execute_command(char **args) {
+    if (args[0] == NULL) {
+        // An empty command was entered.
+        return last_exit_status;
+    }
+    // A trailing & runs the pipeline in the background.  Builtins still
+    // run in the shell itself.
+    struct launch_opts opts = {0};
+    int n = 0;
+    while (args[n] != NULL) {
+        n++;
+    }
+    if (IS_OP(args[n - 1], OP_BG)) {
+        args[--n] = NULL;
+        opts.background = true;
+    }
+    // Leading NAME=value words: alone they set shell variables, in front of
+    // a command they only go into that command's environment.
+    int nassign = 0;
+    while (args[nassign] != NULL && !is_op(args[nassign]) && is_assignment(args[nassign])) {
+        nassign++;
+    }
+    if (args[nassign] == NULL) {
+        int status = 0;
+        for (int i = 0; i < nassign; i++) {
+            status |= !assign_word(args[i]);
+        }
+        return last_exit_status = status;
+    }
+    char **command = args + nassign;
+
+    // timeout [-k GRACE] DURATION applies to every stage of what follows
+    while (command[0] != NULL && strcmp(command[0], "timeout") == 0) {
+        int used = parse_timeout(command, &opts);
+        if (used < 0) {
+            return last_exit_status = 125;
+        }
+        command += used;
+    }
+
+    // With MYSH_INCREMENTAL, a step that is still up to date is skipped
+    struct step step;
+    if (opts.background || exec_in_place || !step_plan(args, &step)) {
+        return dispatch_command(args, nassign, command, &opts);
+    }
+    int status = 0;
+    if (!step_current(&step)) {
+        status = dispatch_command(args, nassign, command, &opts);
+        if (status == 0) {
+            step_record(&step);
+        }
+    }
+    step_free(&step);
+    return last_exit_status = status;
+}
+
+// Runs a command once its assignments and timeout have been taken off:
+// a function, a builtin, or a pipeline.
+int dispatch_command(char **args, int nassign, char **command, struct launch_opts *opts) {
+    bool pipeline = false;
+    for (int i = 0; command[i] != NULL && !pipeline; i++) {
+        pipeline = IS_OP(command[i], OP_PIPE);
+    }
+
+    // A function runs in the shell, unless it has to be a job of its own
+    struct function *function = pipeline ? NULL : function_find(command[0]);
+    if (function != NULL && !opts->background && opts->timeout == 0) {
+        for (int i = 0; i < nassign; i++) {
+            assign_word(args[i]);
+        }
+        return last_exit_status = run_function(function, command);
+    }
+
+    // Check if the command is a built-in command.
+    int builtin = pipeline || function ? -1 : find_builtin(command[0]);
+    if (builtin >= 0) {
+        // The command is a built-in command. Execute it.
+        for (int i = 0; i < nassign; i++) {
+            assign_word(args[i]);
+        }
+        return last_exit_status = run_builtin(builtin, command);
+    }
+    // Not a built-in command. Attempt to execute it as an external command.
+    char **envp = nassign ? command_env(args, nassign) : env_get();
+    return launch_process(command, envp, opts);
+}
+
+int handle_cd(char **args) {
+    if (args[1] == NULL) {
+        err_printf("Expected argument to \"cd\"\n");
+        return 1;
+    }
+    if (chdir(args[1]) != 0) {
+        err_perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+
+int handle_pwd(char **args) {
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        out_printf("%s\n", cwd);
+        return 0; // Indicate success
+    } else {
+        err_perror("pwd");
+        return 1; // Indicate failure
+    }
+}
+
+int handle_exit(char **args) {
+    int status = args[1] ? atoi(args[1]) : 0;
+    if (isatty(STDIN_FILENO)) {
+        out_printf("mysh: Exiting my shell\n");
+    }
+    exit(status); // Exit the shell
+}
+
+int handle_which(char **args) {
+    if (args[1] == NULL) {
+        err_printf("which: missing argument\n");
+        return 1; // Indicate failure
+    }
+    const char* paths[] = {"/usr/local/bin", "/usr/bin", "/bin"};
+    char executable_path[1024];
+    for (int i = 0; i < sizeof(paths)/sizeof(paths[0]); i++) {
+        snprintf(executable_path, sizeof(executable_path), "%s/%s", paths[i], args[1]);
+        if (access(executable_path, X_OK) == 0) {
+            out_printf("%s\n", executable_path);
+            return 0; // Indicate success
+        }
+    }
+    err_printf("which: no %s in (%s)\n", args[1], var_get("PATH"));
+    return 1; // Indicate failure
+}
+
+int handle_true(char **args) {
+    return 0;
+}
+
+int handle_false(char **args) {
+    return 1;
+}
+
+// Decodes the backslash escape after p[-1] into *c.  In a printf format
+// (format true) \NNN takes one to three octal digits; elsewhere, as in
+// echo -e and %b, it is \0NNN.  \c sets *stop.  Returns the position after
+// the escape.
+const char *decode_escape(const char *p, bool format, char *c, bool *stop) {
+    static const char plain[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v\"\"''";
+    const char *hit = *p ? strchr(plain, *p) : NULL;
+    if (hit != NULL && (hit - plain) % 2 == 0) {
+        *c = hit[1];
+        return p + 1;
+    }
+    if (*p == 'c') {
+        *stop = true;
+        return p + 1;
+    }
+    if (*p == 'x' && isxdigit((unsigned char)p[1])) {
+        int v = 0, n = 0;
+        for (p++; n < 2 && isxdigit((unsigned char)*p); n++, p++) {
+            v = v * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+        }
+        *c = (char)v;
+        return p;
+    }
+    if ((format && *p >= '0' && *p <= '7') || (!format && *p == '0')) {
+        int v = 0, n = 0;
+        for (p += !format; n < 3 && *p >= '0' && *p <= '7'; n++, p++) {
+            v = v * 8 + (*p - '0');
+        }
+        *c = (char)v;
+        return p;
+    }
+    *c = '\\';      // not an escape: the backslash stays
+    return p;
+}
+
+// Writes s with its backslash escapes decoded.  Returns false at a \c,
+// after which nothing more is to be written.
+bool out_escaped(const char *s, bool format) {
+    bool stop = false;
+    while (*s != '\0' && !stop) {
+        const char *plain = s;
+        while (*s != '\0' && *s != '\\') {
+            s++;
+        }
+        out_write(plain, s - plain);
+        if (*s == '\\') {
+            char c = 0;
+            const char *next = decode_escape(s + 1, format, &c, &stop);
+            if (!stop) {
+                out_write(&c, 1);
+            }
+            s = next;
+        }
+    }
+    return !stop;
+}
+
+// echo [-neE] [ARG...], as coreutils' echo: -n drops the newline, -e
+// decodes backslash escapes.  Anything else, "--" included, is printed.
+int handle_echo(char **args) {
+    bool newline = true, escapes = false;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' &&
+           strspn(args[i] + 1, "neE") == strlen(args[i] + 1); i++) {
+        for (const char *p = args[i] + 1; *p != '\0'; p++) {
+            if (*p == 'n') {
+                newline = false;
+            } else {
+                escapes = *p == 'e';
+            }
+        }
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) {
+            out_write(" ", 1);
+        }
+        if (!escapes) {
+            out_write(args[i], strlen(args[i]));
+        } else if (!out_escaped(args[i], false)) {
+            return 0;
+        }
+    }
+    if (newline) {
+        out_write("\n", 1);
+    }
+    return 0;
+}
+
+// A numeric printf argument: decimal, 0x hex or 0 octal, or 'c for the
+// code of c.  A bad one is reported, and what could be read is used.
+long long printf_number(const char *arg, bool *bad) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long v = arg[0] == '-' ? strtoll(arg, &end, 0) : (long long)strtoull(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno == ERANGE) {
+        err_printf("printf: '%s': %s\n", arg, end == arg ? "expected a numeric value"
+                                                : *end ? "value not completely converted"
+                                                       : strerror(errno));
+        *bad = true;
+    }
+    return v;
+}
+
+double printf_double(const char *arg, bool *bad) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    double v = strtod(arg, &end);
+    if (end == arg || *end != '\0') {
+        err_printf("printf: '%s': %s\n", arg, end == arg ? "expected a numeric value"
+                                                           : "value not completely converted");
+        *bad = true;
+    }
+    return v;
+}
+
+// One pass of printf's format over the arguments from *arg on.  Returns
+// false when output is to stop (\c, or a bad conversion).
+bool printf_format(const char *f, char ***arg, bool *bad) {
+    while (*f != '\0') {
+        const char *plain = f;
+        while (*f != '\0' && *f != '\\' && *f != '%') {
+            f++;
+        }
+        out_write(plain, f - plain);
+        if (*f == '\\') {
+            char c = 0;
+            bool stop = false;
+            f = decode_escape(f + 1, true, &c, &stop);
+            if (stop) {
+                return false;
+            }
+            out_write(&c, 1);
+            continue;
+        }
+        if (*f == '\0') {
+            break;
+        }
+        if (f[1] == '%') {
+            out_write("%", 1);
+            f += 2;
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion
+        const char *spec = f++;
+        char flags[8];
+        size_t nflags = 0;
+        while (*f != '\0' && strchr("-+ #0", *f) != NULL) {
+            if (nflags < sizeof(flags) - 1 && memchr(flags, *f, nflags) == NULL) {
+                flags[nflags++] = *f;
+            }
+            f++;
+        }
+        flags[nflags] = '\0';
+        int width = 0, precision = -1;
+        if (*f == '*') {
+            width = (int)printf_number(**arg ? *(*arg)++ : "0", bad);
+            f++;
+        } else {
+            width = (int)strtol(f, (char **)&f, 10);
+        }
+        if (*f == '.') {
+            f++;
+            if (*f == '*') {
+                precision = (int)printf_number(**arg ? *(*arg)++ : "0", bad);
+                f++;
+            } else {
+                precision = (int)strtol(f, (char **)&f, 10);
+            }
+        }
+        while (*f != '\0' && strchr("hlLqjzt", *f) != NULL) {
+            f++;
+        }
+        const char *value = **arg ? *(*arg)++ : NULL;
+        char fmt[32];
+        switch (*f) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            snprintf(fmt, sizeof(fmt), "%%%s*.*ll%c", flags, *f);
+            out_printf(fmt, width, precision, printf_number(value ? value : "0", bad));
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            snprintf(fmt, sizeof(fmt), "%%%s*.*%c", flags, *f);
+            out_printf(fmt, width, precision < 0 ? 6 : precision,
+                       printf_double(value ? value : "0", bad));
+            break;
+        case 'c':
+            if (value != NULL && value[0] != '\0') {
+                snprintf(fmt, sizeof(fmt), "%%%s*c", flags);
+                out_printf(fmt, width, value[0]);
+            }
+            break;
+        case 's':
+            snprintf(fmt, sizeof(fmt), "%%%s*.*s", flags);
+            out_printf(fmt, width, precision < 0 ? INT_MAX : precision, value ? value : "");
+            break;
+        case 'b':
+            if (value != NULL && !out_escaped(value, false)) {
+                return false;
+            }
+            break;
+        default:
+            err_printf("printf: %.*s: invalid conversion specification\n",
+                    (int)(f - spec + (*f != '\0')), spec);
+            *bad = true;
+            return false;
+        }
+        f++;
+    }
+    return true;
+}
+
+// printf FORMAT [ARG...], as coreutils' printf.  The format is reused
+// while arguments remain.
+int handle_printf(char **args) {
+    if (args[1] == NULL) {
+        err_printf("printf: missing operand\n");
+        return 1;
+    }
+    char **arg = args + 2;
+    bool bad = false;
+    while (1) {
+        char **start = arg;
+        if (!printf_format(args[1], &arg, &bad) || *arg == NULL || arg == start) {
+            break;
+        }
+    }
+    return bad ? 1 : 0;
+}
+
+// cat [-AbeEnstTuv] [FILE...]: FILE - (or none) is stdin.  Without
+// options the bytes are copied through in large reads; the options
+// number lines, squeeze blank ones and make characters visible as
+// coreutils' cat does, with line numbers running on across files.
+struct cat_state {
+    bool number, nonblank, squeeze, ends, tabs, visible;
+    int line;
+    bool line_start;
+    int blanks;                 // newlines in a row at the start of lines
+};
+
+void cat_format(struct cat_state *cs, const char *buf, size_t n) {
+    char out[8192 + 16];
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = buf[i];
+        if (len > 8192) {
+            out_write(out, len);
+            len = 0;
+        }
+        if (cs->line_start) {
+            if (c == '\n' && cs->squeeze && ++cs->blanks > 1) {
+                continue;
+            }
+            if (cs->number && !(cs->nonblank && c == '\n')) {
+                len += snprintf(out + len, 16, "%6d\t", ++cs->line);
+            }
+        }
+        cs->line_start = c == '\n';
+        if (c == '\n') {
+            if (cs->ends) {
+                out[len++] = '$';
+            }
+            out[len++] = '\n';
+            continue;
+        }
+        cs->blanks = 0;
+        if (c == '\t') {
+            if (cs->tabs) {
+                out[len++] = '^';
+                out[len++] = 'I';
+            } else {
+                out[len++] = '\t';
+            }
+            continue;
+        }
+        if (cs->visible && c >= 128) {
+            out[len++] = 'M';
+            out[len++] = '-';
+            c -= 128;
+        }
+        if (cs->visible && (c < 32 || c == 127)) {
+            out[len++] = '^';
+            out[len++] = c == 127 ? '?' : c + 64;
+        } else {
+            out[len++] = c;
+        }
+    }
+    out_write(out, len);
+}
+
+// Waits for a terminal to have input, so that ^C can stop a builtin
+// reading it.  False if interrupted.
+bool wait_readable(int fd) {
+    struct pollfd p = {fd, POLLIN};
+    out_flush();
+    return poll(&p, 1, -1) >= 0 || errno != EINTR;     // poll() is never restarted
+}
+
+int handle_cat(char **args) {
+    struct cat_state cs = {.line_start = true};
+    bool options = true, plain = true;
+    int nfiles = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (!options || args[i][0] != '-' || args[i][1] == '\0') {
+            nfiles++;
+            continue;
+        }
+        if (strcmp(args[i], "--") == 0) {
+            options = false;
+            continue;
+        }
+        for (const char *p = args[i] + 1; *p != '\0'; p++) {
+            switch (*p) {
+            case 'A': cs.visible = cs.ends = cs.tabs = true; break;
+            case 'b': cs.number = cs.nonblank = true; break;
+            case 'e': cs.visible = cs.ends = true; break;
+            case 'E': cs.ends = true; break;
+            case 'n': cs.number = true; break;
+            case 's': cs.squeeze = true; break;
+            case 't': cs.visible = cs.tabs = true; break;
+            case 'T': cs.tabs = true; break;
+            case 'u': break;
+            case 'v': cs.visible = true; break;
+            default:
+                err_printf("cat: invalid option -- '%c'\n", *p);
+                return 1;
+            }
+        }
+    }
+    plain = !(cs.number || cs.squeeze || cs.ends || cs.tabs || cs.visible);
+
+    int status = 0;
+    char *buf = xmalloc(65536);
+    options = true;
+    for (int i = 1; nfiles == 0 || args[i] != NULL; i++) {
+        const char *name = nfiles == 0 ? "-" : args[i];
+        if (nfiles > 0 && options && name[0] == '-' && name[1] != '\0') {
+            options = strcmp(name, "--") != 0;
+            continue;
+        }
+        int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            err_printf("cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+        } else {
+            bool tty = isatty(fd);
+            ssize_t n;
+            while ((n = tty && !wait_readable(fd) ? -2 : read(fd, buf, 65536)) != 0) {
+                if (n == -2) {
+                    status = 130;       // ^C at the terminal
+                    break;
+                }
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    err_printf("cat: %s: %s\n", name, strerror(errno));
+                    status = 1;
+                    break;
+                }
+                if (plain) {
+                    out_write(buf, n);
+                } else {
+                    cat_format(&cs, buf, n);
+                }
+                if (tty) {
+                    out_flush();
+                }
+            }
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+        }
+        if (nfiles == 0 || status == 130) {
+            break;
+        }
+    }
+    free(buf);
+    return status;
+}
+
+// test EXPR, or [ EXPR ]: file tests, string and integer comparisons, and
+// !, -a, -o and parentheses over them.  Status 2 on a malformed expression.
+struct test_state {
+    char **argv;
+    int pos, argc;
+    bool error;
+};
+
+bool test_fail(struct test_state *t, const char *arg, const char *msg) {
+    if (!t->error) {
+        if (arg != NULL) {
+            err_printf("%s: %s: %s\n", t->argv[-1], arg, msg);
+        } else {
+            err_printf("%s: %s\n", t->argv[-1], msg);
+        }
+    }
+    t->error = true;
+    return false;
+}
+
+bool test_integer(struct test_state *t, const char *s, long long *v) {
+    char *end;
+    errno = 0;
+    *v = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (end == s || *end != '\0' || errno == ERANGE) {
+        return test_fail(t, s, "integer expression expected");
+    }
+    return true;
+}
+
+bool test_is_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghknprstuwxzGLOS", op[1]);
+}
+
+bool test_is_binary(const char *op) {
+    static const char *const ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                      "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool test_unary(struct test_state *t, char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+    case 'z': return arg[0] == '\0';
+    case 'n': return arg[0] != '\0';
+    case 't': {
+        long long fd;
+        return test_integer(t, arg, &fd) && fd >= 0 && fd <= INT_MAX && isatty((int)fd);
+    }
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op) {
+    case 'e': return true;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    }
+    return false;
+}
+
+bool test_binary(struct test_state *t, const char *a, const char *op, const char *b) {
+    if (op[0] != '-') {
+        int cmp = strcmp(a, b);
+        return op[0] == '<' ? cmp < 0 : op[0] == '>' ? cmp > 0 : (cmp == 0) == (op[0] == '=');
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') {
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        }
+        // A missing file is older than any other
+        if (!ha || !hb) {
+            return op[1] == 'n' ? ha && !hb : hb && !ha;
+        }
+        long long ta = sa.st_mtim.tv_sec * 1000000000LL + sa.st_mtim.tv_nsec;
+        long long tb = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+        return op[1] == 'n' ? ta > tb : ta < tb;
+    }
+    long long x, y;
+    if (!test_integer(t, a, &x) || !test_integer(t, b, &y)) {
+        return false;
+    }
+    switch (op[1] * 256 + op[2]) {
+    case 'e' * 256 + 'q': return x == y;
+    case 'n' * 256 + 'e': return x != y;
+    case 'l' * 256 + 't': return x < y;
+    case 'l' * 256 + 'e': return x <= y;
+    case 'g' * 256 + 't': return x > y;
+    default: return x >= y;
+    }
+}
+
+bool test_or(struct test_state *t);
+
+bool test_primary(struct test_state *t) {
+    if (t->pos >= t->argc) {
+        return test_fail(t, NULL, "argument expected");
+    }
+    char **a = t->argv + t->pos;
+    int left = t->argc - t->pos;
+    if (left >= 3 && test_is_binary(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (left >= 2 && strcmp(a[0], "(") == 0) {
+        t->pos++;
+        bool v = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            return test_fail(t, NULL, "`)' expected");
+        }
+        t->pos++;
+        return v;
+    }
+    if (left >= 2 && test_is_unary(a[0])) {
+        t->pos += 2;
+        return test_unary(t, a[0][1], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+bool test_not(struct test_state *t) {
+    // "! = x" compares the string "!"
+    if (t->pos + 1 < t->argc && strcmp(t->argv[t->pos], "!") == 0 &&
+        !test_is_binary(t->argv[t->pos + 1])) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+bool test_and(struct test_state *t) {
+    bool v = test_not(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        v = test_not(t) && v;
+    }
+    return v;
+}
+
+bool test_or(struct test_state *t) {
+    bool v = test_and(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        v = test_and(t) || v;
+    }
+    return v;
+}
+
+int handle_test(char **args) {
+    struct test_state t = {args + 1};
+    while (t.argv[t.argc] != NULL) {
+        t.argc++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (t.argc == 0 || strcmp(t.argv[t.argc - 1], "]") != 0) {
+            err_printf("[: missing `]'\n");
+            return 2;
+        }
+        t.argc--;
+    }
+    if (t.argc == 0) {
+        return 1;
+    }
+    bool v = test_or(&t);
+    if (!t.error && t.pos < t.argc) {
+        test_fail(&t, t.argv[t.pos], "unexpected argument");
+    }
+    return t.error ? 2 : !v;
+}
+
+int handle_export(char **args) {
+    if (args[1] == NULL) {
+        for (size_t i = 0; i < vars.cap; i++) {
+            struct var *v = &vars.slots[i];
+            if (v->state == VAR_USED && v->exported) {
+                out_printf("export %s\n", v->entry);
+            }
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (len == 0 || !is_name_start(args[i][0])) {
+            err_printf("export: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        status |= !var_set_n(args[i], len, eq ? eq + 1 : NULL, 1);
+    }
+    return status;
+}
+
+int handle_unset(char **args) {
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        status |= !var_unset(args[i]);
+    }
+    return status;
+}
+
+// history [N]          print the last N entries (all by default)
+// history -s WORDS...  append WORDS as an entry
+// history -g TEXT      print entries containing TEXT, most recent first
+int handle_history(char **args) {
+    history_open();
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+        struct strbuf line = {0};
+        for (int i = 2; args[i] != NULL; i++) {
+            if (i > 2) {
+                sb_putc(&line, ' ');
+            }
+            sb_append(&line, args[i], strlen(args[i]));
+        }
+        if (line.data != NULL) {
+            history_add(line.data);
+        }
+        free(line.data);
+        return 0;
+    }
+    if (args[1] != NULL && strcmp(args[1], "-g") == 0) {
+        if (args[2] == NULL) {
+            err_printf("history: -g: missing search text\n");
+            return 1;
+        }
+        history_search(args[2]);
+        for (size_t i = 0; i < hist.nresults; i++) {
+            uint32_t len;
+            const char *text = history_text(hist.results[i], &len);
+            out_printf("%.*s\n", (int)len, text);
+        }
+        return hist.nresults ? 0 : 1;
+    }
+
+    // Walk back N records from the end, then print forwards
+    history_refresh();
+    long count = -1;
+    if (args[1] != NULL) {
+        char *end;
+        count = strtol(args[1], &end, 10);
+        if (*args[1] == '\0' || *end != '\0' || count < 0) {
+            err_printf("history: %s: invalid number\n", args[1]);
+            return 1;
+        }
+        if (count == 0) {
+            return 0;
+        }
+    }
+    long off = hist.len, start = 0;
+    for (long n = 0; count < 0 || n < count; n++) {
+        long prev = history_prev(off);
+        if (prev < 0) {
+            break;
+        }
+        start = off = prev;
+    }
+    while ((start = history_next(start)) >= 0) {
+        uint32_t len;
+        const char *text = history_text(start, &len);
+        out_printf("%.*s\n", (int)len, text);
+        start += HIST_OVERHEAD + len;
+    }
+    return 0;
+}
+
+int handle_jobs(char **args) {
+    jobs_reap(true);
+    for (struct job *job = waiter.jobs; job != NULL; job = job->next) {
+        out_printf("[%d]  Running\t\t%s &\n", job->id, job->text);
+    }
+    return 0;
+}
+
+// wait [%N | PID]...: waits for the given background jobs, or for all of
+// them.  The status is that of the last job waited for.
+int handle_wait(char **args) {
+    int status = 0;
+    if (args[1] == NULL) {
+        for (struct job *job = waiter.jobs; job != NULL; job = job->next) {
+            job_wait(job);
+        }
+        jobs_reap(false);
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        bool by_id = args[i][0] == '%';
+        char *end;
+        long n = strtol(args[i] + by_id, &end, 10);
+        struct job *job = waiter.jobs;
+        while (job != NULL && (by_id ? job->id : job->last_pid) != n) {
+            job = job->next;
+        }
+        if (*end != '\0' || job == NULL) {
+            err_printf("wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        job_wait(job);
+        status = job_exit_status(job);
+    }
+    jobs_reap(false);
+    return status;
+}
+
+// coproc NAME command [args]: starts command in the background with its
+// stdin and stdout on pipes held by the shell, so a long-lived helper can
+// serve many later commands: `cmd >&NAME` writes to it and `cmd <&NAME`
+// reads from it.  NAME_PID is set to its process id.  `coproc -c NAME`
+// closes the shell's write end, which the coprocess sees as end of input.
+int handle_coproc(char **args) {
+    if (args[1] != NULL && strcmp(args[1], "-c") == 0) {
+        struct coproc *cp = args[2] ? coproc_find(args[2]) : NULL;
+        if (cp == NULL) {
+            err_printf("coproc: %s: no such coprocess\n", args[2] ? args[2] : "");
+            return 1;
+        }
+        if (cp->write_fd >= 0) {
+            close(cp->write_fd);
+            cp->write_fd = -1;
+        }
+        return 0;
+    }
+    bool valid = args[1] != NULL && is_name_start(args[1][0]);
+    for (const char *p = args[1]; valid && *p; p++) {
+        valid = is_name_char(*p);
+    }
+    if (!valid || args[2] == NULL) {
+        err_printf("usage: coproc NAME command [args]\n");
+        return 2;
+    }
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) == -1) {
+        err_perror("coproc");
+        return 1;
+    }
+    if (pipe2(from, O_CLOEXEC) == -1) {
+        err_perror("coproc");
+        close(to[0]);
+        close(to[1]);
+        return 1;
+    }
+    struct launch_opts opts = {.background = true, .in_fd = to[0], .out_fd = from[1]};
+    int status = launch_process(args + 2, env_get(), &opts);
+    close(to[0]);
+    close(from[1]);
+    if (status != 0) {
+        close(to[1]);
+        close(from[0]);
+        return status;
+    }
+
+    struct coproc *cp = coproc_find(args[1]);
+    if (cp == NULL) {
+        cp = xmalloc(sizeof(*cp));
+        cp->name = strdup(args[1]);
+        cp->next = coprocs;
+        coprocs = cp;
+    } else {
+        // The old one loses its pipes and sees end of input
+        close(cp->read_fd);
+        if (cp->write_fd >= 0) {
+            close(cp->write_fd);
+        }
+    }
+    cp->pid = waiter.last_background;
+    cp->read_fd = from[0];
+    cp->write_fd = to[1];
+    char name[256], pid[16];
+    snprintf(name, sizeof(name), "%s_PID", args[1]);
+    snprintf(pid, sizeof(pid), "%d", (int)cp->pid);
+    var_set(name, pid, 0);
+    return 0;
+}
+
+// read [NAME...]: reads one line from stdin and assigns its words to the
+// NAMEs, the last one taking the rest of the line (REPLY if none are
+// given).  Reads a byte at a time so that nothing past the newline is
+// taken from a pipe another command will read next.
+int handle_read(char **args) {
+    struct strbuf line = {0};
+    char c;
+    ssize_t n;
+    out_flush();    // a question asked with echo -n is seen first
+    while ((n = read(STDIN_FILENO, &c, 1)) == 1 || (n < 0 && errno == EINTR)) {
+        if (n == 1 && c == '\n') {
+            break;
+        }
+        if (n == 1) {
+            sb_putc(&line, c);
+        }
+    }
+    if (n <= 0 && line.len == 0) {
+        free(line.data);
+        return 1;
+    }
+    sb_putc(&line, '\0');
+
+    char *p = line.data;
+    int status = 0;
+    if (args[1] == NULL) {
+        status |= !var_set("REPLY", p, 0);
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        p += strspn(p, " \t");
+        char *end = args[i + 1] != NULL ? p + strcspn(p, " \t") : p + strlen(p);
+        if (args[i + 1] == NULL) {
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+        }
+        char saved = *end;
+        *end = '\0';
+        status |= !var_set(args[i], p, 0);
+        *end = saved;
+        p = end;
+    }
+    free(line.data);
+    return status;
+}
+
+// stats: the last finished jobs with their wall time, CPU time and peak
+// memory.  "cgroup" rows are measured over the job's cgroup, so include
+// any grandchildren; "rusage" rows come from waitid() per stage.
+int handle_stats(char **args) {
+    int first = job_history.count > NUM_JOB_STATS ? job_history.count - NUM_JOB_STATS : 0;
+    out_printf("%5s %10s %10s %10s %10s %-6s %s\n",
+               "#", "wall ms", "user ms", "sys ms", "mem kB", "source", "command");
+    for (int i = first; i < job_history.count; i++) {
+        struct job_stats *st = &job_history.jobs[i % NUM_JOB_STATS];
+        out_printf("%5d %10.1f %10.1f %10.1f %10ld %-6s %s\n", st->seq,
+                   st->wall_us / 1000.0, st->user_us / 1000.0, st->sys_us / 1000.0,
+                   st->mem_kb, st->cgroup ? "cgroup" : "rusage", st->text);
+    }
+    return 0;
+}
+
+struct ulimit_option {
+    char flag;
+    int resource;
+    int unit;                       // bytes per unit of the value
+    const char *name;
+} ulimit_options[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (kbytes)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+
+#define NUM_ULIMIT_OPTIONS (int)(sizeof(ulimit_options) / sizeof(ulimit_options[0]))
+
+// The limit children will get for resource.
+struct rlimit child_limit(int resource) {
+    struct rlimit lim;
+    for (int i = 0; i < waiter.nlimits; i++) {
+        if (waiter.limits[i].resource == resource) {
+            return waiter.limits[i].limit;
+        }
+    }
+    if (resource == RLIMIT_NOFILE && waiter.nofile_raised) {
+        return waiter.nofile;
+    }
+    getrlimit(resource, &lim);
+    return lim;
+}
+
+void ulimit_print(const struct ulimit_option *o, bool label) {
+    struct rlimit lim = child_limit(o->resource);
+    if (label) {
+        out_printf("%-28s(-%c) ", o->name, o->flag);
+    }
+    if (lim.rlim_cur == RLIM_INFINITY) {
+        out_printf("unlimited\n");
+    } else {
+        out_printf("%llu\n", (unsigned long long)lim.rlim_cur / o->unit);
+    }
+}
+
+// ulimit [-a | -X [N | unlimited]]: shows or sets a limit for the commands
+// the shell starts.  The shell itself is not limited; each child applies
+// the limits between fork and exec.
+int handle_ulimit(char **args) {
+    const struct ulimit_option *o = &ulimit_options[2];    // -f by default
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-a") == 0) {
+        for (int k = 0; k < NUM_ULIMIT_OPTIONS; k++) {
+            ulimit_print(&ulimit_options[k], true);
+        }
+        return 0;
+    }
+    if (args[i] != NULL && args[i][0] == '-') {
+        o = NULL;
+        for (int k = 0; k < NUM_ULIMIT_OPTIONS && args[i][2] == '\0'; k++) {
+            if (ulimit_options[k].flag == args[i][1]) {
+                o = &ulimit_options[k];
+            }
+        }
+        if (o == NULL) {
+            err_printf("ulimit: %s: invalid option\n", args[i]);
+            return 2;
+        }
+        i++;
+    }
+    if (args[i] == NULL) {
+        ulimit_print(o, false);
+        return 0;
+    }
+
+    struct rlimit hard, lim;
+    getrlimit(o->resource, &hard);
+    if (strcmp(args[i], "unlimited") == 0) {
+        lim.rlim_cur = RLIM_INFINITY;
+    } else {
+        char *end;
+        unsigned long long n = strtoull(args[i], &end, 10);
+        if (*end != '\0' || end == args[i] || args[i][0] == '-') {
+            err_printf("ulimit: %s: invalid number\n", args[i]);
+            return 1;
+        }
+        lim.rlim_cur = n * o->unit;
+    }
+    if (hard.rlim_max != RLIM_INFINITY &&
+        (lim.rlim_cur == RLIM_INFINITY || lim.rlim_cur > hard.rlim_max)) {
+        err_printf("ulimit: %s: exceeds the hard limit\n", args[i]);
+        return 1;
+    }
+    lim.rlim_max = lim.rlim_cur;
+    int k = 0;
+    while (k < waiter.nlimits && waiter.limits[k].resource != o->resource) {
+        k++;
+    }
+    waiter.limits[k] = (struct child_limit){o->resource, lim};
+    waiter.nlimits += k == waiter.nlimits;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Command lists and loops.
+//
+// A line is parsed into a tree of commands before anything runs.  Simple
+// commands keep their raw tokens, which are expanded afresh every time the
+// command runs, so a loop body is lexed once however often it is executed.
+// Compound commands may span lines: the parser reads more input (with a
+// "> " prompt) until they are closed.
+// ---------------------------------------------------------------------------
+
+enum node_kind { NODE_CMD, NODE_FOR, NODE_WHILE, NODE_UNTIL, NODE_PIPELINE, NODE_FUNCTION };
+
+struct node {
+    enum node_kind kind;
+    char **words;           // NODE_CMD: raw tokens; NODE_FOR: the items,
+                            // NULL for "$@"
+    char *name;             // NODE_FOR: the variable; NODE_FUNCTION
+    struct node *cond;      // NODE_WHILE, NODE_UNTIL
+    struct node *body;      // NODE_PIPELINE: the first stage
+    char **redirs;          // compound commands: raw redirection tokens
+    bool background;        // NODE_PIPELINE ending in '&'
+    struct node *next;      // next command of the list, or stage
+};
+
+struct parser {
+    char **tok;             // tokens of the current line, in line_arena
+    int pos;
+    int depth;              // compound commands open
+    bool error;
+};
+
+// The next token without consuming it.  At the end of a line inside an
+// open compound command, the next line is read and its newline becomes a
+// ';'.  NULL at the end of the input.
+char *parse_peek(struct parser *p) {
+    if (p->tok[p->pos] == NULL && p->depth > 0 && !p->error) {
+        char *line = read_input_line("> ");
+        char **tok = line ? lex_line(line) : NULL;
+        free(line);
+        if (tok == NULL) {
+            return NULL;
+        }
+        int n = 0;
+        while (tok[n] != NULL) {
+            n++;
+        }
+        p->tok = arena_alloc(&line_arena, (n + 2) * sizeof(char *));
+        p->tok[0] = op_table[OP_SEMI];
+        memcpy(p->tok + 1, tok, (n + 1) * sizeof(char *));
+        p->pos = 0;
+    }
+    return p->tok[p->pos];
+}
+
+bool is_keyword(const char *tok, const char *word) {
+    return tok != NULL && !is_op(tok) && strcmp(tok, word) == 0;
+}
+
+void parse_fail(struct parser *p, const char *tok, const char *expecting) {
+    if (!p->error) {
+        if (tok == NULL) {
+            err_printf("Syntax error: unexpected end of file (expecting `%s')\n", expecting);
+        } else {
+            err_printf("Syntax error near unexpected token `%s'\n", tok);
+        }
+    }
+    p->error = true;
+}
+
+// Consumes keyword word, or fails.
+bool parse_expect(struct parser *p, const char *word) {
+    char *tok = parse_peek(p);
+    while (tok != NULL && IS_OP(tok, OP_SEMI)) {
+        p->pos++;
+        tok = parse_peek(p);
+    }
+    if (!is_keyword(tok, word)) {
+        parse_fail(p, tok, word);
+        return false;
+    }
+    p->pos++;
+    return true;
+}
+
+struct node *parse_list(struct parser *p, const char *end1, const char *end2);
+
+struct node *parse_node(enum node_kind kind) {
+    struct node *n = arena_alloc(&line_arena, sizeof(*n));
+    *n = (struct node){kind};
+    return n;
+}
+
+char **parse_slice(struct parser *p, int start) {
+    int len = p->pos - start;
+    char **words = arena_alloc(&line_arena, (len + 1) * sizeof(char *));
+    memcpy(words, p->tok + start, len * sizeof(char *));
+    words[len] = NULL;
+    return words;
+}
+
+// for NAME [in WORD...]; do LIST; done
+struct node *parse_for(struct parser *p) {
+    struct node *n = parse_node(NODE_FOR);
+    p->depth++;
+    n->name = parse_peek(p);
+    if (n->name == NULL || is_op(n->name) || !is_name_start(n->name[0])) {
+        parse_fail(p, n->name, "a name");
+        return NULL;
+    }
+    p->pos++;
+    if (is_keyword(parse_peek(p), "in")) {
+        int start = ++p->pos;
+        while (p->tok[p->pos] != NULL && !IS_OP(p->tok[p->pos], OP_SEMI)) {
+            p->pos++;
+        }
+        n->words = parse_slice(p, start);
+    }
+    if (!parse_expect(p, "do")) {
+        return NULL;
+    }
+    n->body = parse_list(p, "done", NULL);
+    if (!parse_expect(p, "done")) {
+        return NULL;
+    }
+    p->depth--;
+    return n;
+}
+
+// while LIST; do LIST; done, or until
+struct node *parse_while(struct parser *p, enum node_kind kind) {
+    struct node *n = parse_node(kind);
+    p->depth++;
+    n->cond = parse_list(p, "do", NULL);
+    if (n->cond == NULL || !parse_expect(p, "do")) {
+        parse_fail(p, parse_peek(p), "do");
+        return NULL;
+    }
+    n->body = parse_list(p, "done", NULL);
+    if (!parse_expect(p, "done")) {
+        return NULL;
+    }
+    p->depth--;
+    return n;
+}
+
+bool ends_stage(const char *tok) {
+    return tok == NULL || IS_OP(tok, OP_SEMI) || IS_OP(tok, OP_PIPE) || IS_OP(tok, OP_BG);
+}
+
+bool is_function_name(const char *s, size_t len) {
+    if (len == 0 || !is_name_start(s[0])) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!is_name_char(s[i]) && s[i] != '-' && s[i] != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Length of a "()", or "(){" with the brace glued on, ending word.
+size_t function_parens(const char *word, size_t len) {
+    if (len >= 3 && strcmp(word + len - 3, "(){") == 0) {
+        return 3;
+    }
+    return len >= 2 && strcmp(word + len - 2, "()") == 0 ? 2 : 0;
+}
+
+// Whether a function definition starts at the current token: NAME() or
+// NAME (), or "function NAME", with the () then optional.
+bool at_function(struct parser *p) {
+    char **t = p->tok + p->pos;
+    if (is_keyword(t[0], "function") && t[1] != NULL && !is_op(t[1])) {
+        size_t len = strlen(t[1]);
+        return is_function_name(t[1], len - function_parens(t[1], len));
+    }
+    if (t[0] == NULL || is_op(t[0])) {
+        return false;
+    }
+    size_t len = strlen(t[0]);
+    size_t parens = function_parens(t[0], len);
+    if (parens > 0) {
+        return parens < len && is_function_name(t[0], len - parens);
+    }
+    return (is_keyword(t[1], "()") || is_keyword(t[1], "(){")) && is_function_name(t[0], len);
+}
+
+// NAME() { LIST; }
+struct node *parse_function(struct parser *p) {
+    struct node *n = parse_node(NODE_FUNCTION);
+    if (is_keyword(p->tok[p->pos], "function")) {
+        p->pos++;
+    }
+    char *name = p->tok[p->pos++];
+    size_t len = strlen(name);
+    size_t parens = function_parens(name, len);
+    len -= parens;
+    if (parens == 0 && is_keyword(p->tok[p->pos], "()")) {
+        parens = 2;
+        p->pos++;
+    } else if (parens == 0 && is_keyword(p->tok[p->pos], "(){")) {
+        parens = 3;
+        p->pos++;
+    }
+    n->name = arena_strndup(&line_arena, name, len);
+    p->depth++;
+    if (parens != 3 && !parse_expect(p, "{")) {     // name(){ has its brace
+        return NULL;
+    }
+    n->body = parse_list(p, "}", NULL);
+    if (n->body == NULL && !p->error) {
+        parse_fail(p, parse_peek(p), "a command");
+    }
+    if (p->error || !parse_expect(p, "}")) {
+        return NULL;
+    }
+    p->depth--;
+    return n;
+}
+
+// A pipeline: simple commands and compound ones joined by '|', up to the
+// next ';' or the end of the line; a trailing '&' stays with it.  One made
+// of simple commands only stays a NODE_CMD holding all of its tokens.
+struct node *parse_pipeline(struct parser *p) {
+    int start = p->pos;
+    struct node *head = NULL, **tail = &head;
+    bool compound = false;
+    if (parse_peek(p) != NULL && at_function(p)) {
+        // A definition stands alone
+        struct node *n = parse_function(p);
+        if (n != NULL && p->tok[p->pos] != NULL && !IS_OP(p->tok[p->pos], OP_SEMI)) {
+            parse_fail(p, p->tok[p->pos], NULL);
+            return NULL;
+        }
+        return n;
+    }
+    while (1) {
+        char *tok = parse_peek(p);
+        struct node *n;
+        if (is_keyword(tok, "for") || is_keyword(tok, "while") || is_keyword(tok, "until")) {
+            p->pos++;
+            n = tok[0] == 'f' ? parse_for(p) : parse_while(p, tok[0] == 'w' ? NODE_WHILE : NODE_UNTIL);
+            if (n == NULL) {
+                return NULL;
+            }
+            // Redirections may follow "done"; nothing else may
+            int rstart = p->pos;
+            while (!ends_stage(p->tok[p->pos]) && is_op(p->tok[p->pos]) &&
+                   p->tok[p->pos + 1] != NULL) {
+                p->pos += 2;
+            }
+            if (!ends_stage(p->tok[p->pos])) {
+                parse_fail(p, p->tok[p->pos], NULL);
+                return NULL;
+            }
+            n->redirs = p->pos > rstart ? parse_slice(p, rstart) : NULL;
+            compound = true;
+        } else if (tok == NULL || is_keyword(tok, "do") || is_keyword(tok, "done") || ends_stage(tok)) {
+            parse_fail(p, tok, "a command");
+            return NULL;
+        } else {
+            int sstart = p->pos;
+            while (!ends_stage(p->tok[p->pos])) {
+                p->pos++;
+            }
+            n = parse_node(NODE_CMD);
+            n->words = parse_slice(p, sstart);
+        }
+        *tail = n;
+        tail = &n->next;
+        if (p->tok[p->pos] == NULL || !IS_OP(p->tok[p->pos], OP_PIPE)) {
+            break;
+        }
+        p->pos++;
+    }
+    bool background = p->tok[p->pos] != NULL && IS_OP(p->tok[p->pos], OP_BG);
+    p->pos += background;
+    if (!compound) {
+        head->words = parse_slice(p, start);
+        head->next = NULL;
+        return head;
+    }
+    if (head->next == NULL && !background && head->redirs == NULL) {
+        return head;
+    }
+    struct node *n = parse_node(NODE_PIPELINE);
+    n->body = head;
+    n->background = background;
+    return n;
+}
+
+// Commands separated by ';', '&' or newlines, up to (not including) the
+// keyword end1 or end2 at the start of a command, or the end of the input.
+struct node *parse_list(struct parser *p, const char *end1, const char *end2) {
+    struct node *head = NULL, **tail = &head;
+    while (!p->error) {
+        char *tok = parse_peek(p);
+        if (tok != NULL && IS_OP(tok, OP_SEMI)) {
+            p->pos++;
+            continue;
+        }
+        if (tok == NULL || (end1 && is_keyword(tok, end1)) || (end2 && is_keyword(tok, end2))) {
+            break;
+        }
+        struct node *n = parse_pipeline(p);
+        if (n == NULL) {
+            break;
+        }
+        *tail = n;
+        tail = &n->next;
+    }
+    return p->error ? NULL : head;
+}
+
+// break [N] and continue [N]: pending loop exits, counted in loop levels
+int loop_depth = 0;
+int loop_break = 0;
+int loop_continue = 0;
+bool interrupted = false;          // a foreground command died of SIGINT
+bool function_return = false;      // return: leave the running function
+
+void define_function(struct node *n);
+
+int run_list(struct node *n);
+
+// Runs a simple command: expands its words, then runs it (then/else
+// prefixes make it conditional on the last status).  What the expansion
+// allocates is released afterwards, so a loop runs in constant memory.
+int run_simple(char **words) {
+    struct arena_mark mark = arena_mark(&line_arena);
+    char **args = expand_tokens(words);
+    if (args == NULL) { // Syntax error, already reported
+        arena_release(&line_arena, mark);
+        return last_exit_status = 2;
+    }
+    if (args[0] != NULL) {
+        int shouldExecute = 1; // Flag to determine command execution based on conditionals
+
+        if ((strcmp(args[0], "then") == 0 && last_exit_status != 0) ||
+            (strcmp(args[0], "else") == 0 && last_exit_status == 0)) {
+            shouldExecute = 0; // Do not execute the command based on last_exit_status
+        }
+
+        char **commandToExecute = args;
+        if (strcmp(args[0], "then") == 0 || strcmp(args[0], "else") == 0) {
+            commandToExecute += 1; // Skip 'then'/'else'
+        }
+
+        if (shouldExecute) {
+            execute_command(commandToExecute);
+        }
+    }
+    free(args);
+    arena_release(&line_arena, mark);
+    return last_exit_status;
+}
+
+// After a loop body: whether the loop goes on.
+bool loop_next(void) {
+    if (interrupted || function_return) {
+        return false;
+    }
+    if (loop_break > 0) {
+        loop_break--;
+        return false;
+    }
+    if (loop_continue > 0) {
+        return --loop_continue == 0;    // or the continue is for an outer loop
+    }
+    return true;
+}
+
+int run_for(struct node *n) {
+    char **items;
+    if (n->words != NULL) {
+        items = expand_tokens(n->words);
+    } else {
+        items = xmalloc((params.argc + 1) * sizeof(char *));
+        memcpy(items, params.argv ? params.argv : (char *[]){NULL},
+               (params.argc + 1) * sizeof(char *));
+    }
+    if (items == NULL) {
+        return last_exit_status = 2;
+    }
+    int status = 0;
+    loop_depth++;
+    for (int i = 0; items[i] != NULL; i++) {
+        var_set(n->name, items[i], 0);
+        status = run_list(n->body);
+        if (!loop_next()) {
+            break;
+        }
+    }
+    loop_depth--;
+    free(items);
+    return last_exit_status = status;
+}
+
+int run_while(struct node *n) {
+    int status = 0;
+    loop_depth++;
+    while (1) {
+        bool holds = run_list(n->cond) == 0;
+        if (holds != (n->kind == NODE_WHILE) || interrupted || function_return) {
+            break;
+        }
+        status = run_list(n->body);
+        if (!loop_next()) {
+            break;
+        }
+    }
+    loop_depth--;
+    return last_exit_status = status;
+}
+
+const char *node_keyword(const struct node *n) {
+    return n->kind == NODE_FOR ? "for" : n->kind == NODE_WHILE ? "while" : "until";
+}
+
+// Runs a pipeline with loops in it, or a redirected or background loop.
+// The loops are stages run by forked shells, except a lone redirected loop
+// in the foreground, which runs in the shell so its assignments stay.
+int run_pipeline(struct node *n) {
+    struct node *head = n->kind == NODE_PIPELINE ? n->body : n;
+    struct arena_mark mark = arena_mark(&line_arena);
+    struct argv_buf args = {0};
+    int nstages = 0;
+    for (struct node *st = head; st != NULL; st = st->next) {
+        nstages++;
+    }
+    struct node **compounds = arena_alloc(&line_arena, nstages * sizeof(*compounds));
+    int k = 0;
+    for (struct node *st = head; st != NULL; st = st->next, k++) {
+        char **words = st->kind == NODE_CMD ? st->words : st->redirs;
+        char **expanded = words ? expand_tokens(words) : empty_args();
+        if (expanded == NULL) {
+            free(args.v);
+            arena_release(&line_arena, mark);
+            return last_exit_status = 2;
+        }
+        if (k > 0) {
+            argv_push(&args, op_table[OP_PIPE]);
+        }
+        for (int i = 0; expanded[i] != NULL; i++) {
+            argv_push(&args, expanded[i]);
+        }
+        free(expanded);
+        compounds[k] = st->kind == NODE_CMD ? NULL : st;
+    }
+    if (args.v == NULL) {
+        argv_push(&args, NULL);
+        args.n = 0;
+    }
+    int status;
+    if (nstages == 1 && !n->background) {
+        struct stage st = {args.v, -1, -1};
+        st.compound = head;
+        status = open_redirections(&st, 1) != 0 ? 1 : run_in_shell(&st, -1);
+    } else {
+        struct launch_opts opts = {.background = n->background, .compounds = compounds};
+        status = launch_process(args.v, env_get(), &opts);
+    }
+    free(args.v);
+    arena_release(&line_arena, mark);
+    return last_exit_status = status;
+}
+
+// Runs one command of a list, a loop without its redirections.
+int run_node(struct node *n) {
+    switch (n->kind) {
+    case NODE_CMD:
+        return run_simple(n->words);
+    case NODE_PIPELINE:
+        return run_pipeline(n);
+    case NODE_FOR:
+        return run_for(n);
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        return run_while(n);
+    case NODE_FUNCTION:
+        define_function(n);
+        return last_exit_status = 0;
+    }
+    return last_exit_status;
+}
+
+// Runs a list of commands.  It stops early for a pending break or continue.
+int run_list(struct node *n) {
+    for (; n != NULL && loop_break == 0 && loop_continue == 0 && !interrupted && !function_return;
+         n = n->next) {
+        if (n->redirs != NULL) {
+            run_pipeline(n);
+        } else {
+            run_node(n);
+        }
+    }
+    return last_exit_status;
+}
+
+// Parses a line (and any further lines a compound command on it needs)
+// into a command list.  Returns false on a syntax error, reported.
+bool parse_line(char *line, struct node **list) {
+    char **tok = lex_line(line);
+    if (tok == NULL) {
+        return false;
+    }
+    struct parser p = {tok};
+    *list = parse_list(&p, NULL, NULL);
+    if (!p.error && p.tok[p.pos] != NULL) {
+        parse_fail(&p, p.tok[p.pos], NULL);
+    }
+    return !p.error;
+}
+
+int run_line(char *line) {
+    struct node *list;
+    if (!parse_line(line, &list)) {
+        return last_exit_status = 2;
+    }
+    interrupted = false;
+    return run_list(list);
+}
+
+int handle_break(char **args) {
+    int n = args[1] ? atoi(args[1]) : 1;
+    if (loop_depth == 0) {
+        err_printf("%s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 1;
+    }
+    if (n < 1) {
+        err_printf("%s: %s: loop count out of range\n", args[0], args[1]);
+        return 1;
+    }
+    n = n > loop_depth ? loop_depth : n;
+    if (args[0][0] == 'b') {
+        loop_break = n;
+    } else {
+        loop_break = n - 1;     // leave the inner loops, go on with the Nth
+        loop_continue = 1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Shell functions.
+//
+// A definition's body is copied out of line_arena into an arena of the
+// function's own, so it is parsed once and kept as a tree.  A call runs
+// that tree in the shell, with the arguments as $1... for the duration; a
+// function is only forked as a stage of a pipeline or a background job.
+// ---------------------------------------------------------------------------
+
+#define FUNCTION_DEPTH_MAX 1000
+
+// A body replaced while calls were still running it
+struct retired_body {
+    struct arena arena;
+    struct retired_body *next;
+};
+
+struct function {
+    char *name;
+    struct node *body;
+    struct arena arena;             // name and body
+    int active;                     // calls in progress
+    struct retired_body *retired;   // freed once no call is active
+    struct function *next;
+} *functions = NULL;
+
+int function_depth = 0;
+
+struct function *function_find(const char *name) {
+    struct function *f = functions;
+    while (f != NULL && strcmp(f->name, name) != 0) {
+        f = f->next;
+    }
+    return f;
+}
+
+char **copy_words(struct arena *a, char **words) {
+    if (words == NULL) {
+        return NULL;
+    }
+    int n = 0;
+    while (words[n] != NULL) {
+        n++;
+    }
+    char **copy = arena_alloc(a, (n + 1) * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        copy[i] = is_op(words[i]) ? words[i] : arena_strndup(a, words[i], strlen(words[i]));
+    }
+    copy[n] = NULL;
+    return copy;
+}
+
+struct node *copy_list(struct arena *a, const struct node *n) {
+    struct node *head = NULL, **tail = &head;
+    for (; n != NULL; n = n->next) {
+        struct node *c = arena_alloc(a, sizeof(*c));
+        *c = *n;
+        c->words = copy_words(a, n->words);
+        c->redirs = copy_words(a, n->redirs);
+        c->name = n->name ? arena_strndup(a, n->name, strlen(n->name)) : NULL;
+        c->cond = copy_list(a, n->cond);
+        c->body = copy_list(a, n->body);
+        *tail = c;
+        tail = &c->next;
+    }
+    *tail = NULL;
+    return head;
+}
+
+void define_function(struct node *n) {
+    struct function *f = function_find(n->name);
+    if (f == NULL) {
+        f = xmalloc(sizeof(*f));
+        *f = (struct function){.next = functions};
+        functions = f;
+    } else if (f->active == 0) {
+        arena_release(&f->arena, (struct arena_mark){NULL, 0});
+    } else {
+        // Redefined from inside itself: the running calls still walk the
+        // old body, so it is kept until the outermost one returns
+        struct retired_body *r = xmalloc(sizeof(*r));
+        *r = (struct retired_body){f->arena, f->retired};
+        f->retired = r;
+        f->arena = (struct arena){NULL};
+    }
+    f->name = arena_strndup(&f->arena, n->name, strlen(n->name));
+    f->body = copy_list(&f->arena, n->body);
+}
+
+// Runs a function in the shell.  Its arguments are copied into arg_arena
+// as the new positional parameters, and dropped again on return.
+int call_function(struct function *f, char **args) {
+    if (function_depth == FUNCTION_DEPTH_MAX) {
+        err_printf("%s: maximum function nesting level exceeded (%d)\n", args[0],
+                FUNCTION_DEPTH_MAX);
+        return 1;
+    }
+    struct arena_mark mark = arena_mark(&arg_arena);
+    struct params saved = params;
+    int argc = 0;
+    while (args[argc + 1] != NULL) {
+        argc++;
+    }
+    params.argv = arena_alloc(&arg_arena, (argc + 1) * sizeof(char *));
+    for (int i = 0; i < argc; i++) {
+        params.argv[i] = arena_strndup(&arg_arena, args[i + 1], strlen(args[i + 1]));
+    }
+    params.argv[argc] = NULL;
+    params.argc = argc;
+    int saved_loops = loop_depth;   // break does not reach the caller's loops
+    loop_depth = 0;
+    function_depth++;
+    f->active++;
+    int status = run_list(f->body);
+    if (--f->active == 0) {
+        while (f->retired != NULL) {
+            struct retired_body *r = f->retired;
+            f->retired = r->next;
+            arena_release(&r->arena, (struct arena_mark){NULL, 0});
+            free(r);
+        }
+    }
+    function_depth--;
+    function_return = false;
+    loop_depth = saved_loops;
+    params = saved;
+    arena_release(&arg_arena, mark);
+    return last_exit_status = status;
+}
+
+// Runs a function with its redirections applied to the shell.
+int run_function(struct function *f, char **args) {
+    struct stage st = {args, -1, -1};
+    if (open_redirections(&st, 1) != 0) {
+        return 1;
+    }
+    st.function = f;
+    return run_in_shell(&st, -1);
+}
+
+int handle_return(char **args) {
+    if (function_depth == 0) {
+        err_printf("return: can only `return' from a function\n");
+        return 1;
+    }
+    function_return = true;
+    return args[1] ? atoi(args[1]) & 0xff : last_exit_status;
+}
+
+int handle_shift(char **args) {
+    int n = args[1] ? atoi(args[1]) : 1;
+    if (n < 0 || n > params.argc) {
+        err_printf("shift: %s: shift count out of range\n", args[1] ? args[1] : "1");
+        return 1;
+    }
+    params.argv += n;
+    params.argc -= n;
+    return 0;
+}
+
+// Set in the child of a command substitution: the last external command
+// replaces the child instead of forking yet another process.
+bool exec_in_place = false;
+
+// Runs text as a command and returns its output, minus trailing newlines,
+// in line_arena.  A lone side-effect-free builtin (e.g. $(pwd)) runs
+// in-process straight into the buffer; anything else runs in a forked child
+// whose stdout is a pipe read in large chunks.
+char *command_subst(const char *text, size_t len) {
+    char *line = arena_strndup(&line_arena, text, len);
+    int saved_fd = script_fd;
+    script_fd = -1;
+    struct node *list = NULL;
+    bool parsed = parse_line(line, &list);
+    script_fd = saved_fd;
+    // A single simple command is expanded here; lists and loops run whole
+    // in the child
+    bool simple = parsed && (list == NULL || (list->kind == NODE_CMD && list->next == NULL));
+    char **args = !parsed ? NULL : simple && list ? expand_tokens(list->words) : empty_args();
+    struct capture out = {0};
+    capture_reserve(&line_arena, &out, 0);
+
+    int nassign = 0;
+    while (args && args[nassign] && !is_op(args[nassign]) && is_assignment(args[nassign])) {
+        nassign++;
+    }
+    int builtin = args && args[nassign] && !function_find(args[nassign]) ?
+                  find_builtin(args[nassign]) : -1;
+    bool inline_ok = builtin >= 0 && nassign == 0 && (builtins[builtin].flags & BUILTIN_PURE);
+    for (int i = 0; inline_ok && args[i] != NULL; i++) {
+        inline_ok = !is_op(args[i]);
+    }
+
+    if (args == NULL) {
+        last_exit_status = 2;
+    } else if (args[0] == NULL && simple) {
+        last_exit_status = 0;
+    } else if (inline_ok) {
+        struct capture *saved = builtin_capture;
+        builtin_capture = &out;
+        last_exit_status = call_builtin(builtin, args);
+        builtin_capture = saved;
+    } else {
+        int pipefd[2];
+        if (pipe(pipefd) == -1) {
+            err_perror("pipe");
+            free(args);
+            return "";
+        }
+        out_flush();    // the child must not write our pending output again
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            dup2(pipefd[1], STDOUT_FILENO);
+            close(pipefd[1]);
+            waiter_forget();
+            exec_in_place = simple;
+            int status = simple ? execute_command(args) : run_list(list);
+            out_flush();
+            _exit(status);
+        }
+        close(pipefd[1]);
+        ssize_t n;
+        do {
+            capture_reserve(&line_arena, &out, 16384);
+            n = read(pipefd[0], out.data + out.len, out.cap - out.len - 1);
+            if (n > 0) {
+                out.len += n;
+            }
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        close(pipefd[0]);
+        int status;
+        if (pid < 0) {
+            err_perror("fork");
+            last_exit_status = 1;
+        } else {
+            waitpid(pid, &status, 0);
+            last_exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        }
+    }
+    free(args);
 
-int num_builtins() {
-    return sizeof(builtin_str) / sizeof(char *);
+    while (out.len > 0 && out.data[out.len - 1] == '\n') {
+        out.len--;
+    }
+    out.data[out.len] = '\0';
+    return out.data;
 }
 
+// ---------------------------------------------------------------------------
+// Memoized commands.
+//
+// memo [-e VAR]... [-f FILE]... [--] COMMAND [ARG]... runs COMMAND once and
+// replays its stdout and exit status when the same key comes up again.  The
+// key is the command's words, the current directory, the value of each -e
+// variable and the mtime, size and inode of each -f file, each field
+// length-framed so no two keys run together.  The table is direct-mapped,
+// so it stays a fixed size however many keys a script makes.
+//
+// With MYSH_MEMO set to a path, results are also appended to that file in
+// records like the history's:
+//
+//     magic (4) | len (4) | status (4) | keylen (4) | key | output | len (4)
+//
+// The file is mmap'd and indexed into the same table as it grows, so
+// another shell's results are found too and a hit costs no read().
+// ---------------------------------------------------------------------------
 
-char *read_line_fd(int fd) {
-    char *line = NULL;
-    size_t bufsize = 0;  // getline will allocate a buffer.
-    ssize_t read_size = getline(&line, &bufsize, fdopen(fd, "r"));
-    if (read_size == -1) {
-        free(line);  // Free the allocated buffer
-        return NULL; // Return NULL to indicate end-of-file or error
-    }
-    return line;
-}
+#define MEMO_MAGIC 0x4d454d4du      // "MMEM"
+#define MEMO_OVERHEAD 12
+#define MEMO_SLOTS 1024
+#define MEMO_MAX_OUTPUT (16u << 20) // larger outputs are passed on uncached
 
+struct memo_entry {
+    uint32_t hash;
+    bool used;
+    int status;
+    bool on_disk;                   // off is a record in the store mapping
+    size_t off;
+    char *key, *out;                // otherwise, copies of our own
+    size_t keylen, outlen;
+};
 
-char **split_line_and_expand_wildcards(char *line) {
-    int bufsize = 64, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    char *token;
+struct memo_cache {
+    struct memo_entry slots[MEMO_SLOTS];
+    char *path;                     // MYSH_MEMO the store was opened for
+    int fd;
+    char *base;
+    size_t len;
+    size_t indexed;                 // bytes of the store in the table
+};
 
-    if (!tokens) {
-        fprintf(stderr, "allocation error\n");
-        exit(EXIT_FAILURE);
-    }
+struct memo_cache memo = {.fd = -1};
 
-    token = strtok(line, DELIM);
-    while (token != NULL) {
-        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0) {
-            // Handle redirection
-            tokens[position++] = strdup(token);  // Add the redirection token
-            token = strtok(NULL, DELIM);  // Skip the redirection file name
-            if (token == NULL) {
-                fprintf(stderr, "Syntax error: Missing file name after redirection\n");
-                exit(EXIT_FAILURE);
-            }
-            tokens[position++] = strdup(token);  // Add the redirection file name
-        } else {
-            // Expand wildcards if needed
-            glob_t glob_result;
-            if (strchr(token, '*') != NULL) {
-                glob(token, GLOB_NOCHECK | GLOB_TILDE, NULL, &glob_result);
-                for (unsigned int i = 0; i < glob_result.gl_pathc; ++i) {
-                    tokens[position++] = strdup(glob_result.gl_pathv[i]);
-                    if (position >= bufsize) {
-                        bufsize += 64;
-                        tokens = realloc(tokens, bufsize * sizeof(char*));
-                        if (!tokens) {
-                            fprintf(stderr, "allocation error\n");
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                }
-                globfree(&glob_result);
-            } else {
-                tokens[position++] = strdup(token);
-            }
-        }
+void memo_clear(struct memo_entry *e) {
+    free(e->key);
+    free(e->out);
+    memset(e, 0, sizeof(*e));
+}
 
-        token = strtok(NULL, DELIM);
+// Indexes the records appended to the store since the last call; a later
+// record for a key replaces an earlier one.  A record another shell has
+// only partly written yet is left for the next call.
+void memo_index(void) {
+    off_t size = lseek(memo.fd, 0, SEEK_END);
+    if (size < 0 || (size_t)size == memo.len) {
+        return;
+    }
+    if (memo.base != NULL) {
+        munmap(memo.base, memo.len);
+    }
+    memo.base = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, memo.fd, 0) : NULL;
+    memo.len = memo.base == MAP_FAILED ? 0 : size;
+    if (memo.base == MAP_FAILED) {
+        memo.base = NULL;
+    }
+    size_t off = memo.indexed;
+    while (off + MEMO_OVERHEAD + 8 <= memo.len) {
+        const char *rec = memo.base + off;
+        uint32_t len = get_u32(rec + 4);
+        if (get_u32(rec) == MEMO_MAGIC && len >= 8 && len > memo.len - off - MEMO_OVERHEAD) {
+            break;                  // still being written: index it next time
+        }
+        if (get_u32(rec) != MEMO_MAGIC || len < 8 || get_u32(rec + 8 + len) != len ||
+            get_u32(rec + 12) > len - 8) {
+            off++;                  // torn or foreign data: look for the next record
+            continue;
+        }
+        uint32_t keylen = get_u32(rec + 12);
+        uint32_t hash = hash_bytes(rec + 16, keylen);
+        struct memo_entry *e = &memo.slots[hash & (MEMO_SLOTS - 1)];
+        memo_clear(e);
+        *e = (struct memo_entry){hash, true, (int)get_u32(rec + 8), true, off,
+                                 NULL, NULL, keylen, len - 8 - keylen};
+        off += len + MEMO_OVERHEAD;
     }
-    tokens[position] = NULL;
-    return tokens;
+    memo.indexed = off;
 }
 
-int execute_builtin(char **args) {
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            return (*builtin_func[i])(args);
+// Opens the store named by MYSH_MEMO, or drops the one in use when it has
+// been changed or unset.
+void memo_open(void) {
+    const char *path = var_get("MYSH_MEMO");
+    if (path != NULL && *path == '\0') {
+        path = NULL;
+    }
+    if (path != NULL && memo.path != NULL && strcmp(path, memo.path) == 0) {
+        return;
+    }
+    if (path == NULL && memo.path == NULL) {
+        return;
+    }
+    for (int i = 0; i < MEMO_SLOTS; i++) {
+        if (memo.slots[i].on_disk) {
+            memo_clear(&memo.slots[i]);
         }
     }
-    return 0; // Not a built-in command
+    if (memo.base != NULL) {
+        munmap(memo.base, memo.len);
+    }
+    if (memo.fd >= 0) {
+        close(memo.fd);
+    }
+    free(memo.path);
+    memo.path = path ? strdup(path) : NULL;
+    memo.fd = path ? open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600) : -1;
+    memo.base = NULL;
+    memo.len = memo.indexed = 0;
+    if (path != NULL && memo.fd < 0) {
+        err_printf("memo: %s: %s\n", path, strerror(errno));
+    }
 }
 
-// Example of handling commands, including built-ins like "cd"
-int execute_command(char **args) {
-    if (args[0] == NULL) {
-        // An empty command was entered.
-        return 1;
+struct memo_entry *memo_find(const char *key, size_t keylen, uint32_t hash) {
+    memo_open();
+    if (memo.fd >= 0) {
+        memo_index();
     }
-    // Check if the command is a built-in command.
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            // The command is a built-in command. Execute it.
-            return (*builtin_func[i])(args);
-        }
+    struct memo_entry *e = &memo.slots[hash & (MEMO_SLOTS - 1)];
+    if (!e->used || e->hash != hash || e->keylen != keylen) {
+        return NULL;
     }
-    // Not a built-in command. Attempt to execute it as an external command.
-    return launch_process(args);
+    const char *k = e->on_disk ? memo.base + e->off + 16 : e->key;
+    return memcmp(k, key, keylen) == 0 ? e : NULL;
 }
 
-int handle_cd(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "Expected argument to \"cd\"\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("cd");
+const char *memo_output(struct memo_entry *e) {
+    return e->on_disk ? memo.base + e->off + 16 + e->keylen : e->out;
+}
+
+// Keeps a result: in the store when there is one, which the next lookup
+// indexes, and otherwise in the table itself.
+void memo_remember(const char *key, size_t keylen, uint32_t hash,
+                   const char *out, size_t outlen, int status) {
+    if (memo.fd >= 0) {
+        size_t len = 8 + keylen + outlen;
+        char *rec = xmalloc(len + MEMO_OVERHEAD);
+        uint32_t head[4] = {MEMO_MAGIC, len, status, keylen}, len32 = len;
+        memcpy(rec, head, sizeof(head));
+        memcpy(rec + 16, key, keylen);
+        memcpy(rec + 16 + keylen, out, outlen);
+        memcpy(rec + 8 + len, &len32, 4);
+        bool written = write(memo.fd, rec, len + MEMO_OVERHEAD) == (ssize_t)(len + MEMO_OVERHEAD);
+        free(rec);
+        if (written) {
+            return;
         }
     }
-    return 1;
+    struct memo_entry *e = &memo.slots[hash & (MEMO_SLOTS - 1)];
+    memo_clear(e);
+    *e = (struct memo_entry){hash, true, status, false, 0, xmalloc(keylen + 1),
+                             xmalloc(outlen + 1), keylen, outlen};
+    memcpy(e->key, key, keylen);
+    memcpy(e->out, out, outlen);
 }
 
+void memo_key_field(struct strbuf *key, char tag, const void *data, size_t n) {
+    uint32_t n32 = n;
+    sb_putc(key, tag);
+    sb_append(key, (const char *)&n32, 4);
+    sb_append(key, data, n);
+}
 
-int handle_pwd(char **args) {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("%s\n", cwd);
-        return 0; // Indicate success
-    } else {
-        perror("pwd");
-        return 1; // Indicate failure
+// Runs args in a forked child and collects its stdout; stderr and stdin
+// are the shell's.  Returns the wait status, or -1 if it could not start.
+int memo_run(char **args, struct strbuf *out) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        err_perror("pipe");
+        return -1;
+    }
+    out_flush();    // the child must not write our pending output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[1]);
+        waiter_forget();
+        builtin_capture = NULL;
+        exec_in_place = true;
+        int status = execute_command(args);
+        out_flush();
+        _exit(status);
+    }
+    close(pipefd[1]);
+    char buf[16384];
+    ssize_t n;
+    do {
+        n = read(pipefd[0], buf, sizeof(buf));
+        if (n > 0) {
+            sb_append(out, buf, n);
+        }
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    close(pipefd[0]);
+    if (pid < 0) {
+        err_perror("fork");
+        return -1;
     }
+    int status;
+    waitpid(pid, &status, 0);
+    return status;
 }
 
-int handle_exit(char **args) {
-    // Optional: Handle any arguments to exit here
-    if (isatty(STDIN_FILENO)) {
-        printf("mysh: Exiting my shell\n");
+int handle_memo(char **args) {
+    struct strbuf key = {0};
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if ((strcmp(args[i], "-e") != 0 && strcmp(args[i], "-f") != 0) || args[i + 1] == NULL) {
+            break;
+        }
+        const char *name = args[++i];
+        if (args[i - 1][1] == 'e') {
+            const char *value = var_get(name);
+            memo_key_field(&key, value ? 'e' : 'E', name, strlen(name));
+            if (value != NULL) {
+                memo_key_field(&key, 'v', value, strlen(value));
+            }
+            continue;
+        }
+        struct stat st;
+        memo_key_field(&key, 'f', name, strlen(name));
+        if (stat(name, &st) == 0) {
+            long stamp[5] = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size,
+                             (long)st.st_ino, (long)st.st_dev};
+            memo_key_field(&key, 's', stamp, sizeof(stamp));
+        }
+    }
+    if (args[i] == NULL || (args[i][0] == '-' && strcmp(args[i - 1], "--") != 0)) {
+        err_printf("memo: usage: memo [-e VAR]... [-f FILE]... [--] COMMAND [ARG]...\n");
+        free(key.data);
+        return 2;
+    }
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        memo_key_field(&key, 'd', cwd, strlen(cwd));
+    }
+    for (int k = i; args[k] != NULL; k++) {
+        memo_key_field(&key, 'a', args[k], strlen(args[k]));
     }
-    exit(0); // Exit the shell
-}
 
-int handle_which(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "which: missing argument\n");
-        return 1; // Indicate failure
+    uint32_t hash = hash_bytes(key.data, key.len);
+    struct memo_entry *e = memo_find(key.data, key.len, hash);
+    if (e != NULL) {
+        out_write(memo_output(e), e->outlen);
+        free(key.data);
+        return e->status;
     }
-    const char* paths[] = {"/usr/local/bin", "/usr/bin", "/bin"};
-    char executable_path[1024];
-    for (int i = 0; i < sizeof(paths)/sizeof(paths[0]); i++) {
-        snprintf(executable_path, sizeof(executable_path), "%s/%s", paths[i], args[1]);
-        if (access(executable_path, X_OK) == 0) {
-            printf("%s\n", executable_path);
-            return 0; // Indicate success
-        }
+    struct strbuf out = {0};
+    int status = memo_run(args + i, &out);
+    if (out.len > 0) {
+        out_write(out.data, out.len);
     }
-    fprintf(stderr, "which: no %s in (%s)\n", args[1], getenv("PATH"));
-    return 1; // Indicate failure
+    // Only a command that finished on its own has a result worth keeping
+    if (status != -1 && WIFEXITED(status) && out.len <= MEMO_MAX_OUTPUT) {
+        memo_remember(key.data, key.len, hash, out.data ? out.data : "", out.len,
+                      WEXITSTATUS(status));
+    }
+    free(key.data);
+    free(out.data);
+    return status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+void ignore_signal(int sig) {
 }
 
 // Rename or ensure you're using read_line_fd in the main_loop
 void main_loop(int fd, bool batchMode) {
     char *line;
-    char **args;
     int interactive = isatty(STDIN_FILENO);
 
     if (interactive && !batchMode) {
-        printf("Welcome to my shell!\n");
+        out_printf("Welcome to my shell!\n");
+    }
+    script_fd = fd;
+    show_prompts = interactive && !batchMode;
+    const char *term = getenv("TERM");
+    use_editor = show_prompts && isatty(STDOUT_FILENO) && term && strcmp(term, "dumb") != 0 &&
+                 event_loop_start();
+    if (show_prompts) {
+        // Ctrl-C interrupts the foreground command, not the shell.  A
+        // handler rather than SIG_IGN, so exec() resets it for children.
+        struct sigaction sa = {0};
+        sa.sa_handler = ignore_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGQUIT, &sa, NULL);
     }
 
     do {
-        if (interactive && !batchMode) {
-            printf("mysh> ");
+        // A script keeps finished jobs until it waits for them, so that
+        // `wait $!` still finds one that was quick
+        if (show_prompts) {
+            jobs_reap(true);
+        } else if (waiter.jobs != NULL) {
+            while (waiter_run(0) > 0) {
+            }
         }
-        // Change here: Use file descriptor fd with read_line_fd
-        line = read_line_fd(fd); 
+        line = read_input_line("mysh> ");
         if (line == NULL) { // Handle EOF
             break;
         }
+        if (show_prompts) {
+            history_add(line);
+        }
 
-        args = split_line_and_expand_wildcards(line);
+        run_line(line);
+        out_flush();        // the line's builtin output goes out with it
+        free(line);
+        arena_reset(&line_arena);
+    } while (1);
 
-        int shouldExecute = 1; // Flag to determine command execution based on conditionals
+    if (interactive && !batchMode) {
+        out_printf("\nExiting my shell.\n");
+    }
+}
 
-        if ((strcmp(args[0], "then") == 0 && last_exit_status != 0) ||
-            (strcmp(args[0], "else") == 0 && last_exit_status == 0)) {
-            shouldExecute = 0; // Do not execute the command based on last_exit_status
+// Runs a pipeline of external commands: cmd [| cmd]...  Every stage's
+// redirections are opened up front, then each stage is forked with its
+// pipe ends and redirections dup'ed onto stdin/stdout.
+int launch_process(char **args, char **envp, const struct launch_opts *opts) {
+    bool background = opts->background;
+    int nstages = 1;
+    int status = 0;
+
+    // Split the pipeline into stages
+    for (int i = 0; args[i] != NULL; i++) {
+        if (IS_OP(args[i], OP_PIPE)) {
+            nstages++;
+        }
+    }
+    struct stage *stages = arena_alloc(&line_arena, nstages * sizeof(struct stage));
+    memset(stages, 0, nstages * sizeof(struct stage));
+    pid_t *pids = arena_alloc(&line_arena, nstages * sizeof(pid_t));
+    stages[0].argv = args;
+    for (int i = 0, k = 0; args[i] != NULL; i++) {
+        if (IS_OP(args[i], OP_PIPE)) {
+            args[i] = NULL; // Null-terminate the previous command line
+            stages[++k].argv = &args[i + 1];
         }
+    }
+    for (int k = 0; k < nstages && opts->compounds != NULL; k++) {
+        stages[k].compound = opts->compounds[k];
+    }
 
-        char **commandToExecute = args;
-        if (strcmp(args[0], "then") == 0 || strcmp(args[0], "else") == 0) {
-            commandToExecute += 1; // Skip 'then'/'else'
+    // Handle input and output redirections
+    if (open_redirections(stages, nstages) != 0) {
+        return last_exit_status = 1;
+    }
+    for (int k = 0; k < nstages && nstages > 1; k++) {
+        if (stages[k].argv[0] == NULL && stages[k].compound == NULL) {
+            err_printf("Syntax error: empty command in pipeline\n");
+            for (k = 0; k < nstages; k++) {
+                close_redirections(&stages[k]);
+            }
+            return last_exit_status = 2;
         }
+    }
+    if (stages[0].argv[0] == NULL && stages[0].compound == NULL) { // Only redirections, e.g. "> file"
+        close_redirections(&stages[0]);
+        return last_exit_status = 0;
+    }
+    for (int k = 0; k < nstages; k++) {
+        stages[k].function = stages[k].compound ? NULL : function_find(stages[k].argv[0]);
+        int b = stages[k].compound || stages[k].function ? -1 : find_builtin(stages[k].argv[0]);
+        stages[k].builtin = b >= 0 && (builtins[b].flags & BUILTIN_RAW) ? &builtins[b] : NULL;
+    }
 
-        if (shouldExecute) {
-            if (!execute_builtin(commandToExecute)) {
-                launch_process(commandToExecute);
+    // Adjacent builtins run as one stage passing records; if that is the
+    // whole pipeline it runs in the shell without a fork
+    nstages = fuse_in_process_stages(stages, nstages);
+    if (nstages == 1 && stages[0].run != NULL && !background && opts->timeout == 0) {
+        return last_exit_status = run_in_shell(&stages[0], -1);
+    }
+
+    // Find the executables: from the command cache if it is warm, else with
+    // one batch of statx calls on the ring
+    bool batch = ring_available();
+    for (int k = 0; k < nstages; k++) {
+        bool forked_shell = stages[k].run || stages[k].compound || stages[k].function ||
+                            stages[k].builtin;
+        stages[k].path = forked_shell ? NULL : command_path(stages[k].argv[0]);
+    }
+    if (batch) {
+        ring_resolve_paths(stages, nstages);
+    }
+
+    // With MYSH_SANDBOX, nothing runs unconfined for want of a sandbox
+    if (sandbox_setup() < 0) {
+        for (int k = 0; k < nstages; k++) {
+            close_redirections(&stages[k]);
+        }
+        return last_exit_status = 126;
+    }
+
+    // A coprocess talks to the shell through its pipes, unless redirected
+    if (opts->in_fd > 0 && stages[0].in_fd < 0) {
+        stages[0].in_fd = fcntl(opts->in_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (opts->out_fd > 0 && stages[nstages - 1].out_fd < 0) {
+        stages[nstages - 1].out_fd = fcntl(opts->out_fd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    // A background job does not compete with the shell for its input
+    if (background && stages[0].in_fd < 0) {
+        stages[0].in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    struct job *job = xmalloc(sizeof(*job));
+    *job = (struct job){.status = 1 << 8, .timer.fd = -1, .cgroup_fd = -1};
+    struct strbuf text = {0};
+    for (int k = 0; k < nstages; k++) {
+        if (k > 0) {
+            sb_append(&text, " | ", 3);
+        }
+        if (stages[k].compound != NULL) {
+            const char *kw = node_keyword(stages[k].compound);
+            sb_append(&text, kw, strlen(kw));
+        }
+        for (int i = 0; stages[k].argv[i] != NULL; i++) {
+            if (i > 0 || stages[k].compound != NULL) {
+                sb_append(&text, " ", 1);
+            }
+            sb_append(&text, stages[k].argv[i], strlen(stages[k].argv[i]));
+        }
+    }
+    job->text = text.data;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    if (!(nstages == 1 && exec_in_place)) {
+        job_cgroup_create(job);
+    }
+    bool *untracked = arena_alloc(&line_arena, nstages * sizeof(bool));
+    out_flush();        // Earlier builtin output goes out before the children's
+    int prev_read = -1; // Read end of the pipe from the previous stage
+    for (int k = 0; k < nstages; k++) {
+        int pipefd[2] = {-1, -1};
+        untracked[k] = false;
+        if (k < nstages - 1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+            err_perror("pipe");
+            for (int j = k; j < nstages; j++) {
+                close_redirections(&stages[j]);
             }
+            nstages = k;
+            break;
         }
 
-        free(line);
-        free(args);
-    } while (1);
+        // (namespaces are only had by starting a process)
+        bool in_place = nstages == 1 && exec_in_place && opts->timeout == 0 &&
+                        sandbox.clone_flags == 0;
+        bool forked_shell = stages[k].run || stages[k].compound || stages[k].function ||
+                            stages[k].builtin;
+        if (forked_shell && batch) {
+            ring_run();     // a forked shell must not inherit queued closes
+        }
+        pids[k] = in_place ? 0 : spawn_child(job, forked_shell ? 0 : sandbox.clone_flags,
+                                             forked_shell, &untracked[k]);
+        if (pids[k] == 0) { // Child process
+            child_apply_limits();
+            int in = stages[k].in_fd >= 0 ? stages[k].in_fd : prev_read;
+            int out = stages[k].out_fd >= 0 ? stages[k].out_fd : pipefd[1];
+            if (in >= 0) {
+                dup2(in, STDIN_FILENO);
+            }
+            if (out >= 0) {
+                dup2(out, STDOUT_FILENO);
+            }
+            // Everything else is close-on-exec
+            environ = envp;
+            sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+            if (forked_shell) {
+                // A forked shell for the run, loop or function; it execs nothing, so drop
+                // what close-on-exec would have
+                int fds[4] = {in, out, pipefd[0], prev_read};
+                for (int i = 0; i < 4; i++) {
+                    if (fds[i] > STDERR_FILENO) {
+                        close(fds[i]);
+                    }
+                }
+                signal(SIGINT, SIG_DFL);
+                signal(SIGQUIT, SIG_DFL);
+                waiter_forget();
+                int run_status = run_stage(&stages[k], -1);
+                out_flush();
+                _exit(run_status);
+            }
+            sandbox_enter();
+            if (stages[k].path != NULL) {
+                execve(stages[k].path, stages[k].argv, envp);
+            }
+            execvp(stages[k].argv[0], stages[k].argv);
+            child_perror("", stages[k].argv[0]);
+            _exit(127);
+        }
+        if (pids[k] < 0) {
+            err_perror("fork");
+        }
 
-    if (interactive && !batchMode) {
-        printf("\nExiting my shell.\n");
+        // Parent process: our copies of this stage's fds go.  On the ring
+        // the closes are queued and issued in one go.
+        int done[4] = {prev_read, pipefd[1], stages[k].in_fd, stages[k].out_fd};
+        for (int i = 0; i < 4; i++) {
+            if (done[i] >= 0 && batch) {
+                ring_close(done[i]);
+            } else if (done[i] >= 0) {
+                close(done[i]);
+            }
+        }
+        for (int i = 0; i < stages[k].nrun; i++) {
+            close_redirections(&stages[k].run[i]);
+        }
+        prev_read = pipefd[0];
+        stages[k].in_fd = stages[k].out_fd = -1;
+    }
+    if (prev_read >= 0) {
+        close(prev_read);
+    }
+
+    if (batch) {
+        ring_run();
+    }
+    if (opts->timeout > 0 && job->nrunning > 0) {
+        job_set_timeout(job, opts->timeout, opts->kill_after);
+    }
+
+    // Children without a pidfd are waited for here, and only in the
+    // foreground: in a background job they are left untracked
+    if (background) {
+        job_background(job);
+        if (show_prompts) {
+            err_printf("[%d] %d\n", job->id, (int)job->last_pid);
+        }
+        return last_exit_status = 0;
+    }
+    for (int k = 0; k < nstages; k++) {
+        if (untracked[k]) {
+            waitpid(pids[k], k == nstages - 1 ? &job->status : &status, 0);
+        }
+    }
+    job_wait(job);
+    status = nstages > 0 && pids[nstages - 1] > 0 ? job->status : 1 << 8;
+    bool timed_out = job->timed_out;
+    if (job->cgroup_fd >= 0) {
+        job_finish(job);            // no child was started in it
+    }
+    free(job->text);
+    free(job);
+    if (show_prompts && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        out_write("\n", 1);    // the ^C echo is left on the command's last line
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        interrupted = true;     // and any loop it was in stops
     }
+    last_exit_status = timed_out ? TIMEOUT_STATUS : WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    return last_exit_status;
 }
 
-int launch_process(char **args) {
-    int pipe_position = -1;
-    pid_t pid1, pid2;
-    int status;
+// ---------------------------------------------------------------------------
+// Fork server.
+//
+// mysh --server SOCKET starts once, imports the environment and reads the
+// PATH directories into the command cache, then listens on a UNIX socket.
+// mysh --client SOCKET SCRIPT [ARG]... opens the script, connects, and
+// sends its stdin, stdout, stderr and the script as SCM_RIGHTS, followed by
+//
+//     len (4) | argc (4) | umask (4) | cwd \0 | argv \0... | environ \0...
+//
+// The server keeps one worker forked ahead of time, waiting in accept().
+// The worker that gets a connection takes over the client's descriptors,
+// directory, umask and environment and runs the script as a batch shell
+// would, with the server's warm caches, while the server forks the next.
+// The server writes the worker's pid back at once and its wait status
+// when it is done.  The client forwards SIGINT, SIGTERM, SIGHUP and
+// SIGQUIT to the worker's process group and exits the way the worker did.
+// Without a server the client runs the script itself.  Only the server's
+// own user can connect, and a worker hangs up on a client of any other.
+// ---------------------------------------------------------------------------
 
-    // Find if there's a pipeline
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "|") == 0) {
-            pipe_position = i;
-            break;
+struct server_worker {
+    pid_t pid;
+    int conn;
+};
+
+struct server {
+    int listen_fd, sigfd;
+    int ctl[2];                     // idle worker -> server: its connection
+    pid_t idle;                     // the worker waiting in accept(), or -1
+    struct server_worker *workers;  // the ones with a client
+    int nworkers, cap;
+    sigset_t saved_mask;
+};
+
+void server_listen_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+bool read_full(int fd, void *buf, size_t n) {
+    for (size_t done = 0; done < n;) {
+        ssize_t got = read(fd, (char *)buf + done, n - done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
         }
+        done += got;
     }
+    return true;
+}
 
-    // Handle input and output redirections
-    int input_fd, output_fd;
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0) { // Input redirection
-            input_fd = open(args[i + 1], O_RDONLY);
-            if (input_fd < 0) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-            // Remove redirection symbols and filename from args
-            args[i] = NULL;
-            args[i + 1] = NULL;
-        } else if (strcmp(args[i], ">") == 0) { // Output redirection
-            output_fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (output_fd < 0) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            dup2(output_fd, STDOUT_FILENO);
-            close(output_fd);
-            // Remove redirection symbols and filename from args
-            args[i] = NULL;
-            args[i + 1] = NULL;
-        }
-    }
-
-    if (pipe_position == -1) { // No pipeline found
-        pid1 = fork();
-        if (pid1 == 0) { // Child process
-            execvp(args[0], args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else { // Parent process
-            waitpid(pid1, &status, 0);
-            last_exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
-            return last_exit_status == 0 ? 1 : 0;
+// In a worker: takes the client's request off conn and becomes its shell.
+// Returns the script's descriptor.
+int server_accept_request(int conn) {
+    uint32_t head[3];
+    int fds[4];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {head, sizeof(head)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (got != sizeof(head) || cm == NULL || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fds)) || head[0] > (64u << 20) || head[1] == 0 ||
+        head[1] > head[0]) {
+        _exit(EXIT_FAILURE);
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    char *data = xmalloc(head[0] + 1);
+    if (!read_full(conn, data, head[0])) {
+        _exit(EXIT_FAILURE);
+    }
+    data[head[0]] = '\0';
+    close(conn);
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);        // dup2 clears close-on-exec
+        close(fds[i]);
+    }
+    umask(head[2]);
+    char *p = data, *end = data + head[0];
+    if (chdir(p) != 0) {
+        err_perror(p);
+    }
+    p += strlen(p) + 1;
+    char **argv = xmalloc((head[1] + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < head[1]; i++, p += strlen(p) + 1) {
+        if (p >= end) {
+            _exit(EXIT_FAILURE);    // fewer arguments than the header says
         }
-    } else { // Pipeline found
-        // Split args into two separate command lines
-        args[pipe_position] = NULL; // Null-terminate the first command line
-        char **cmd1 = args;
-        char **cmd2 = &args[pipe_position + 1];
+        argv[i] = p;
+    }
+    argv[head[1]] = NULL;
+    struct argv_buf env = {0};
+    for (; p < end; p += strlen(p) + 1) {
+        argv_push(&env, p);
+    }
 
-        // Create pipe
-        int pipefd[2];
-        if (pipe(pipefd) == -1) {
-            perror("pipe");
-            exit(EXIT_FAILURE);
+    // The client's environment replaces the server's
+    for (size_t i = 0; i < vars.cap; i++) {
+        free(vars.slots[i].entry);
+    }
+    memset(vars.slots, 0, vars.cap * sizeof(struct var));
+    vars.used = vars.deleted = 0;
+    env_dirty = true;
+    static char *no_env[] = {NULL};
+    environ = env.v ? env.v : no_env;
+    import_environment();
+    sandbox_init();
+    params = (struct params){argv[0], argv + 1, head[1] - 1};
+    return fds[3];
+}
+
+// Forks the next worker ahead of its client, so that the fork is not on
+// the client's path.  The worker waits in accept(), hands the connection
+// to the server (which answers the client and reports the status) and
+// takes the request.  Returns 0 in the worker, with script set, and the
+// worker's pid (or -1) in the server.
+pid_t server_prefork(struct server *sv, int *script) {
+    pid_t server = getpid();
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    // A group of its own, for the client to signal as a terminal would
+    // signal a foreground job
+    setpgid(0, 0);
+    int forwarded[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+        signal(forwarded[i], SIG_DFL);
+    }
+    close(sv->sigfd);
+    close(sv->ctl[0]);
+    for (int i = 0; i < sv->nworkers; i++) {
+        close(sv->workers[i].conn);     // the server's business, not ours
+    }
+    free(sv->workers);
+    // An idle worker goes with the server; a busy one finishes its script
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != server) {
+        _exit(EXIT_FAILURE);
+    }
+    int conn;
+    do {
+        conn = accept4(sv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (conn < 0 && (errno == EINTR || errno == ECONNABORTED));
+    prctl(PR_SET_PDEATHSIG, 0);
+    close(sv->listen_fd);
+    // The worker runs the script as us: only our own user may ask
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+    if (conn >= 0 && (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 ||
+                      peer.uid != geteuid())) {
+        _exit(EXIT_FAILURE);
+    }
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {"", 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &conn, sizeof(int));
+    if (conn < 0 || sendmsg(sv->ctl[1], &msg, 0) != 1) {
+        _exit(EXIT_FAILURE);    // the client sees the connection close
+    }
+    close(sv->ctl[1]);
+    sigprocmask(SIG_SETMASK, &sv->saved_mask, NULL);
+    *script = server_accept_request(conn);
+    return 0;
+}
+
+// Takes the connection the idle worker has reported, if it has: the client
+// gets the worker's pid, and later its status.
+void server_take(struct server *sv) {
+    char byte, control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    if (recvmsg(sv->ctl[0], &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != 1) {
+        return;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    int conn = -1;
+    if (cm != NULL && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(&conn, CMSG_DATA(cm), sizeof(int));
+    }
+    uint32_t word = sv->idle;
+    if (conn >= 0 && send(conn, &word, sizeof(word), MSG_NOSIGNAL) == sizeof(word)) {
+        if (sv->nworkers == sv->cap) {
+            sv->cap = sv->cap ? sv->cap * 2 : 16;
+            sv->workers = xrealloc(sv->workers, sv->cap * sizeof(*sv->workers));
         }
+        sv->workers[sv->nworkers++] = (struct server_worker){sv->idle, conn};
+    } else if (conn >= 0) {
+        close(conn);
+    }
+    sv->idle = -1;
+}
 
-        pid1 = fork();
-        if (pid1 == 0) { // Child process for the first command
-            close(pipefd[0]); // Close read end of the pipe
-            dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to the write end of the pipe
-            close(pipefd[1]); // Close the write end of the pipe
-            execvp(cmd1[0], cmd1);
-            perror("execvp");
-            exit(EXIT_FAILURE);
+// Reaps finished workers and tells their clients.
+void server_reap(struct server *sv) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == sv->idle) {
+            // A quick script can be done before the server has looked at
+            // its connection, which was sent before it ran
+            server_take(sv);
+            sv->idle = -1;
+        }
+        for (int i = 0; i < sv->nworkers; i++) {
+            if (sv->workers[i].pid == pid) {
+                uint32_t word = status;
+                send(sv->workers[i].conn, &word, sizeof(word), MSG_NOSIGNAL);
+                close(sv->workers[i].conn);
+                sv->workers[i] = sv->workers[--sv->nworkers];
+                break;
+            }
         }
+    }
+}
 
-        pid2 = fork();
-        if (pid2 == 0) { // Child process for the second command
-            close(pipefd[1]); // Close write end of the pipe
-            dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to the read end of the pipe
-            close(pipefd[0]); // Close the read end of the pipe
-            execvp(cmd2[0], cmd2);
-            perror("execvp");
-            exit(EXIT_FAILURE);
+// Runs the server.  Returns only in a worker, with the script to run.
+int server_run(const char *path) {
+    struct sockaddr_un addr;
+    server_listen_addr(path, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        err_printf("mysh: a server is already listening on %s\n", path);
+        out_flush();
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    mode_t saved_umask = umask(077);    // the socket is for our own user only
+    bool bound = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(saved_umask);
+    if (!bound || listen(fd, 128) != 0) {
+        err_perror(path);
+        out_flush();
+        exit(EXIT_FAILURE);
+    }
+
+    // Blocked before the cache threads start, so that they inherit it and
+    // only the signalfd sees a worker finish
+    sigset_t mask, saved;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &saved);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    // Workers start with the command table built
+    prefetch_idle();
+    for (int i = 0; i < 100 && cache.started; i++) {
+        pthread_mutex_lock(&cache.lock);
+        bool ready = cache.path_ready && cache.path_jobs == 0;
+        pthread_mutex_unlock(&cache.lock);
+        if (ready) {
+            break;
         }
+        poll(&(struct pollfd){cache.notify_fd[0], POLLIN}, 1, 20);
+        char drain[64];
+        while (read(cache.notify_fd[0], drain, sizeof(drain)) > 0) {
+        }
+    }
 
-        // Parent process
-        close(pipefd[0]); // Close both ends of the pipe
-        close(pipefd[1]);
-        waitpid(pid1, NULL, 0);
-        waitpid(pid2, &status, 0);
-        last_exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
-        return last_exit_status == 0 ? 1 : 0;
+    struct server sv = {fd, sigfd, .idle = -1, .saved_mask = saved};
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv.ctl) != 0) {
+        err_perror("socketpair");
+        out_flush();
+        exit(EXIT_FAILURE);
+    }
+    int script;
+    time_t revalidated = time(NULL);
+    out_flush();
+    while (1) {
+        if (sv.idle < 0 && (sv.idle = server_prefork(&sv, &script)) == 0) {
+            return script;
+        }
+        struct pollfd pfd[2] = {{sv.ctl[0], POLLIN}, {sigfd, POLLIN}};
+        if (poll(pfd, 2, sv.idle < 0 ? 100 : -1) < 0) {
+            continue;
+        }
+        if (pfd[0].revents & POLLIN) {
+            server_take(&sv);
+        }
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) > 0) {
+            }
+            server_reap(&sv);
+        }
+        if (sv.idle < 0 && time(NULL) != revalidated) {
+            prefetch_idle();        // re-stat PATH for the workers to come
+            revalidated = time(NULL);
+        }
+    }
+}
+
+pid_t client_worker = 0;
+
+void client_forward(int sig) {
+    if (client_worker > 0) {
+        kill(-client_worker, sig);
+    }
+}
+
+// Has the server at path run the script, and exits as the script did.
+// Returns if there is no server to do it.
+void client_run(const char *path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    server_listen_addr(path, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    int script = open(argv[0], O_RDONLY | O_CLOEXEC);
+    if (script < 0) {
+        close(fd);
+        return;                 // reported by the local run
+    }
+
+    struct strbuf data = {0};
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
     }
+    sb_append(&data, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; i++) {
+        sb_append(&data, argv[i], strlen(argv[i]) + 1);
+    }
+    for (char **e = environ; *e != NULL; e++) {
+        sb_append(&data, *e, strlen(*e) + 1);
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    uint32_t head[3] = {data.len, argc, mask};
+    int fds[4] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, script};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {head, sizeof(head)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
 
-    return 0; // Return 0 by default if no command is executed
+    uint32_t word;
+    bool sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(head);
+    for (size_t off = 0; sent && off < data.len;) {
+        ssize_t n = send(fd, data.data + off, data.len - off, MSG_NOSIGNAL);
+        sent = n > 0 || (n < 0 && errno == EINTR);
+        off += n > 0 ? n : 0;
+    }
+    free(data.data);
+    close(script);
+    if (!sent || !read_full(fd, &word, sizeof(word))) {
+        close(fd);
+        return;                 // no worker was started
+    }
+    client_worker = word;
+    struct sigaction sa = {0};
+    sa.sa_handler = client_forward;
+    int forwarded[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+        sigaction(forwarded[i], &sa, NULL);
+    }
+    if (!read_full(fd, &word, sizeof(word))) {
+        fprintf(stderr, "mysh: %s: server went away\n", path);
+        exit(EXIT_FAILURE);
+    }
+    int status = word;
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
 }
 
 int main(int argc, char **argv) {
     int fd = STDIN_FILENO;  // Default to standard input
     bool batchMode = false;
 
-    if (argc > 1) {
+    // A client only hands the script over; it runs it itself if nobody
+    // is listening
+    if (argc > 2 && strcmp(argv[1], "--client") == 0) {
+        if (argc > 3) {
+            client_run(argv[2], argc - 3, argv + 3);
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    import_environment();
+    sandbox_init();
+
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+        fd = server_run(argv[2]);
+        batchMode = true;
+    } else if (argc > 1) {
         // Attempt to open the script file
         fd = open(argv[1], O_RDONLY);
         if (fd < 0) {
-            perror("Error opening script file");
+            err_perror("Error opening script file");
             return EXIT_FAILURE;
         }
         batchMode = true;
+        params = (struct params){argv[1], argv + 2, argc - 2};
+    } else {
+        params.zero = argv[0];
     }
 
+    // Output to a terminal goes out a line at a time; into a file or pipe
+    // it is gathered into large writes
+    outq.line_flush[STDOUT_FILENO] = isatty(STDOUT_FILENO);
+    outq.line_flush[STDERR_FILENO] = isatty(STDERR_FILENO);
+    pid_t self = getpid();
+    outq.shared = syscall(SYS_kcmp, self, self, KCMP_FILE, STDOUT_FILENO, STDERR_FILENO) == 0;
+    atexit(out_flush);
+
     // Use main_loop function to handle command execution
     main_loop(fd, batchMode);
 
@@ -333,4 +9310,4 @@ int main(int argc, char **argv) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Coprocesses, >&NAME / <&NAME and read
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# One helper serves several requests
+run_test "coproc UP tr a-z A-Z\necho hello >&UP\necho world >&UP\ncoproc -c UP\nread A <&UP\nread B <&UP\necho \$A \$B" "HELLO WORLD"
+run_test "coproc D sh -c 'while read x; do echo \$((x * 2)); done'\necho 21 >&D\nread R <&D\necho 7 >&D\nread S <&D\necho \$R \$S" "42 14"
+run_test "coproc C cat\necho \$C_PID" "[0-9]"
+
+# Unknown names and plain descriptors
+run_test "echo x >&NOPE" "NOPE: Bad file descriptor"
+run_test "echo moved >&2" "moved"
+run_test "coproc 1X cat" "usage: coproc"
+
+# read splits words, the last name taking the rest
+run_test "read X Y REST <<< 'a  b c d'\necho \"[\$X][\$Y][\$REST]\"" "\[a\]\[b\]\[c d\]"
+run_test "read X < /dev/null\necho status \$?" "status 1"
+
+rm -f output.txt script.txt
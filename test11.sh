@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Record streams between builtins in a pipeline
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    (cd records_dir && ../mysh ../script.txt > ../output.txt 2>&1)
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+rm -rf records_dir && mkdir records_dir
+touch records_dir/a.c records_dir/b.c records_dir/main.c records_dir/x.h
+
+# Builtins pass records to each other
+run_test "glob '*.c' | filter 'm*'" "main.c"
+run_test "glob '*.c' | filter -v 'm*' | filter 'b*'" "b.c"
+run_test "glob '*.c' | filter 'zz*'\necho status \$?" "status 1"
+run_test "echo \$(glob '*.h' | filter 'x*')" "x.h"
+
+# At an external command the records become lines, or NUL-terminated
+run_test "glob '*.c' | filter -v 'm*' | wc -l" "2"
+run_test "ls | filter '*.h'" "x.h"
+run_test "glob -0 '*.c' | xargs -0 echo" "a.c b.c main.c"
+run_test "glob '*.c' | filter 'a*' > list.txt\ncat list.txt" "a.c"
+
+# parallel runs a command per record
+run_test "glob '*.c' | parallel -j 2 echo file | sort | head -1" "file a.c"
+run_test "glob '*.c' | parallel sh -c 'exit 1'\necho status \$?" "status 1"
+
+rm -rf records_dir output.txt script.txt
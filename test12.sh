@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# walk: the built-in directory walker
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    (cd walk_dir && ../mysh ../script.txt > ../output.txt 2>&1)
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+rm -rf walk_dir && mkdir -p walk_dir/logs/old walk_dir/src
+touch walk_dir/logs/a.log walk_dir/logs/old/b.log walk_dir/src/main.c
+touch -d '2000-01-01' walk_dir/logs/old/b.log
+ln -s src walk_dir/link
+
+# Paths are listed like find's, the starting point included
+run_test "walk | sort | head -1" "^\.$"
+run_test "walk | wc -l" "8"
+run_test "walk logs -name '*.log' | sort | head -1" "logs/a.log"
+
+# Filters on type, age and depth
+run_test "walk -type d | sort | tail -1" "./src"
+run_test "walk -type l" "./link"
+run_test "walk -type f -mtime +30" "./logs/old/b.log"
+run_test "walk -type f -mtime -30 -name '*.log'" "./logs/a.log"
+run_test "walk -maxdepth 1 -type d | wc -l" "3"
+
+# Symlinks to directories are not followed
+run_test "walk link -type f | wc -l" "0"
+run_test "walk link" "^link$"
+
+# Records flow into the next stage, or as lines into an external one
+run_test "walk -name '*.log' | filter '*old*'" "./logs/old/b.log"
+run_test "walk -0 -name '*.c' | xargs -0 echo found" "found ./src/main.c"
+run_test "walk nonexistent\necho status \$?" "status 1"
+
+rm -rf walk_dir output.txt script.txt
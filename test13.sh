@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# for/while/until loops, ';' lists, break and continue
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Lists and loops on one line or several
+run_test "echo one; echo two" "two"
+run_test "for x in a b c; do echo item \$x; done" "item c"
+run_test "for x in a b\ndo\n  echo got \$x\ndone" "got b"
+run_test "i=0\nwhile test \$i != 3; do i=\$(expr \$i + 1); done\necho i=\$i" "i=3"
+run_test "i=2\nuntil test \$i = 0; do i=\$(expr \$i - 1); done\necho i=\$i" "i=0"
+run_test "for x in 1 2; do for y in a b; do echo \$x\$y; done; done | tr '\\\\n' ' '" "1a 1b 2a 2b"
+
+# A loop can be redirected or be a stage of a pipeline
+run_test "for x in a b; do echo \$x; done > loop.txt\ncat loop.txt" "^b$"
+run_test "seq 2 | while read line; do echo got \$line; done" "got 2"
+run_test "for x in 1 2; do n=\$x; done > /dev/null\necho n=\$n" "n=2"
+run_test "for x in 1; do echo x; done foo" "Syntax error near unexpected token \`foo'"
+
+# The items are expanded once, the body each time round
+run_test "for f in *.sh; do echo \$f; done | grep -c test13" "1"
+run_test "for x in 1 2 3; do last=\$x; done\necho \$last" "^3$"
+
+# break and continue, also out of nested loops
+run_test "for x in 1 2 3; do echo \$x; break; done" "^1$"
+run_test "for x in 1 2 3; do continue; echo no; done\necho done" "^done$"
+run_test "for x in 1 2; do for y in a b; do continue 2; echo no; done; done\necho ok" "^ok$"
+run_test "for x in 1 2; do while true; do break 2; done; echo no; done\necho out" "^out$"
+run_test "break" "only meaningful"
+
+# Syntax errors
+run_test "for x in a b; echo no; done" "Syntax error near unexpected token"
+run_test "for x in a; do echo x" "unexpected end of file"
+run_test "done" "Syntax error near unexpected token \`done'"
+
+# Loops inside command substitution
+run_test "echo \$(for z in p q; do echo \$z; done)" "p q"
+
+rm -f output.txt script.txt loop.txt
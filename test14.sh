@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Shell functions: definitions, positional parameters, return and shift
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Definitions and calls, in the shell
+run_test "greet() { echo hello \$1; }\ngreet world" "hello world"
+run_test "greet()\n{\n  echo hi \$#: \$@\n}\ngreet a b c" "hi 3: a b c"
+run_test "function f { x=set; }\nf\necho x=\$x" "x=set"
+run_test "f() { echo redefined? no; }\nf() { echo yes; }\nf" "^yes$"
+run_test "greet(){ echo glued \$1; }\ngreet brace" "^glued brace$"
+run_test "greet (){ echo spaced; }\ngreet" "^spaced$"
+run_test "f() { echo old; f() { echo new; }; }\nf\nf" "^new$"
+
+# Positional parameters, shift and for without in
+run_test "f() { for a; do echo arg:\$a; done; }\nf 1 \"2 3\"" "arg:2 3"
+run_test "f() { shift; echo \$1 \$#; }\nf a b c" "^b 2$"
+run_test "f() { g \"\$@\"; echo \$1; }\ng() { echo g\$#; }\nf x 'y z'" "g2"
+
+# return, also from inside a loop
+run_test "f() { return 3; echo no; }\nf\necho status \$?" "status 3"
+run_test "f() { for i in 1 2 3; do test \$i = 2; then return 4; done; }\nf\necho status \$?" "status 4"
+run_test "return" "can only"
+
+# Functions as pipeline stages, redirected, and recursing
+run_test "f() { echo piped; }\nf | tr a-z A-Z" "PIPED"
+run_test "f() { echo saved; }\nf > fn.txt\ncat fn.txt" "^saved$"
+run_test "f() { test \$1 = 0; then return; echo d\$1; f \$(expr \$1 - 1); }\nf 2" "d1"
+run_test "f() { f; }\nf" "maximum function nesting level"
+
+rm -f output.txt script.txt fn.txt
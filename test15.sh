@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# test, [, true, false and $(( )) arithmetic, all without forking
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# test and [
+run_test "[ -f mysh.c ]\necho \$?" "^0$"
+run_test "test -d mysh.c\necho \$?" "^1$"
+run_test "[ ! -e nofile ]\nthen echo missing" "missing"
+run_test "[ abc = abc -a 3 -lt 10 ]\necho \$?" "^0$"
+run_test "[ \\\\( 1 -eq 2 \\\\) -o -n x ]\necho \$?" "^0$"
+run_test "[ x -eq 3 ]\necho \$?" "integer expression expected"
+run_test "[ 1 = 1\necho \$?" "missing"
+run_test "true\nthen echo yes\nfalse\nelse echo no" "^no$"
+
+# Arithmetic
+run_test "echo \$((1 + 2 * 3)) \$(( (1 + 2) * 3 )) \$((2 ** 10)) \$((7 % 3))" "7 9 1024 1"
+run_test "i=5\necho \$((i++)) \$i \$((++i)) \$((i += 10))" "5 6 7 17"
+run_test "x=4\necho \$((\$x > 3 ? x * 2 : 0))" "^8$"
+run_test "n=0\nfor k in 1 2 3 4; do n=\$((n + k)); done\necho sum \$n" "sum 10"
+run_test "echo \$((1 / 0))\necho after" "division by 0"
+run_test "echo \$((1 +))" "operand expected"
+run_test "echo \$(( \$(echo 6) * 7 ))" "^42$"
+
+rm -f output.txt script.txt
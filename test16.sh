@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# echo, printf and cat as builtins writing through the shell's output buffer
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# echo
+run_test "echo -n one; echo two" "^onetwo$"
+run_test "echo -e 'a\\\\tb' | cat -A" "^a^Ib\\\$$"
+run_test "echo -e 'x\\\\cy'; echo END" "^xEND$"
+run_test "echo -- -n -x" "^-- -n -x$"
+
+# printf
+run_test "printf '%s-%d\\\\n' a 1 b 2" "^b-2$"
+run_test "printf '[%5.2f|%-3s|%04x]\\\\n' 3.14159 ab 255" "^\[ 3.14|ab |00ff\]$"
+run_test "printf '%d\\\\n' \"'A\"" "^65$"
+run_test "printf '%d\\\\n' abc\necho status \$?" "status 1"
+run_test "printf" "missing operand"
+
+# cat
+run_test "printf 'a\\\\n\\\\n\\\\n\\\\nb\\\\n' | cat -s -n" "^     3	b$"
+run_test "printf 'one\\\\n' > cat1.txt\ncat cat1.txt - cat1.txt < cat1.txt | wc -l" "^3$"
+run_test "cat nofile\necho status \$?" "nofile: No such file or directory"
+run_test "cat -z" "invalid option -- 'z'"
+
+# Output order: builtin output goes out before a child's
+run_test "echo first; ls mysh.c; echo last" "^last$"
+run_test "echo \$(echo in; printf sub)" "^in sub$"
+
+rm -f output.txt script.txt cat1.txt
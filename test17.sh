@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# One ordered output queue for the shell's stdout and stderr
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Messages come out where they were written relative to output
+run_test "echo -n a; cd /nonexist; echo b" "^acd: No such file or directory$"
+run_test "printf 'n=%d' z; echo ' end'" "^n=printf: 'z': expected a numeric value$"
+run_test "for i in 1 2; do echo -n \$i; which; done" "^2which: missing argument$"
+
+# Output is written before a child's and around redirections
+run_test "echo -n x; ls -d mysh.c" "^xmysh.c$"
+run_test "echo -n a; echo b > order.txt; echo -n c; cat order.txt" "^acb$"
+run_test "echo -n s; echo \$(echo sub)" "^ssub$"
+
+rm -f output.txt script.txt order.txt
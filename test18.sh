@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Adjacent builtins fused into one chain of record iterators
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Byte builtins at the head of a run, and after one
+run_test "echo -e 'a.c\\\\nb.h\\\\nc.c' | filter '*.c' | filter -v 'a*'" "^c.c$"
+run_test "printf 'x1\\\\ny\\\\nx2' | filter 'x*' | cat -n" "^     2	x2$"
+
+# Plain patterns and wildcards match alike
+run_test "printf 'abc\\\\nxabcx\\\\nab\\\\n' | filter 'abc' | wc -l" "^1$"
+run_test "printf 'abc\\\\nxabcx\\\\nab\\\\n' | filter '*bc*' | filter '*x'" "^xabcx$"
+run_test "printf 'abc\\\\nxabcx\\\\nab\\\\n' | filter 'a?'" "^ab$"
+
+# Records flow from a stream, through redirections and into \$(...)
+run_test "seq 20 | filter '1*' | filter -v '*[02-9]'" "^11$"
+run_test "seq 3 > fuse.txt\nglob '*.c' | filter '*' < fuse.txt | filter 2" "^2$"
+run_test "echo \$(glob 'test1*.sh' | filter '*8*')" "^test18.sh$"
+run_test "seq 3 | filter '*' | parallel echo n" "^n 3$"
+run_test "glob 'nomatch*' | filter x\necho status \$?" "status 1"
+
+rm -f output.txt script.txt fuse.txt
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+# MYSH_PIPELINE=threads: in-process stages on threads linked by rings
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "MYSH_PIPELINE=threads\n$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# The same records as in one thread, through rings that fill up many times
+run_test "seq 100000 | filter '*1*' | filter -v '*2*' | filter '*3*' | wc -l" "^10320$"
+run_test "seq 100000 | filter '*7' | filter '9*' | filter -v '*0*' | filter '*5*'" "^95877$"
+run_test "echo -e 'a.c\\\\nb.h' | filter '*.c' | filter 'a*'" "^a.c$"
+run_test "glob 'test1*.sh' | filter '*9*' | parallel echo got" "^got test19.sh$"
+run_test "echo \$(glob '*.c' | filter 'm*' | filter '*c')" "^mysh.c$"
+
+# A stage that stops early does not leave the ones before it hanging
+run_test "seq 100000 | filter '*' | filter\necho status \$?" "status 2"
+run_test "walk . -name '*.sh' | filter 'test1?.sh' | filter -v '*'\necho status \$?" "status 1"
+
+rm -f output.txt script.txt
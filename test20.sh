@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# memo: cached stdout and exit status of deterministic commands
+
+run_test() {
+    command=$1
+    expected_part=$2
+    rm -f memo.runs memo.store
+    echo -e "$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+step="sh -c 'echo run >> memo.runs; echo out; exit 3'"
+
+# A repeat is replayed with its status, without running again
+run_test "memo $step\nmemo $step\necho \$? \$(wc -l < memo.runs)" "^3 1$"
+run_test "memo $step\nmemo $step" "^out$"
+run_test "a=\$(memo $step)\nb=\$(memo $step)\necho \$a \$b \$(wc -l < memo.runs)" "^out out 1$"
+run_test "memo echo hit | filter 'h*'\nmemo echo hit | filter 'h*'" "^hit$"
+
+# Other arguments, variables and input files make other keys
+run_test "memo $step\nmemo $step x\nwc -l < memo.runs" "^2$"
+run_test "memo -e V sh -c 'echo \$V'\nexport V=1\nmemo -e V sh -c 'echo \$V'\nmemo -e V sh -c 'echo \$V'" "^1$"
+run_test "echo a > memo.in\nmemo -f memo.in cat memo.in\necho bb > memo.in\nmemo -f memo.in cat memo.in\nrm memo.in" "^bb$"
+run_test "memo -f memo.in $step\nmemo -f memo.in $step\nwc -l < memo.runs" "^1$"
+
+# A store in MYSH_MEMO is shared with later shells
+run_test "MYSH_MEMO=memo.store\nmemo $step\nmemo $step\necho \$(wc -l < memo.runs)" "^1$"
+echo -e "MYSH_MEMO=memo.store\nmemo $step" > script.txt
+rm -f memo.runs memo.store
+./mysh script.txt > /dev/null
+./mysh script.txt > output.txt
+if [ "$(cat output.txt)" = "out" ] && [ "$(wc -l < memo.runs)" = "1" ]; then
+    echo "PASS: memo store across shells"
+else
+    echo "FAIL: memo store across shells. Got '$(cat output.txt)'"
+fi
+
+# A record another shell has only partly written is indexed once complete
+echo -e "MYSH_MEMO=memo.store\nmemo $step" > script.txt
+rm -f memo.runs memo.store
+./mysh script.txt > /dev/null
+head -c 20 memo.store > memo.part
+tail -c +21 memo.store > memo.rest
+mv memo.part memo.store
+echo -e "MYSH_MEMO=memo.store\nmemo sh -c 'kill -9 \$\$'\ncat memo.rest >> memo.store\nmemo $step" > script.txt
+./mysh script.txt > output.txt
+if [ "$(cat output.txt)" = "out" ] && [ "$(wc -l < memo.runs)" = "1" ]; then
+    echo "PASS: memo record completed after a lookup"
+else
+    echo "FAIL: memo record completed after a lookup. Got '$(cat output.txt)'"
+fi
+
+run_test "memo -e\necho status \$?" "status 2"
+
+rm -f output.txt script.txt memo.runs memo.store memo.in memo.rest
@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# MYSH_INCREMENTAL: steps whose command and inputs are unchanged are skipped
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "MYSH_INCREMENTAL=inc.index\n$command" > script.txt
+    ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+rm -f inc.index inc.in inc.a inc.b inc.c
+seq 5 > inc.in
+steps="sh -c 'echo one >&2; sort -r' < inc.in > inc.a\nsh -c 'echo two >&2; head -2' < inc.a | sort > inc.b\nsh -c 'echo three >&2; cat' < inc.b > inc.c\ncat inc.c"
+
+# Checks that the last run did not print $1
+run_test_not() {
+    if grep -q -- "$1" output.txt; then
+        echo "FAIL: $2. Found '$1' in '$(cat output.txt)'"
+    else
+        echo "PASS: $2"
+    fi
+}
+
+# The first run does every step, a rerun none
+run_test "$steps" "three"
+run_test "$steps" "^5$"
+run_test_not "o" "rerun does nothing"
+
+# A touched input with the same contents is not a change
+touch inc.in
+run_test "$steps" "^5$"
+run_test_not "one" "touched input"
+
+# A changed input reruns what depends on it, but only as far as the
+# contents it leads to change
+printf '5\n4\n9\n' > inc.in
+run_test "$steps" "three"
+printf '5\n1\n9\n' > inc.in
+run_test "$steps" "two"
+run_test_not "three" "early cutoff"
+
+# A missing output, another command, or a failure reruns the step
+rm inc.c
+run_test "$steps" "three"
+run_test "sh -c 'echo four >&2; sort' < inc.in > inc.a" "four"
+run_test "sh -c 'echo five >&2; exit 1' < inc.in > inc.a\nsh -c 'echo five >&2; exit 1' < inc.in > inc.a" "five.*"
+if [ "$(grep -c five output.txt)" = "2" ]; then echo "PASS: failed step reruns"; else echo "FAIL: failed step reruns"; fi
+
+# Appends are never skipped
+run_test "echo x >> inc.a\necho x >> inc.a\ngrep -c x inc.a" "^2$"
+
+# A step done after another shell compacted the index is recorded in the
+# new one: the other shell finds 1100 superseded records to drop
+rm -f inc.index
+printf 'for i in $(seq 1100); do printf "MINC\\2\\0\\0\\0\\1\\0\\0\\0\\0\\0\\0\\0aaaaaaaabbbbbbbb"; done >> inc.index\n' > inc.junk
+echo -e "MYSH_INCREMENTAL=inc.index\ncat < inc.in > inc.x" > inc.compact
+run_test "cat < inc.in > inc.a\nbash inc.junk\n./mysh inc.compact\nsh -c 'echo six >&2; cat' < inc.a > inc.b" "six"
+if [ "$(stat -c %s inc.index)" -lt 1024 ]; then echo "PASS: index compacted"; else echo "FAIL: index compacted"; fi
+run_test "sh -c 'echo six >&2; cat' < inc.a > inc.b\necho done" "done"
+run_test_not "six" "step recorded after another shell's compaction"
+
+rm -f output.txt script.txt inc.index inc.in inc.a inc.b inc.c inc.x inc.junk inc.compact
@@ -0,0 +1,100 @@
+#!/bin/bash
+
+# mysh --server / --client: scripts run by a pre-forked worker of a server
+
+sock=$PWD/test-server.sock
+./mysh --server "$sock" &
+server=$!
+for i in $(seq 50); do
+    [ -S "$sock" ] && break
+    sleep 0.1
+done
+
+run_test() {
+    command=$1
+    expected_part=$2
+    shift 2
+    echo -e "$command" > script.txt
+    ./mysh --client "$sock" script.txt "$@" > output.txt 2>&1
+    echo "status $?" >> output.txt
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# The worker has the client's arguments, descriptors and exit status
+run_test "echo \$0 \$# \$1" "^script.txt 2 one$" one two
+run_test "echo to stderr >&2" "^to stderr$"
+run_test "exit 7" "^status 7$"
+run_test "ls /nonexistent-dir" "No such file"
+
+# ... and its directory and environment
+export TEST_SERVER_VAR=from-client
+run_test "echo \$TEST_SERVER_VAR" "^from-client$"
+run_test "pwd" "^$PWD$"
+echo piped > input.txt
+run_test "cat" "^piped$" < input.txt
+
+# Many clients in a row each get a worker of their own
+echo 'echo -n "x "' > script2.txt
+run_test "for i in 1 2 3; do ./mysh --client $sock script2.txt; done" "^x x x "
+
+# A signal to the client reaches the script's commands, and the client
+# dies of it as they did
+echo -e "sleep 30\necho not reached" > script.txt
+start=$SECONDS
+./mysh --client "$sock" script.txt > output.txt 2>&1 &
+client=$!
+sleep 0.5
+kill -TERM $client
+wait $client
+status=$?
+if [ $status = 143 ] && [ $((SECONDS - start)) -lt 10 ] && ! grep -q reached output.txt; then
+    echo "PASS: signal forwarded"
+else
+    echo "FAIL: signal forwarded. Got status $status, '$(cat output.txt)'"
+fi
+
+# The socket is the server's user's alone, and a worker will not run a
+# script for another user who gets through anyway: that client runs it
+# itself, as that user
+if [ "$(stat -c %a "$sock")" = 700 ]; then echo "PASS: socket mode"; else echo "FAIL: socket mode"; fi
+if [ "$(id -u)" = 0 ] && command -v setpriv > /dev/null; then
+    other=$(mktemp -d)
+    cp mysh "$other"
+    echo "id -u" > "$other/script.txt"
+    chmod -R a+rX "$other"
+    ./mysh --server "$other/sock" &
+    other_server=$!
+    for i in $(seq 50); do
+        [ -S "$other/sock" ] && break
+        sleep 0.1
+    done
+    chmod 666 "$other/sock"
+    (cd "$other" && setpriv --reuid=65534 --regid=65534 --clear-groups \
+        ./mysh --client "$other/sock" script.txt) > output.txt 2>&1
+    if grep -q "^65534$" output.txt; then
+        echo "PASS: other user refused"
+    else
+        echo "FAIL: other user refused. Got '$(cat output.txt)'"
+    fi
+    kill $other_server
+    wait $other_server 2>/dev/null
+    rm -rf "$other"
+fi
+
+# A second server on the same socket is refused
+./mysh --server "$sock" > output.txt 2>&1
+if grep -q "already listening" output.txt; then echo "PASS: second server"; else echo "FAIL: second server"; fi
+
+kill $server
+wait $server 2>/dev/null
+
+# Without a server the client runs the script itself
+run_test "echo alone" "^alone$"
+
+rm -f output.txt script.txt script2.txt input.txt "$sock"
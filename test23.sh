@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# MYSH_SANDBOX: seccomp filter, read-only mounts and PID namespaces for the
+# commands the shell execs
+
+# Runs the command in a shell started with the settings ("VAR=value ...")
+run_test() {
+    settings=$1
+    command=$2
+    expected_part=$3
+    echo -e "$command" > script.txt
+    env $settings ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: [$settings] $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: [$settings] $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+rm -rf sandbox.dir sandbox.link
+mkdir sandbox.dir
+ln -s sandbox.dir sandbox.link
+
+# Settings the shell cannot honour refuse to run the command
+run_test "MYSH_SANDBOX=bogus" "/bin/true\necho status \$?" "unknown MYSH_SANDBOX setting 'bogus'"
+run_test "MYSH_SANDBOX=bogus" "/bin/true\necho status \$?" "^status 126$"
+run_test "MYSH_SANDBOX=0" "sh -c 'echo \$\$' | grep -c '^[12]\$'" "^0$"
+
+# The settings are the shell's from the start: a script cannot change them
+run_test "MYSH_SANDBOX=seccomp" "MYSH_SANDBOX=0\necho status \$?" "^status 1$"
+run_test "MYSH_SANDBOX=seccomp" "MYSH_SANDBOX=0" "MYSH_SANDBOX: readonly variable"
+run_test "MYSH_SANDBOX=seccomp" "unset MYSH_SANDBOX\necho status \$? \$MYSH_SANDBOX" "^status 1 seccomp$"
+run_test "MYSH_SANDBOX=ro" "export MYSH_SANDBOX_WRITABLE=/\necho status \$?" "^status 1$"
+run_test "" "MYSH_SANDBOX=ro\necho status \$?" "^status 1$"
+
+# Without namespaces to make (root, or unprivileged user namespaces) there
+# is nothing more to check
+if ! unshare -m -p -f true 2> /dev/null && ! unshare -U -m -p -f true 2> /dev/null; then
+    rm -rf script.txt output.txt sandbox.dir
+    exit 0
+fi
+
+# seccomp: mount and namespace calls are refused, the rest works
+run_test "MYSH_SANDBOX=seccomp" "unshare -m true\necho status \$?" "Operation not permitted"
+run_test "MYSH_SANDBOX=seccomp" "ls / | grep -c '^etc\$'" "^1$"
+
+# ro: nothing is writable but MYSH_SANDBOX_WRITABLE, and the shell's
+# redirections are held to the same
+run_test "MYSH_SANDBOX=ro" "touch sandbox.dir/a\necho status \$?" "^status 1$"
+run_test "MYSH_SANDBOX=ro MYSH_SANDBOX_WRITABLE=/nonexistent:$PWD/sandbox.dir" "touch sandbox.dir/a\necho status \$?" "^status 126$"
+run_test "MYSH_SANDBOX=ro MYSH_SANDBOX_WRITABLE=$PWD/sandbox.dir" "touch sandbox.dir/b\nls sandbox.dir" "^b$"
+run_test "MYSH_SANDBOX=ro" "echo hello | cat > sandbox.dir/c\necho status \$?" "^status 1$"
+run_test "MYSH_SANDBOX=ro" "echo hello > sandbox.dir/c" "sandbox.dir/c: Read-only file system"
+run_test "MYSH_SANDBOX=ro" "echo hello >> sandbox.link/c" "sandbox.link/c: Read-only file system"
+if [ -e sandbox.dir/c ]; then
+    echo "FAIL: ro redirection was opened"
+else
+    echo "PASS: ro redirection is not opened"
+fi
+run_test "MYSH_SANDBOX=ro MYSH_SANDBOX_WRITABLE=$PWD/sandbox.dir" "echo hello | cat > sandbox.dir/c\ncd sandbox.dir\necho more >> c\ncat c" "^more$"
+run_test "MYSH_SANDBOX=ro" "echo hello > /dev/null\necho status \$?" "^status 0$"
+
+# pid: the command runs under a small init of its own namespace, which
+# passes signals on to it
+run_test "MYSH_SANDBOX=pid" "sh -c 'echo pid \$\$'" "^pid 2$"
+run_test "MYSH_SANDBOX=pid" "ls /proc | grep -c '^[0-9]'" "^2$"
+run_test "MYSH_SANDBOX=pid" "timeout 0.2 sleep 5\necho status \$?" "^status 124$"
+run_test "MYSH_SANDBOX=pid" "timeout 0.2 sh -c 'trap \"echo got TERM; exit 5\" TERM; sleep 5 & wait'" "^got TERM$"
+run_test "MYSH_SANDBOX=pid" "sh -c 'exit 3'\necho status \$?" "^status 3$"
+run_test "MYSH_SANDBOX=pid" "yes | head -1" "^y$"
+
+# Everything at once, through a pipeline, a command substitution and parallel
+run_test "MYSH_SANDBOX=1" "x=\$(sh -c 'echo \$\$; unshare -m true 2>&1')\necho \$x" "^2 unshare: .*not permitted"
+run_test "MYSH_SANDBOX=1" "echo a b | tr a-z A-Z" "^A B$"
+run_test "MYSH_SANDBOX=1" "printf 'x\\\\ny\\\\n' | parallel sh -c 'echo \$\$'" "^2$"
+
+rm -rf script.txt output.txt sandbox.dir sandbox.link
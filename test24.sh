@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# The interactive line editor, driven through a pty
+
+# Types each chunk into an interactive mysh, pausing after each so that a
+# completion or redraw is done before the next keys arrive, then ^D
+run_test() {
+    expected_part=$1
+    shift
+    {
+        sleep 0.3
+        for chunk in "$@"; do
+            printf "$chunk"
+            sleep 0.3
+        done
+        printf '\004'
+        sleep 0.3
+    } | TERM=xterm HISTFILE=$PWD/edit.hist script -qfc ./mysh /dev/null > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $*"
+    else
+        actual_output=$(cat -v output.txt)
+        echo "FAIL: $*. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Checks that the last run did not print $1
+run_test_not() {
+    if grep -q -- "$1" output.txt; then
+        echo "FAIL: $2. Found '$1' in '$(cat -v output.txt)'"
+    else
+        echo "PASS: $2"
+    fi
+}
+
+if ! command -v script > /dev/null; then
+    exit 0
+fi
+rm -rf edit.hist edit.d
+mkdir edit.d
+echo completed > edit.d/unique_name.txt
+
+# Cursor movement and insertion in the middle of the line
+run_test "^WORLD" 'echo wrld | tr a-z A-Z\001\006\006\006\006\006\006o\r'
+run_test "^WORLD" 'echo wrld | tr a-z A-Z\033[H\033[C\033[C\033[C\033[C\033[C\033[Co\r'
+
+# Kill keys: ^U the whole line, ^W a word, ^K to the end
+run_test "^GOOD" 'echo bad | tr a-z A-Z\025echo good | tr a-z A-Z\r'
+run_test_not "BAD" "^U drops the line"
+run_test "^ONE THREE" 'echo one two\027three | tr a-z A-Z\r'
+run_test "^KEPT" 'echo kept | tr a-z A-Z | sed s/^/X/\002\002\002\002\002\002\002\002\002\002\002\002\002\013\r'
+run_test_not "XKEPT" "^K cuts to the end"
+
+# ^C abandons the line, ^D on an empty line leaves the shell
+run_test "^YES" 'echo nope | tr a-z A-Z\003' 'echo yes | tr a-z A-Z\r'
+run_test_not "NOPE" "^C abandons the line"
+run_test "Exiting my shell" ''
+
+# History: up-arrow recalls the last line, ^R searches all of it
+run_test "^FIRST" 'echo first | tr a-z A-Z\r' '\033[A\r'
+if [ "$(grep -c '^FIRST' output.txt)" = 2 ]; then
+    echo "PASS: up-arrow runs the line again"
+else
+    echo "FAIL: up-arrow runs the line again. Got '$(cat -v output.txt)'"
+fi
+run_test "^SEARCHME" 'echo searchme | tr a-z A-Z\r' 'echo other\r' '\022searchm' '\r'
+
+# Tab completes a file name from the directory listing
+run_test "^completed" 'cat edit.d/uniq\t' '\r'
+
+rm -rf output.txt edit.hist edit.d
@@ -0,0 +1,77 @@
+#!/bin/bash
+
+# The directory cache: PATH and cwd listings read by the worker pool and
+# used for completion, command lookup and wildcards at the prompt
+
+# Types each chunk into an interactive mysh, pausing after each so that the
+# pool has read what the next keys need, then ^D
+run_test() {
+    expected_part=$1
+    shift
+    {
+        sleep 0.3
+        for chunk in "$@"; do
+            printf "$chunk"
+            sleep 0.3
+        done
+        printf '\004'
+        sleep 0.3
+    } | TERM=xterm PATH="$PWD/cache.bin:$PWD/cache.empty:$PATH" script -qfc ./mysh /dev/null \
+        > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $*"
+    else
+        actual_output=$(cat -v output.txt)
+        echo "FAIL: $*. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+if ! command -v script > /dev/null; then
+    exit 0
+fi
+rm -rf cache.bin cache.empty cache.d
+mkdir cache.bin cache.empty cache.d
+printf '#!/bin/sh\necho probed\n' > cache.bin/mysh_probe_cmd
+chmod +x cache.bin/mysh_probe_cmd
+touch cache.d/zeta cache.d/alpha cache.d/mid
+
+# Commands complete from the PATH listings, an empty PATH directory
+# included
+run_test "^probed" 'mysh_probe_c\t' '\r'
+
+# Candidates are listed in name order
+run_test "alpha  mid    zeta" 'ls cache.d/\t' '\t' '\025'
+
+# A command added while the shell runs is found and completed
+printf '#!/bin/sh\necho late\n' > late_cmd
+chmod +x late_cmd
+run_test "^late" 'cp late_cmd cache.bin/\r' 'late_c\t' '\r'
+rm -f late_cmd cache.bin/late_cmd
+
+# A PATH directory that changes at the prompt and is read again for a
+# completion still leaves its commands runnable
+{
+    sleep 0.3
+    printf "ls $PWD/cache.bin/"
+    touch cache.bin/changed
+    sleep 2.5               # past DIRCACHE_REVALIDATE, so ^I reads it again
+    printf 'ch\t'
+    sleep 0.3
+    printf '\025mysh_probe_c\t'
+    sleep 0.3
+    printf '\r\004'
+    sleep 0.3
+} | TERM=xterm PATH="$PWD/cache.bin:$PWD/cache.empty:$PATH" script -qfc ./mysh /dev/null \
+    > output.txt 2>&1
+if grep -q "^probed" output.txt && ! grep -q "ERROR" output.txt; then
+    echo "PASS: changed PATH directory read for a completion"
+else
+    echo "FAIL: changed PATH directory read for a completion. Got '$(cat -v output.txt)'"
+fi
+rm -f cache.bin/changed
+
+# Wildcards in the cwd follow files created and removed at the prompt
+run_test "^B_FILE" 'cd cache.d\r' 'touch a_file b_file\r' 'rm a_file\r' 'echo *_file | tr a-z A-Z\r'
+
+rm -rf output.txt cache.bin cache.empty cache.d
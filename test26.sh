@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Redirection opens, PATH lookups and closes batched on io_uring, and the
+# plain syscalls MYSH_IO_URING=0 falls back to: both must behave the same
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" > script.txt
+    MYSH_IO_URING=$mode ./mysh script.txt > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: [$mode] $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: [$mode] $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+printf 'one\ntwo\nthree\n' > ring.in
+for mode in 0 1; do
+    rm -f ring.out ring.created
+
+    # The ring is only set up when enabled
+    if [ $mode = 0 ]; then
+        run_test "ls -l /proc/\$\$/fd | grep -c io_uring" "^0$"
+    elif [ "$(cat /proc/sys/kernel/io_uring_disabled 2> /dev/null)" = 0 ]; then
+        run_test "ls -l /proc/\$\$/fd | grep -c io_uring" "^1$"
+    fi
+
+    # A pipeline's redirections, opened as one chain
+    run_test "cat < ring.in > ring.out\ncat ring.out" "^three$"
+    run_test "cat < ring.in | tr a-z A-Z | wc -l > ring.out\ncat ring.out" "^3$"
+    run_test "echo more >> ring.out\nwc -l < ring.out" "^2$"
+
+    # The chain stops at the first failure, as opening in order would
+    run_test "cat < ring.missing > ring.created\necho status \$?" "^status 1$"
+    run_test "cat < ring.missing > ring.created" "ring.missing: No such file"
+    if [ -e ring.created ]; then
+        echo "FAIL: [$mode] a redirection after a failed one was opened"
+    else
+        echo "PASS: [$mode] a redirection after a failed one is not opened"
+    fi
+
+    # Uncached PATH lookups
+    run_test "uname -s | tr A-Z a-z" "^linux$"
+    run_test "no_such_command_here\necho status \$?" "^status 127$"
+done
+
+rm -f script.txt output.txt ring.in ring.out ring.created
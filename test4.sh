@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Variables, export and $ expansion
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" | ./mysh > output.txt
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Assignment and expansion
+run_test "X=hello\necho \$X \${X}world" "hello helloworld"
+run_test "X=hello\necho '\$X' \"\$X there\"" "\$X hello there"
+
+# export puts the variable in the environment of children
+run_test "export Y=exported\nprintenv Y" "exported"
+
+# Prefix assignments only reach that one command
+run_test "Z=once printenv Z\nprintenv Z\necho status \$?" "status 1"
+run_test "Z=once printenv Z" "once"
+
+# \$? reflects builtins as well as external commands
+run_test "cd /nonexistent\necho \$?" "1"
+run_test "false\necho \$?" "1"
+
+# Quoted words are not split or globbed
+run_test "V='a   b'\necho \"\$V\" \"*.sh\"" "a   b \*.sh"
+
+# Command substitution, in-process for builtins and forked otherwise
+run_test "echo dir=\$(pwd)" "dir=$(pwd)"
+run_test "echo \"[\$(printf 'a\\\\nb\\\\n\\\\n')]\"" "b]"
+run_test "echo \`echo back\` \$(echo \$(echo nested))" "back nested"
+run_test "echo \$(false) \$?" "1"
+
+# Clean up
+rm output.txt
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Redirection, here-documents and here-strings
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" | ./mysh > output.txt
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Output redirection only applies to its own command
+run_test "echo first > redirected.txt\necho second\ncat redirected.txt" "first"
+run_test "echo first > redirected.txt\necho second" "second"
+run_test "echo one > redirected.txt\necho two >> redirected.txt\nwc -l < redirected.txt" "2"
+
+# Longer pipelines
+run_test "echo a | tr a b | tr b c | tr c d" "d"
+
+# Here-documents expand unless the delimiter is quoted
+run_test "X=world\ncat <<EOF\nhello \$X\nEOF" "hello world"
+run_test "X=world\ncat <<'EOF'\nraw \$X\nEOF" "raw \$X"
+run_test "cat <<-EOF\n\tindented\n\tEOF" "^indented"
+# An unclosed substitution in a body is kept as text
+run_test "cat <<EOF\nhello \$(echo\nEOF\necho after" "hello \$(echo"
+run_test "cat <<EOF\nhello \`echo\nEOF\necho after" "after"
+
+# Here-strings, and a body too large for the pipe buffer
+run_test "wc -w <<< 'three little words'" "3"
+run_test "X=\$(seq 1 30000)\nwc -l <<< \"\$X\"" "30000"
+
+# Clean up
+rm -f output.txt redirected.txt
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Persistent history and history search
+export HISTFILE=$(pwd)/history_test.txt
+rm -f "$HISTFILE"
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" | ./mysh > output.txt
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Entries survive across shells
+echo -e "history -s git status\nhistory -s make pgo" | ./mysh
+run_test "history" "make pgo"
+
+# Search finds every distinct matching entry once
+echo -e "history -s git status\nhistory -s git log" | ./mysh
+run_test "history -g git" "git log"
+run_test "history -g git > found.txt\nwc -l < found.txt" "2"
+run_test "history -g nothing-like-this\necho status \$?" "status 1"
+
+# history N shows the last N entries
+run_test "history 1" "git log"
+run_test "history 0 | wc -l" "^0$"
+run_test "history -1\necho status \$?" "status 1"
+
+# Clean up
+rm -f output.txt found.txt "$HISTFILE"
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Background jobs and wait
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" | ./mysh > output.txt
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# The shell carries on while a job runs, and wait collects it
+run_test "sleep 1 > /dev/null &\necho first\nwait\necho second" "first"
+run_test "sh -c 'sleep 0.2; echo late' &\necho early\nwait" "early"
+run_test "sh -c 'sleep 0.2; echo late' &\necho early\nwait" "late"
+
+# wait reports the job's status; \$! is its pid
+run_test "sh -c 'exit 3' &\nwait %1\necho status \$?" "status 3"
+run_test "true &\nwait \$!\necho status \$?" "status 0"
+run_test "wait %7\necho status \$?" "status 127"
+
+# Pipelines and redirections work in the background too
+run_test "seq 3 | tail -1 > bg_out.txt &\nwait\ncat bg_out.txt" "3"
+
+# Many concurrent children
+for i in $(seq 500); do echo "sleep 0.5 &"; done > many_jobs.txt
+echo -e "wait\necho all done" >> many_jobs.txt
+run_test "./mysh many_jobs.txt" "all done"
+
+# A command substitution's children do not take a background job's exit
+echo -e "sleep 1 &\nx=\$(sleep 2 | cat)\nwait\necho subst done" > subst_jobs.txt
+run_test "/usr/bin/timeout 10 ./mysh subst_jobs.txt" "subst done"
+
+rm -f output.txt bg_out.txt many_jobs.txt subst_jobs.txt
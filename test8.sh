@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# timeout and ulimit
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" | ./mysh > output.txt
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# A command that overruns is stopped and reported as 124
+run_test "timeout 0.2 sleep 5\necho status \$?" "status 124"
+run_test "timeout 5 echo quick\necho status \$?" "status 0"
+
+# The timeout covers every stage of a pipeline
+run_test "timeout 0.2 sleep 5 | sleep 5\necho status \$?" "status 124"
+
+# -k follows up with SIGKILL when SIGTERM is ignored
+run_test "timeout -k 0.1 0.1 sh -c 'trap \"\" TERM; sleep 5'\necho status \$?" "status 124"
+
+# Limits apply to the commands the shell starts
+run_test "ulimit -n 64\nsh -c 'ulimit -n'" "64"
+run_test "ulimit -f 1\nsh -c 'head -c 5000 /dev/zero > ulimit_out.txt'\nwc -c < ulimit_out.txt" "1024"
+run_test "ulimit -t 1\nsh -c 'while :; do :; done'\necho status \$?" "status 1"
+
+rm -f output.txt ulimit_out.txt
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Per-job accounting and cgroups
+
+run_test() {
+    command=$1
+    expected_part=$2
+    echo -e "$command" | ./mysh > output.txt 2>&1
+    # Check if the expected output is contained within the actual output
+    if grep -q -- "$expected_part" output.txt; then
+        echo "PASS: $command"
+    else
+        actual_output=$(cat output.txt)
+        echo "FAIL: $command. Expected to find '$expected_part', got '$actual_output'"
+    fi
+}
+
+# Every finished job is listed with its command line
+run_test "sleep 0.1\nstats" "rusage sleep 0.1"
+run_test "ls / | wc -l > /dev/null\nstats" " 1 .* ls / | wc -l"
+run_test "sh -c 'while :; do :; done' &\nkill \$!\nwait\nstats" "sh -c while"
+
+# Without a usable cgroup hierarchy jobs still run
+run_test "export MYSH_CGROUP=/nonexistent\necho still runs" "still runs"
+run_test "export MYSH_CGROUP=/nonexistent\necho a\necho b" "b"
+
+# With one, each job is measured over its own group
+cgroup2=$(awk '{ for (i = 7; i < NF; i++) if ($i == "-" && $(i + 1) == "cgroup2") { print $5; exit } }' /proc/self/mountinfo)
+if [ -n "$cgroup2" ] && [ -w "$cgroup2" ]; then
+    run_test "export MYSH_CGROUP=1\nsh -c 'sleep 0.1 & wait'\nstats" "cgroup sh -c"
+    if ls -d "$cgroup2"/mysh-* > /dev/null 2>&1; then
+        echo "FAIL: cgroups left behind in $cgroup2"
+    else
+        echo "PASS: cgroups removed on exit"
+    fi
+fi
+
+rm -f output.txt